@@ -0,0 +1,483 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/stat.h>
+
+/**
+ * seashell benchmark suite
+ *
+ * Drives a seashell binary through a pseudo-terminal, the same way a user
+ * does, and prints one JSON line per benchmark with percentiles so runs
+ * can be compared over time:
+ *
+ *   {"bench":"keystroke_echo","unit":"us","n":500,"p50":..,"p90":..,"p99":..,"max":..,"mean":..}
+ *
+ * Build and run:
+ *   gcc seashell.c -o seashell
+ *   gcc bench.c -o bench -lutil
+ *   ./bench [-s ./seashell] [-n iterations] [-o results.jsonl]
+ */
+
+const char * promptmarker = "seashell$ ";
+
+#define TIMEOUT_MS 20000
+#define OUTSIZE (1 << 20)
+
+struct session {
+	int fd;          // pty master
+	pid_t pid;
+	char out[OUTSIZE];
+	size_t outlen;   // bytes read since the last expect()
+};
+
+struct samples {
+	double *v;
+	int n;
+	int cap;
+};
+
+static char workdir[1024];
+static FILE *results;
+
+static double now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void add_sample(struct samples *s, double v)
+{
+	if (s->n == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 64;
+		s->v = realloc(s->v, sizeof(double) * s->cap);
+	}
+	s->v[s->n++] = v;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(struct samples *s, double p)
+{
+	int i = (int)(p / 100.0 * (s->n - 1) + 0.5);
+	return s->v[i];
+}
+
+/**
+ * Print the percentiles of a benchmark as one JSON line and reset it
+ */
+static void report(const char *bench, const char *unit, struct samples *s)
+{
+	if (s->n == 0)
+		return;
+	qsort(s->v, s->n, sizeof(double), cmp_double);
+	double sum = 0;
+	for (int i = 0; i < s->n; i++)
+		sum += s->v[i];
+	fprintf(results, "{\"bench\":\"%s\",\"unit\":\"%s\",\"n\":%d,\"p50\":%.2f,\"p90\":%.2f,"
+		"\"p99\":%.2f,\"max\":%.2f,\"mean\":%.2f}\n", bench, unit, s->n, percentile(s, 50),
+		percentile(s, 90), percentile(s, 99), s->v[s->n - 1], sum / s->n);
+	fflush(results);
+	s->n = 0;
+}
+
+/**
+ * Read from the shell until the output contains needle
+ * @return 0 when found, -1 on timeout or EOF
+ */
+static int expect(struct session *ss, const char *needle)
+{
+	size_t nlen = strlen(needle);
+	double deadline = now_us() + TIMEOUT_MS * 1000.0;
+	while (1) {
+		if (ss->outlen >= nlen && memmem(ss->out, ss->outlen, needle, nlen)) {
+			ss->outlen = 0;
+			return 0;
+		}
+		int left = (int)((deadline - now_us()) / 1000);
+		if (left <= 0)
+			break;
+		struct pollfd p = { ss->fd, POLLIN, 0 };
+		if (poll(&p, 1, left) <= 0)
+			continue;
+		//keep only the tail when output is large, the needle is at the end
+		if (ss->outlen > OUTSIZE / 2) {
+			memmove(ss->out, ss->out + ss->outlen - nlen, nlen);
+			ss->outlen = nlen;
+		}
+		ssize_t n = read(ss->fd, ss->out + ss->outlen, OUTSIZE - ss->outlen);
+		if (n <= 0)
+			break;
+		ss->outlen += n;
+	}
+	fprintf(stderr, "bench: timed out waiting for \"%s\"\n", needle);
+	return -1;
+}
+
+static void send_str(struct session *ss, const char *s)
+{
+	size_t len = strlen(s);
+	while (len > 0) {
+		ssize_t n = write(ss->fd, s, len);
+		if (n <= 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		s += n;
+		len -= n;
+	}
+}
+
+/**
+ * Start the shell on a pty inside the work directory, with HOME pointing
+ * there too so alias and alarm files don't touch the real ones
+ */
+static int start_shell(struct session *ss, const char *binary)
+{
+	struct winsize ws = { 50, 200, 0, 0 };
+	ss->outlen = 0;
+	ss->pid = forkpty(&ss->fd, NULL, NULL, &ws);
+	if (ss->pid == -1) {
+		perror("forkpty");
+		return -1;
+	}
+	if (ss->pid == 0) {
+		if (chdir(workdir) == -1)
+			_exit(1);
+		setenv("HOME", workdir, 1);
+		unsetenv("SEASHELL_TRACE");
+		execl(binary, binary, (char *)NULL);
+		perror(binary);
+		_exit(127);
+	}
+	return expect(ss, promptmarker);
+}
+
+static void stop_shell(struct session *ss)
+{
+	send_str(ss, "exit\n");
+	waitpid(ss->pid, NULL, 0);
+	close(ss->fd);
+}
+
+/**
+ * Type a line without timing, waiting for its echo
+ */
+static int type_line(struct session *ss, const char *line)
+{
+	for (const char *p = line; *p; p++) {
+		char c[2] = { *p, 0 };
+		send_str(ss, c);
+		if (expect(ss, c) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Time from Enter to the next prompt for a typed command line
+ * @return microseconds, or a negative value on failure
+ */
+static double run_line(struct session *ss, const char *line)
+{
+	if (type_line(ss, line) == -1)
+		return -1;
+	double t0 = now_us();
+	send_str(ss, "\n");
+	if (expect(ss, promptmarker) == -1)
+		return -1;
+	return now_us() - t0;
+}
+
+//BENCHMARKS
+
+static void bench_keystroke(struct session *ss, int iterations)
+{
+	struct samples s = {0};
+	for (int i = 0; i < iterations; i++) {
+		char c[2] = { 'a' + i % 26, 0 };
+		double t0 = now_us();
+		send_str(ss, c);
+		if (expect(ss, c) == -1)
+			break;
+		add_sample(&s, now_us() - t0);
+
+		//backspace redraws the end of the line and clears after it
+		t0 = now_us();
+		send_str(ss, "\x7f");
+		if (expect(ss, "\033[J") == -1)
+			break;
+		add_sample(&s, now_us() - t0);
+	}
+	report("keystroke_echo", "us", &s);
+}
+
+/**
+ * Type a line that matches many history entries one key at a time, each
+ * key looks up a suggestion in the history index
+ */
+static void bench_suggest(struct session *ss, const char *line, int iterations)
+{
+	struct samples s = {0};
+	for (int i = 0; i < iterations; i++) {
+		const char *p;
+		for (p = line; *p; p++) {
+			char c[2] = { *p, 0 };
+			double t0 = now_us();
+			send_str(ss, c);
+			if (expect(ss, c) == -1)
+				break;
+			add_sample(&s, now_us() - t0);
+		}
+		for (; p > line; p--) {
+			send_str(ss, "\x7f");
+			if (expect(ss, "\033[J") == -1)
+				break;
+		}
+		if (p > line)
+			break;
+	}
+	report("keystroke_suggest", "us", &s);
+}
+
+static void bench_line(struct session *ss, const char *bench, const char *line, int iterations)
+{
+	struct samples s = {0};
+	for (int i = 0; i < iterations; i++) {
+		double us = run_line(ss, line);
+		if (us < 0)
+			break;
+		add_sample(&s, us);
+	}
+	report(bench, "us", &s);
+}
+
+/**
+ * Run a script loop and report the time per iteration
+ */
+static void bench_loop(struct session *ss, const char *bench, const char *line, int loops, int iterations)
+{
+	struct samples s = {0};
+	for (int i = 0; i < iterations; i++) {
+		double us = run_line(ss, line);
+		if (us < 0)
+			break;
+		add_sample(&s, us / loops);
+	}
+	report(bench, "us", &s);
+}
+
+/**
+ * Run a command over a generated file and report throughput in MB/s
+ */
+static void bench_throughput(struct session *ss, const char *bench, const char *line, off_t bytes, int iterations)
+{
+	struct samples s = {0};
+	for (int i = 0; i < iterations; i++) {
+		double us = run_line(ss, line);
+		if (us < 0)
+			break;
+		add_sample(&s, bytes / us); // bytes per microsecond is MB/s
+	}
+	report(bench, "MB/s", &s);
+}
+
+//GENERATED INPUT
+
+static const char *words[] = {
+	"alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+	"india", "juliet", "kilo", "lima", "mike", "november", "oscar", "papa",
+};
+
+/**
+ * Write a text file of random words, roughly size bytes. Lines listed in
+ * change get a different last word so kdiff has a few lines to report.
+ * @return the size written
+ */
+static off_t make_text(const char *name, off_t size, unsigned seed, int changeevery)
+{
+	char path[2048];
+	snprintf(path, sizeof(path), "%s/%s", workdir, name);
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	srand(seed);
+	off_t written = 0;
+	int line = 0;
+	while (written < size) {
+		int nw = 8 + rand() % 8;
+		for (int w = 0; w < nw; w++)
+			written += fprintf(f, "%s%s", w ? " " : "", words[rand() % 16]);
+		if (changeevery && ++line % changeevery == 0)
+			written += fprintf(f, " changed");
+		written += fprintf(f, "\n");
+	}
+	fclose(f);
+	return written;
+}
+
+/**
+ * Write a history file of n command lines for the suggestion index
+ */
+static void make_history(int n, unsigned seed)
+{
+	static const char *cmds[] = { "echo", "ls", "cat", "grep", "git", "make", "kdiff", "highlight" };
+	char path[2048];
+	snprintf(path, sizeof(path), "%s/.seashell_history", workdir);
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	srand(seed);
+	for (int i = 0; i < n; i++) {
+		fprintf(f, "%s", cmds[rand() % 8]);
+		int nw = 1 + rand() % 5;
+		for (int w = 0; w < nw; w++)
+			fprintf(f, " %s", words[rand() % 16]);
+		fprintf(f, " %d\n", rand() % 1000);
+	}
+	fclose(f);
+}
+
+/**
+ * Write a script looping n times over a built-in
+ */
+static void make_loop(const char *name, int n)
+{
+	char path[2048];
+	snprintf(path, sizeof(path), "%s/%s", workdir, name);
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fprintf(f, "for i in");
+	for (int i = 1; i <= n; i++)
+		fprintf(f, " %d", i);
+	fprintf(f, "\ndo\n\tif test $i -gt 0; then\n\t\ttrue\n\tfi\ndone\n");
+	fclose(f);
+}
+
+static off_t make_binary(const char *name, off_t size, unsigned seed, off_t insertat)
+{
+	char path[2048];
+	snprintf(path, sizeof(path), "%s/%s", workdir, name);
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	srand(seed);
+	for (off_t i = 0; i < size; i++) {
+		if (i == insertat)
+			fputc('!', f);
+		fputc(rand() & 0xff, f);
+	}
+	fclose(f);
+	return size + (insertat >= 0);
+}
+
+int main(int argc, char **argv)
+{
+	const char *binary = "./seashell";
+	int iterations = 200;
+	results = stdout;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:n:o:")) != -1) {
+		switch (opt) {
+			case 's': binary = optarg; break;
+			case 'n': iterations = atoi(optarg); break;
+			case 'o':
+				results = fopen(optarg, "a");
+				if (results == NULL) {
+					perror(optarg);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-s seashell] [-n iterations] [-o results.jsonl]\n", argv[0]);
+				return 1;
+		}
+	}
+	char abspath[2048];
+	if (strchr(binary, '/') && realpath(binary, abspath))
+		binary = abspath;
+
+	snprintf(workdir, sizeof(workdir), "/tmp/seashell-bench-XXXXXX");
+	if (mkdtemp(workdir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	//8MB text files for highlight and kdiff -a, 8MB binaries for kdiff -b
+	const off_t textsize = 8 << 20;
+	off_t t1 = make_text("a.txt", textsize, 1, 0);
+	make_text("b.txt", textsize, 1, 5000);
+	off_t b1 = make_binary("a.bin", textsize, 2, -1);
+	make_binary("b.bin", textsize, 2, textsize / 2);
+	//100k lines of history, every key typed looks up a suggestion in them
+	make_history(100000, 3);
+	//a compiled loop of 1000 iterations, each running test and true
+	const int loops = 1000;
+	make_loop("loop.sh", loops);
+
+	struct session *ss = malloc(sizeof(struct session));
+	if (start_shell(ss, binary) == -1)
+		return 1;
+
+	bench_keystroke(ss, iterations);
+	bench_suggest(ss, "grep alpha bravo", iterations / 10 > 3 ? iterations / 10 : 3);
+	bench_line(ss, "enter_to_prompt_true", "true", iterations);
+	bench_line(ss, "enter_to_prompt_fork", "/bin/true", iterations);
+	//the envp is rebuilt for a temporary assignment, cached otherwise
+	bench_line(ss, "assign_fork", "X=1 /bin/true", iterations);
+	bench_line(ss, "core_echo", "echo hello", iterations);
+	run_line(ss, "enable -n echo");
+	bench_line(ss, "external_echo", "echo hello", iterations);
+	run_line(ss, "enable echo");
+	bench_loop(ss, "script_loop", "source loop.sh", loops, iterations / 10 > 3 ? iterations / 10 : 3);
+	run_line(ss, "enable -n test true");
+	bench_loop(ss, "script_loop_fork", "source loop.sh", loops, 3);
+	run_line(ss, "enable -a");
+	bench_line(ss, "builtin_history", "history", iterations);
+	bench_line(ss, "subst_builtin", "echo $(pwd)", iterations);
+	bench_line(ss, "subst_external", "echo $(/bin/pwd)", iterations);
+	bench_line(ss, "pipeline_builtins", "history | cat | cat", iterations);
+	run_line(ss, "enable -n cat");
+	bench_line(ss, "pipeline_fork", "history | cat | cat", iterations);
+	run_line(ss, "enable cat");
+	run_line(ss, "shortdir set bench");
+	bench_line(ss, "builtin_shortdir_jump", "shortdir jump bench", iterations);
+	bench_line(ss, "builtin_myfavorite", "myfavorite", iterations);
+
+	int heavy = iterations / 20 > 3 ? iterations / 20 : 3;
+	bench_throughput(ss, "highlight", "highlight zulu r a.txt", t1, heavy);
+	bench_throughput(ss, "kdiff_lines", "kdiff a.txt b.txt", t1, heavy);
+	bench_throughput(ss, "kdiff_blocks", "kdiff -b a.bin b.bin", b1, heavy);
+
+	stop_shell(ss);
+	free(ss);
+
+	char cmd[2048];
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", workdir);
+	if (system(cmd) != 0)
+		fprintf(stderr, "bench: could not remove %s\n", workdir);
+	return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // pipe2, O_CLOEXEC
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdio.h>
@@ -5,9 +6,27 @@
 #include <termios.h>            //termios, TCSANOW, ECHO, ICANON
 #include <string.h>
 #include <stdbool.h>
+#include <ctype.h>
 #include <errno.h>
 #include <strings.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <limits.h>
 const char * sysname = "seashell";
 const char * aliasfile = "/aliases.txt";
 const char * alarmfile = "/alarm.txt";
@@ -30,7 +49,10 @@ struct command_t {
 	bool repeat;
 	int arg_count;
 	char **args;
+	bool *globs; // per argument, an unquoted pattern expanded when the command runs
 	char *redirects[3]; // in/out redirection
+	bool external; // run the program from PATH even if a built-in has the name
+	char *script; // a line with control flow, compiled and run as a script
 	struct command_t *next; // for piping
 };
 
@@ -48,10 +70,171 @@ struct alias {
 	struct alias *prev;
 };
 
+//one record per process of a pipeline, filled from wait4
+struct stage_usage {
+	pid_t pid;
+	char name[64];
+	struct timespec start, end;
+	struct rusage ru;
+	int status;
+	int done;
+	uint64_t spawn; // ns fork or pthread_create took in the shell, 0 if none
+};
+
+#define MAXSTAGES 32
+
+//collected by the time prefix while its command runs
+struct time_report {
+	struct timespec start, end;
+	struct rusage self0, self1; // the shell itself, for built-ins that don't fork
+	struct stage_usage stages[MAXSTAGES];
+	int nstages;
+};
+
+struct time_report *active_time = NULL;
+
+//SESSION STATS, latency histograms per command (see the section at the end)
+uint64_t elapsed_ns(struct timespec since);
+void stats_record(const char *name, struct timespec start, struct timespec end, uint64_t spawn, int code);
+void stats_stages(struct stage_usage *stages, int n);
+void stats_save();
+
+//exit status of the last foreground pipeline
+int last_status = 0;
+
+//TRACING of the shell's own phases, enabled with SEASHELL_TRACE=file.
+//When it is off every span costs one predictable branch.
+int trace_enabled = 0;
+uint64_t trace_now();
+void trace_span(const char *name, uint64_t start, const char *detail);
+#define TRACE_BEGIN() (trace_enabled ? trace_now() : 0)
+#define TRACE_END(name, start, detail) \
+	do { if (trace_enabled) trace_span(name, start, detail); } while (0)
+void trace_spawn_prepare();
+void trace_child(int will_exec);
+void trace_exec_begin();
+void trace_spawn_wait(pid_t pid, const char *name);
+
+//growable byte buffer for captured output
+struct buffer {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+void buffer_append(struct buffer *b, const void *data, size_t len);
+ssize_t buffer_read_fd(struct buffer *b, int fd);
+void write_all(int fd, const char *data, size_t len);
+
+//set by the cache prefix to collect a pipeline's output in memory
+struct capture {
+	struct buffer out, err;
+	int tee;        // also copy output to the terminal as it arrives
+	int ran;        // a pipeline was actually forked
+	int status;     // exit status of the last stage
+	int outonly;    // stderr stays the terminal's, for $(...)
+};
+
+struct capture *active_capture = NULL;
+
+//EVENT LOOP, the shell's single place to wait (see the section at the end)
+typedef void (*event_fn)(int fd, uint32_t events, void *arg);
+typedef void (*child_fn)(pid_t pid, int status, struct rusage *ru, void *arg);
+void loop_init();
+void loop_reset();
+int loop_add(int fd, event_fn fn, void *arg);
+void loop_del(int fd);
+void loop_wait(int timeout);
+void loop_watch_child(pid_t pid, child_fn fn, void *arg);
+void loop_child();
+void loop_subshell();
+void editor_interrupt();
+void editor_message(const char *msg, size_t len);
+void jobs_notify();
+
+int term_cols = 80; // terminal width, kept current by SIGWINCH
+int loop_interrupts = 0; // SIGINTs read, for shell code that Ctrl+C should stop
+
+//ANSI palette of highlight, also used to color the line being typed
+#define COLOR_RED "\e[31m"
+#define COLOR_GREEN "\e[32m"
+#define COLOR_BLUE "\e[34m"
+#define COLOR_BOLD "\e[1m"
+#define COLOR_RESET "\033[0m"
+#define COLOR_GHOST "\e[90m"   // suggested rest of the line
+
+//HISTORY INDEX of every line entered, for suggestions while typing
+void hist_index_load();
+void hist_index_record(const char *line);
+const char *hist_index_suggest(const char *prefix, int len);
+int hist_index_count();
+int hist_expand(const char *line, char *out, size_t size);
+
+//PATH CACHE of executable names, for coloring commands as they are typed
+void path_cache_refresh();
+int path_cache_has(const char *name);
+
 typedef struct hist history;
 
 typedef struct alias shortdir;
 
+int glob_expand(const char *pattern, char ***matches);
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+//what a built-in reads and writes, and the shell state it may use
+struct builtin_ctx {
+	int in;         // stdin of the command
+	FILE *out;
+	FILE *err;
+	history *h;
+	shortdir *shortdirs; // NULL outside the shell process
+	volatile int *cancel; // set on Ctrl+C for a built-in on a pipeline thread, else NULL
+};
+
+//a built-in on a pipeline thread checks this in its long loops
+static int builtin_cancelled(struct builtin_ctx *ctx)
+{
+	return ctx->cancel && *ctx->cancel;
+}
+
+enum builtin_flags {
+	BUILTIN_SHELL = 1,   // changes the shell's state, always runs in the shell
+	BUILTIN_FORK = 2,    // not safe on a thread, always runs in a forked child
+	BUILTIN_UTILITY = 4, // stands in for the program of the same name in PATH
+	BUILTIN_LOOP = 8,    // waits on the event loop, so a pipeline stage is forked
+	BUILTIN_LONG = 16,   // may run long or block on its input, forked when alone
+};
+
+//returned by a built-in, before it wrote anything, to hand the command
+//over to the program in PATH
+#define BUILTIN_EXTERNAL -1
+
+//Without BUILTIN_SHELL or BUILTIN_FORK a built-in runs in the shell when
+//it is alone on the line and on a thread of the shell inside a pipeline,
+//so it must only write through ctx and never exit. The shell doesn't
+//read Ctrl+C while a built-in runs in it, so one that can take long
+//has BUILTIN_LONG and is forked instead when it is alone.
+struct builtin {
+	const char *name;
+	int (*fn)(struct command_t *command, struct builtin_ctx *ctx);
+	int flags;
+	bool disabled; // by enable -n, the external program is used instead
+};
+
+extern struct builtin builtins[];
+struct builtin *find_builtin(const char *name);
+
+//SCRIPTS, control flow compiled to bytecode (see the section at the end)
+int script_needed(const char *line);
+int script_incomplete(const char *src);
+int script_line(const char *line, history *h, shortdir *shortdirs);
+int script_file(const char *path, char **argv, int argc, history *h, shortdir *shortdirs);
+void var_init();
+int var_assignment(const char *word);
+const char *var_lookup(const char *name);
+char **var_environ();
+int assign_command(struct command_t *command, history *h, shortdir *shortdirs);
+
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -90,6 +273,8 @@ int free_command(struct command_t *command)
 			free(command->args[i]);
 		free(command->args);
 	}
+	free(command->globs);
+	free(command->script);
 	for (int i=0;i<3;++i)
 		if (command->redirects[i])
 			free(command->redirects[i]);
@@ -104,15 +289,14 @@ int free_command(struct command_t *command)
 }
 /**
  * Show the command prompt
- * @return [description]
+ * @return the number of characters printed
  */
 int show_prompt()
 {
 	char cwd[1024], hostname[1024];
     gethostname(hostname, sizeof(hostname));
 	getcwd(cwd, sizeof(cwd));
-	printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
-	return 0;
+	return printf("%s@%s:%s %s$ ", var_lookup("USER"), hostname, cwd, sysname);
 }
 /**
  * Parse a command string into a command struct
@@ -133,19 +317,11 @@ int parse_command(char *buf, struct command_t *command)
 	while (len>0 && strchr(splitters, buf[len-1])!=NULL)
 		buf[--len]=0; // trim right whitespace
 
-	if (len>0 && buf[len-1]=='?') // auto-complete
-		command->auto_complete=true;
 	if (len>0 && buf[len-1]=='&') // background
 		command->background=true;
-	if (len>0 && buf[len-1]=='!' && buf[len-2]=='!') // history
-		command->repeat=true;
 
 	char *pch = strtok(buf, splitters);
-	command->name=(char *)malloc(strlen(pch)+1);
-	if (pch==NULL)
-		command->name[0]=0;
-	else
-		strcpy(command->name, pch);
+	command->name=strdup(pch ? pch : "");
 
 	command->args=(char **)malloc(sizeof(char *));
 
@@ -176,6 +352,7 @@ int parse_command(char *buf, struct command_t *command)
 		if (strcmp(arg, "|")==0)
 		{
 			struct command_t *c=malloc(sizeof(struct command_t));
+			memset(c, 0, sizeof(struct command_t));
 			int l=strlen(pch);
 			pch[l]=splitters[0]; // restore strtok termination
 			index=1;
@@ -207,31 +384,642 @@ int parse_command(char *buf, struct command_t *command)
 		}
 		if (redirect_index != -1)
 		{
-			command->redirects[redirect_index]=malloc(len);
-			strcpy(command->redirects[redirect_index], arg+1);
+			char *target=arg+1;
+			if (*target==0) // "> file", the name is the next token
+			{
+				pch = strtok(NULL, splitters);
+				if (!pch) break;
+				target=pch;
+			}
+			if (command->redirects[redirect_index])
+				free(command->redirects[redirect_index]);
+			command->redirects[redirect_index]=strdup(target);
 			continue;
 		}
 
 		// normal arguments
+		int quoted=0;
 		if (len>2 && ((arg[0]=='"' && arg[len-1]=='"')
 			|| (arg[0]=='\'' && arg[len-1]=='\''))) // quote wrapped arg
 		{
 			arg[--len]=0;
 			arg++;
+			quoted=1;
 		}
+
 		command->args=(char **)realloc(command->args, sizeof(char *)*(arg_index+1));
+		command->globs=(bool *)realloc(command->globs, sizeof(bool)*(arg_index+1));
+		// pathname expansion happens when the command runs, see expand_patterns
+		command->globs[arg_index]=!quoted && strpbrk(arg, "*?[")!=NULL;
 		command->args[arg_index]=(char *)malloc(len+1);
 		strcpy(command->args[arg_index++], arg);
 	}
 	command->arg_count=arg_index;
 	return 0;
 }
-void prompt_backspace()
+//PARSE CACHE
+//Lines typed again, rerun with !! or the up arrow or looped over in a
+//script are parsed once. The parsed commands are kept unchanged, keyed
+//by the xxh64 of the line, and each run gets its own copy since running
+//rewrites the arguments. Bounded, the least recently used line goes.
+//Indexes in the links are stored plus one, so 0 means none.
+
+#define PARSECACHE_SIZE 256
+#define PARSECACHE_BUCKETS 512
+
+struct parsed_line {
+	uint64_t hash;
+	char *line;
+	struct command_t *command;
+	int chain;          // next in the bucket
+	int newer, older;
+};
+
+static struct {
+	struct parsed_line entries[PARSECACHE_SIZE];
+	int used;
+	int buckets[PARSECACHE_BUCKETS];
+	int newest, oldest;
+} parsecache;
+
+long parse_hits, parse_misses;
+
+/**
+ * Deep copy of a parsed command and the stages piped after it
+ * @param dst zeroed command to fill
+ * @param src
+ */
+static void command_copy(struct command_t *dst, const struct command_t *src)
+{
+	*dst=*src;
+	dst->name=strdup(src->name);
+	dst->args=(char **)malloc(sizeof(char *)*(src->arg_count ? src->arg_count : 1));
+	for (int i=0;i<src->arg_count;i++)
+		dst->args[i]=strdup(src->args[i]);
+	if (src->globs)
+	{
+		dst->globs=(bool *)malloc(sizeof(bool)*src->arg_count);
+		memcpy(dst->globs, src->globs, sizeof(bool)*src->arg_count);
+	}
+	for (int i=0;i<3;i++)
+		if (src->redirects[i])
+			dst->redirects[i]=strdup(src->redirects[i]);
+	if (src->script)
+		dst->script=strdup(src->script);
+	if (src->next)
+	{
+		dst->next=malloc(sizeof(struct command_t));
+		command_copy(dst->next, src->next);
+	}
+}
+
+static void parse_cache_unlink(int k)
+{
+	struct parsed_line *e=&parsecache.entries[k];
+	if (e->newer)
+		parsecache.entries[e->newer-1].older=e->older;
+	else
+		parsecache.newest=e->older;
+	if (e->older)
+		parsecache.entries[e->older-1].newer=e->newer;
+	else
+		parsecache.oldest=e->newer;
+}
+
+static void parse_cache_push(int k)
+{
+	struct parsed_line *e=&parsecache.entries[k];
+	e->newer=0;
+	e->older=parsecache.newest;
+	if (parsecache.newest)
+		parsecache.entries[parsecache.newest-1].newer=k+1;
+	parsecache.newest=k+1;
+	if (!parsecache.oldest)
+		parsecache.oldest=k+1;
+}
+
+/**
+ * Parse a line through the cache
+ * @param  line    null terminated, not modified
+ * @param  command zeroed command to fill with a copy of the parse
+ * @return         1 on a hit, 0 when the line was parsed
+ */
+int parse_cached(const char *line, struct command_t *command)
+{
+	uint64_t hash=xxh64(line, strlen(line), 0);
+	int *bucket=&parsecache.buckets[hash % PARSECACHE_BUCKETS];
+	for (int i=*bucket; i; i=parsecache.entries[i-1].chain)
+	{
+		struct parsed_line *e=&parsecache.entries[i-1];
+		if (e->hash==hash && strcmp(e->line, line)==0)
+		{
+			parse_hits++;
+			parse_cache_unlink(i-1);
+			parse_cache_push(i-1);
+			command_copy(command, e->command);
+			return 1;
+		}
+	}
+	parse_misses++;
+
+	int k;
+	if (parsecache.used<PARSECACHE_SIZE)
+		k=parsecache.used++;
+	else
+	{
+		//drop the least recently used line from its bucket and the list
+		k=parsecache.oldest-1;
+		struct parsed_line *e=&parsecache.entries[k];
+		int *link=&parsecache.buckets[e->hash % PARSECACHE_BUCKETS];
+		while (*link!=k+1)
+			link=&parsecache.entries[*link-1].chain;
+		*link=e->chain;
+		parse_cache_unlink(k);
+		free_command(e->command);
+		free(e->line);
+	}
+	struct parsed_line *e=&parsecache.entries[k];
+	e->hash=hash;
+	e->line=strdup(line);
+	e->command=malloc(sizeof(struct command_t));
+	memset(e->command, 0, sizeof(struct command_t));
+	char *copy=strdup(line); // parse_command cuts up its buffer
+	parse_command(copy, e->command);
+	free(copy);
+	e->chain=*bucket;
+	*bucket=k+1;
+	parse_cache_push(k);
+	command_copy(command, e->command);
+	return 0;
+}
+
+//LINE EDITOR
+//Keys arrive one at a time from the event loop, so the editor keeps its
+//state between keys instead of looping in getchar, and the shell can
+//handle signals, timers and job notices while a line is being typed.
+//
+//The line is colored as it is typed. It is kept as a list of tokens,
+//each with the lexer state at its start, so a key only re-lexes from
+//the token it touched and only the part of the screen that changed is
+//redrawn, with a single write per key.
+
+enum token_class {
+	TOK_SPACE,
+	TOK_ARG,
+	TOK_COMMAND,    // found in PATH
+	TOK_BUILTIN,
+	TOK_UNKNOWN,    // in command position but not found
+	TOK_STRING,
+	TOK_REDIRECT,
+	TOK_OPERATOR,   // | and &
+};
+
+//indexed by enum token_class, the palette highlight uses
+static const char *token_colors[] = {
+	"", "", COLOR_GREEN, COLOR_GREEN COLOR_BOLD, COLOR_RED, COLOR_BLUE, COLOR_BOLD, COLOR_BOLD,
+};
+
+struct token {
+	short start, len;
+	char cls;
+	char cmdpos;    // lexer state at the start: a command name is expected
+	char target;    // lexer state at the start: a redirection target is expected
+};
+
+struct line_editor {
+	char buf[BUFFERSIZE];
+	int index;
+	int multicode_state;
+	int active;     // a prompt is shown and keys go to buf
+	int done;       // 1 when the line is complete, -1 at end of input
+	char last[BUFFERSIZE]; // previous line, for the up arrow
+	struct token toks[BUFFERSIZE];
+	int ntoks;
+	int promptlen;  // columns taken by the prompt
+	int shown;      // characters of buf on screen, the cursor is after them
+	int continuation; // reading more lines of an open compound command
+	const char *suggestion; // history line completing buf, NULL for none
+	int ghost;      // characters of the suggestion on screen after buf
+	struct buffer out; // what the current key writes
+};
+
+static struct line_editor editor;
+
+static int token_is_builtin(const char *word, int len)
+{
+	char name[64];
+	if (len >= (int)sizeof(name))
+		return 0;
+	memcpy(name, word, len);
+	name[len] = 0;
+	//prefixes, keywords and words handled before the built-in table
+	static const char *words[] = { "time", "cache", "watch", "exit", "source", ".", "if", "then", "elif",
+		"else", "fi", "while", "until", "do", "done", "for", "function", "break", "continue",
+		"return", "!", "}", NULL };
+	for (int i = 0; words[i]; i++)
+		if (strcmp(name, words[i]) == 0)
+			return 1;
+	return find_builtin(name) != NULL;
+}
+
+//prefixes and keywords followed by a command
+static int token_takes_command(const char *word, int len)
+{
+	static const char *words[] = { "time", "cache", "watch", "if", "then", "elif", "else", "while", "until", "do", "!", NULL };
+	for (int i = 0; words[i]; i++)
+		if ((int)strlen(words[i]) == len && memcmp(word, words[i], len) == 0)
+			return 1;
+	return 0;
+}
+
+static int token_classify_command(const char *word, int len)
+{
+	if (token_is_builtin(word, len))
+		return TOK_BUILTIN;
+	char name[BUFFERSIZE];
+	memcpy(name, word, len);
+	name[len] = 0;
+	if (memchr(word, '/', len))
+		return access(name, X_OK) == 0 ? TOK_COMMAND : TOK_UNKNOWN;
+	return path_cache_has(name) ? TOK_COMMAND : TOK_UNKNOWN;
+}
+
+/**
+ * Lex buf from token k to the end, with k's saved state. Words are split
+ * at whitespace outside quotes, as parse_command does, so "a|b" is one
+ * word. A ';' outside quotes also ends the word and the command, as it
+ * does in scripts, and an unclosed quote runs to the end of the line.
+ */
+static void editor_lex(int k)
+{
+	int p = k < editor.ntoks ? editor.toks[k].start : 0;
+	int cmdpos = k < editor.ntoks ? editor.toks[k].cmdpos : 1;
+	int target = k < editor.ntoks ? editor.toks[k].target : 0;
+	editor.ntoks = k;
+	const char *b = editor.buf;
+	while (p < editor.index) {
+		struct token *t = &editor.toks[editor.ntoks++];
+		t->start = p;
+		t->cmdpos = cmdpos;
+		t->target = target;
+		if (b[p] == ' ' || b[p] == '\t') {
+			while (p < editor.index && (b[p] == ' ' || b[p] == '\t'))
+				p++;
+			t->cls = TOK_SPACE;
+			t->len = p - t->start;
+			continue;
+		}
+		char quote = 0;
+		int semi = 0;
+		while (p < editor.index && (quote || (b[p] != ' ' && b[p] != '\t'))) {
+			char c = b[p++];
+			if (c == '\\' && quote != '\'' && p < editor.index)
+				p++;
+			else if (quote == 0 && (c == '\'' || c == '"'))
+				quote = c;
+			else if (c == quote)
+				quote = 0;
+			else if (quote == 0 && c == ';') {
+				semi = 1;
+				break;
+			}
+		}
+		t->len = p - t->start;
+		const char *w = b + t->start;
+
+		if (target) {
+			t->cls = TOK_REDIRECT;
+			target = 0;
+		}
+		else if ((t->len == 1 && (w[0] == '|' || w[0] == '&' || w[0] == ';'))
+			|| (t->len == 2 && (memcmp(w, "&&", 2) == 0 || memcmp(w, "||", 2) == 0))) {
+			t->cls = TOK_OPERATOR;
+			cmdpos = w[0] == '|' || t->len == 2;
+		}
+		else if (w[0] == '<' || w[0] == '>') {
+			t->cls = TOK_REDIRECT;
+			// "> file" takes the next word as the target
+			target = t->len == 1 || (t->len == 2 && w[1] == '>');
+		}
+		else if (w[0] == '"' || w[0] == '\'')
+			t->cls = TOK_STRING;
+		else if ((w[0] == '$' && t->len > 2 && w[1] == '(') || (w[0] == '`' && t->len > 1)) {
+			//"$(cmd" or "`cmd", colored by the command it starts with
+			int open = w[0] == '`' ? 1 : 2;
+			int len = t->len - open - (w[t->len - 1] == ')' || w[t->len - 1] == '`');
+			t->cls = len > 0 ? token_classify_command(w + open, len) : TOK_ARG;
+		}
+		else if (cmdpos && var_assignment(w))
+			t->cls = TOK_ARG; // name=value, the command is still to come
+		else if (cmdpos) {
+			int len = t->len - semi;
+			t->cls = token_classify_command(w, len);
+			cmdpos = token_takes_command(w, len);
+		}
+		else
+			t->cls = TOK_ARG;
+		if (semi) // "a;" ends the command
+			cmdpos = 1;
+	}
+}
+
+/**
+ * Move the cursor between two offsets of the line, counted from the
+ * start of the prompt, across wrapped rows
+ */
+static void editor_move(int from, int to)
+{
+	int cols = term_cols > 0 ? term_cols : 80;
+	char seq[32];
+	if (from == to)
+		return;
+	int up = from / cols - to / cols;
+	if (up > 0)
+		buffer_append(&editor.out, seq, snprintf(seq, sizeof(seq), "\033[%dA", up));
+	else if (up < 0)
+		buffer_append(&editor.out, seq, snprintf(seq, sizeof(seq), "\033[%dB", -up));
+	buffer_append(&editor.out, "\r", 1);
+	if (to % cols)
+		buffer_append(&editor.out, seq, snprintf(seq, sizeof(seq), "\033[%dC", to % cols));
+}
+
+/**
+ * Redraw the line from position from to the end, then write out
+ * everything the key produced at once
+ */
+static void editor_draw(int from)
+{
+	int old = editor.shown;
+	if (from < editor.shown) {
+		editor_move(editor.promptlen + editor.shown, editor.promptlen + from);
+		editor.shown = from;
+	}
+	//only the tokens past what is on screen, found from the end
+	int k = editor.ntoks;
+	while (k > 0 && editor.toks[k - 1].start + editor.toks[k - 1].len > editor.shown)
+		k--;
+	for (; k < editor.ntoks; k++) {
+		struct token *t = &editor.toks[k];
+		int end = t->start + t->len;
+		int s = t->start > editor.shown ? t->start : editor.shown;
+		const char *color = token_colors[(int)t->cls];
+		buffer_append(&editor.out, color, strlen(color));
+		buffer_append(&editor.out, editor.buf + s, end - s);
+		if (color[0])
+			buffer_append(&editor.out, COLOR_RESET, strlen(COLOR_RESET));
+	}
+	if (from < old || editor.ghost)
+		buffer_append(&editor.out, "\033[J", 3); // drop what was deleted
+	editor.shown = editor.index;
+	editor.ghost = 0;
+
+	//a line ending exactly at the margin leaves the cursor waiting to
+	//wrap, move it to the next row so the position math stays right
+	int cols = term_cols > 0 ? term_cols : 80;
+	if (editor.index > 0 && (editor.promptlen + editor.index) % cols == 0)
+		buffer_append(&editor.out, "\n\r", 2);
+}
+
+/**
+ * Show the rest of the suggested history line dimmed after the cursor,
+ * which stays where typing continues
+ */
+static void editor_suggest()
+{
+	editor.suggestion = hist_index_suggest(editor.buf, editor.index);
+	if (editor.suggestion == NULL)
+		return;
+	int start = editor.promptlen + editor.index;
+	int len = strlen(editor.suggestion + editor.index);
+	//stop short of the margin, see the end of editor_draw
+	int cols = term_cols > 0 ? term_cols : 80;
+	if ((start + len) % cols == 0)
+		len--;
+	if (len <= 0)
+		return;
+	buffer_append(&editor.out, COLOR_GHOST, strlen(COLOR_GHOST));
+	buffer_append(&editor.out, editor.suggestion + editor.index, len);
+	buffer_append(&editor.out, COLOR_RESET, strlen(COLOR_RESET));
+	editor_move(start + len, start);
+	editor.ghost = len;
+}
+
+/**
+ * Re-lex and redraw after buf changed from position pos on
+ */
+static void editor_refresh(int pos)
+{
+	//the token holding the character before the change may merge or
+	//split, everything before it is untouched
+	int k = editor.ntoks - 1;
+	while (k > 0 && editor.toks[k].start >= pos)
+		k--;
+	if (k < 0)
+		k = 0;
+	int oldcls = k < editor.ntoks ? editor.toks[k].cls : -1;
+	int oldstart = k < editor.ntoks ? editor.toks[k].start : -1;
+	editor_lex(k);
+
+	//if the token kept its color only the changed characters are redrawn
+	int from = pos;
+	if (k < editor.ntoks && (editor.toks[k].cls != oldcls || editor.toks[k].start != oldstart))
+		from = editor.toks[k].start;
+	editor_draw(from);
+	editor_suggest();
+}
+
+static void editor_flush()
+{
+	fflush(stdout);
+	write_all(STDOUT_FILENO, editor.out.data, editor.out.len);
+	editor.out.len = 0;
+}
+
+/**
+ * Apply one key to the line being edited
+ */
+static void editor_key(unsigned char c)
+{
+	//printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+
+	if (c==9) // handle tab
+	{
+		// autocomplete isn't implemented, tab used to submit the line
+		// with a '?' appended which then broke the last argument
+		return;
+	}
+
+	if (c==127) // handle backspace
+	{
+		if (editor.index>0)
+		{
+			editor.index--;
+			editor_refresh(editor.index);
+		}
+		return;
+	}
+
+	if (c==27 && editor.multicode_state==0) // (UP) handle multi-code keys
+	{
+		editor.multicode_state=1;
+		return;
+	}
+
+	if (c==91 && editor.multicode_state==1) // ( ) )  ?
+	{
+		editor.multicode_state=2;
+		return;
+	}
+
+	if (c==65 && editor.multicode_state==2) // unechoed A
+	{
+		int i;
+		for (i=0;editor.last[i];++i)
+			editor.buf[i]=editor.last[i];
+		editor.index=i;
+		editor.multicode_state=0;
+		editor.ntoks=0;
+		editor_refresh(0);
+		return;
+	}
+	else if (c==67 && editor.multicode_state==2) // right arrow takes the suggestion
+	{
+		editor.multicode_state=0;
+		if (editor.suggestion)
+		{
+			int pos=editor.index;
+			editor.index=strlen(editor.suggestion);
+			memcpy(editor.buf, editor.suggestion, editor.index);
+			editor_refresh(pos);
+		}
+		return;
+	}
+	else
+		editor.multicode_state=0;
+
+	if (c=='\n') // enter key
+	{
+		if (editor.ghost)
+			buffer_append(&editor.out, "\033[J", 3);
+		buffer_append(&editor.out, "\n", 1);
+		editor.buf[editor.index++]=c;
+		editor.done=1;
+		return;
+	}
+	if (c==4) // Ctrl+D
+	{
+		editor.done=-1;
+		return;
+	}
+
+	editor.buf[editor.index++]=c;
+	editor_refresh(editor.index-1);
+	if (editor.index>=sizeof(editor.buf)-1)
+		editor.done=1;
+}
+
+/**
+ * Event loop handler for the terminal. One byte is read at a time so
+ * typeahead after the line stays for the command that runs next.
+ */
+static void editor_input(int fd, uint32_t events, void *arg)
+{
+	unsigned char c;
+	if (editor.done) // finished in the same wakeup, the key is for the next line
+		return;
+	ssize_t n=read(fd, &c, 1);
+	if (n==-1 && (errno==EINTR || errno==EAGAIN))
+		return;
+	if (n<=0)
+	{
+		editor.done=-1;
+		return;
+	}
+	editor_key(c);
+	editor_flush();
+}
+
+/**
+ * Show the prompt for a new, empty line
+ */
+static void editor_start()
+{
+	editor.promptlen=editor.continuation ? printf("> ") : show_prompt();
+	editor.index=0;
+	editor.shown=0;
+	editor.ntoks=0;
+	editor.multicode_state=0;
+	editor.suggestion=NULL;
+	editor.ghost=0;
+}
+
+/**
+ * Ctrl+C at the prompt drops the line and starts a new one
+ */
+void editor_interrupt()
+{
+	if (!editor.active)
+		return;
+	if (editor.ghost)
+		printf("\033[J");
+	printf("^C\n");
+	if (editor.continuation)
+	{
+		editor.done=-2;
+		return;
+	}
+	editor_start();
+}
+
+/**
+ * Print a message above the line being edited and redraw the line
+ */
+void editor_message(const char *msg, size_t len)
+{
+	fflush(stdout);
+	if (!editor.active)
+	{
+		write_all(STDOUT_FILENO, msg, len);
+		return;
+	}
+	printf("\n");
+	fflush(stdout);
+	write_all(STDOUT_FILENO, msg, len);
+	editor.promptlen=editor.continuation ? printf("> ") : show_prompt();
+	editor.shown=0;
+	editor.ghost=0;
+	editor_draw(0);
+	editor_suggest();
+	editor_flush();
+}
+
+/**
+ * Read a line with the editor while the event loop runs. The terminal is
+ * only watched meanwhile, a command running in the foreground owns it
+ * otherwise.
+ * @return 1 with the line in editor.buf, -1 at end of input, -2 when
+ *         Ctrl+C dropped a continued command
+ */
+static int editor_read()
 {
-	putchar(8); // go back 1
-	putchar(' '); // write empty over
-	putchar(8); // go back 1 again
+	editor_start();
+	editor.done=0;
+	editor.active=1;
+	loop_add(STDIN_FILENO, editor_input, NULL);
+	while (!editor.done)
+		loop_wait(-1);
+	loop_del(STDIN_FILENO);
+	editor.active=0;
+	if (editor.done==1)
+	{
+		int index=editor.index;
+		if (index>0 && editor.buf[index-1]=='\n') // trim newline from the end
+			index--;
+		editor.buf[index]=0;
+	}
+	return editor.done;
 }
+
 /**
  * Prompt a command from the user
  * @param  buf      [description]
@@ -240,13 +1028,6 @@ void prompt_backspace()
  */
 int prompt(struct command_t *command, history *h)
 {
-	int index=0;
-	char c;
-	char buf[4096];
-	static char oldbuf[4096];
-
-	//static char history[5][4096];
-
     // tcgetattr gets the parameters of the current terminal
     // STDIN_FILENO will tell tcgetattr that it should write the settings
     // of stdin to oldt
@@ -262,90 +1043,103 @@ int prompt(struct command_t *command, history *h)
 
 
     //FIXME: backspace is applied before printing chars
-	show_prompt();
-	int multicode_state=0;
-	buf[0]=0;
-  	while (1)
-  	{
-		c=getchar();
-		//printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
-
-		if (c==9) // handle tab
-		{
-			buf[index++]='?'; // autocomplete
-			break;
-		}
-
-		if (c==127) // handle backspace
-		{
-			if (index>0)
-			{
-				prompt_backspace();
-				index--;
-			}
-			continue;
-		}
+	uint64_t trace_start=TRACE_BEGIN();
+	jobs_notify();
+	path_cache_refresh();
+	editor.continuation=0;
+	if (editor_read()==-1)
+	{
+		tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+		return EXIT;
+	}
 
-		if (c==27 && multicode_state==0) // (UP) handle multi-code keys
-		{
-			multicode_state=1;
-			continue;
-		}
+	char *buf=editor.buf;
+  	TRACE_END("prompt", trace_start, NULL);
 
-		if (c==91 && multicode_state==1) // ( ) )  ?
-		{
-			multicode_state=2;
-			continue;
-		}
+	//!! !n !prefix ^old^new and the like, the expanded line is echoed
+	//and is what goes to the history
+	char expanded[BUFFERSIZE];
+	int repeat=hist_expand(buf, expanded, sizeof(expanded));
+	if (repeat==-1)
+		buf[0]=0;
+	else if (repeat==1)
+	{
+		strcpy(buf, expanded);
+		printf("%s\n", buf);
+	}
 
-		if (c==65 && multicode_state==2) // unechoed A
+	//an if, while, for or function left open continues on the next
+	//lines, the history gets them joined by ;
+	char src[BUFFERSIZE], joined[BUFFERSIZE];
+	strcpy(src, buf);
+	int script=script_needed(buf);
+	if (script && script_incomplete(src))
+	{
+		strcpy(joined, buf);
+		editor.continuation=1;
+		while (1)
 		{
-			int i;
-			while (index>0)
+			int done=editor_read();
+			if (done==-1)
+			{
+				tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+				return EXIT;
+			}
+			if (done==-2) // Ctrl+C drops the whole command
 			{
-				prompt_backspace();
-				index--;
+				joined[0]=src[0]=0;
+				break;
 			}
-			for (i=0;oldbuf[i];++i)
+			if (strlen(joined)+strlen(buf)+3>BUFFERSIZE)
 			{
-				putchar(oldbuf[i]);
-				buf[i]=oldbuf[i];
+				printf("E: command too long\n");
+				joined[0]=src[0]=0;
+				break;
 			}
-			index=i;
-			continue;
+			strcat(src, "\n");
+			strcat(src, buf);
+			strcat(joined, "; ");
+			strcat(joined, buf);
+			if (!script_incomplete(src))
+				break;
 		}
-		else
-			multicode_state=0;
-
-		putchar(c); // echo the character
-		buf[index++]=c;
-		if (index>=sizeof(buf)-1) break;
-		if (c=='\n') // enter key
-			break;
-		if (c==4) // Ctrl+D
-			return EXIT;
-  	}
-  	if (index>0 && buf[index-1]=='\n') // trim newline from the end
-  		index--;
-  	buf[index++]=0; // null terminate string
-
-  	//Push stack!
-  	int ih = HISTORYSIZE-2;
-  	for(;ih>=0;ih--){
-  		strcpy(h->commands[ih+1], h->commands[ih]);
-  	}
-
-  	//FIXME: Consider unifying oldbuf and history?
-  	strcpy(oldbuf, buf);
-  	strcpy(h->commands[0], buf);
+		strcpy(buf, joined);
+	}
 
-  	//Update length
-  	//printf("LENGTH WAS: %d\n", h->length);
-  	//FIXED OVERFLOW INTO h->length
-	h->length = ( (h->length) < HISTORYSIZE ) ? (h->length+1) : HISTORYSIZE;
-	//printf("LENTH IS NOW: %d\n", h->length);
+	//blank lines are left out so history numbers match the index's
+	if (buf[strspn(buf, " \t")])
+	{
+	  	//Push stack!
+	  	int ih = HISTORYSIZE-2;
+	  	for(;ih>=0;ih--){
+	  		strcpy(h->commands[ih+1], h->commands[ih]);
+	  	}
+
+	  	//FIXME: Consider unifying editor.last and history?
+	  	strcpy(editor.last, buf);
+	  	strcpy(h->commands[0], buf);
+	  	hist_index_record(buf);
+
+	  	//Update length
+	  	//printf("LENGTH WAS: %d\n", h->length);
+	  	//FIXED OVERFLOW INTO h->length
+		h->length = ( (h->length) < HISTORYSIZE ) ? (h->length+1) : HISTORYSIZE;
+		//printf("LENTH IS NOW: %d\n", h->length);
+	}
 
-  	parse_command(buf, command);
+	if (script && src[0])
+	{
+		//compiled and run by process_command
+		command->name=strdup("");
+		command->script=strdup(src);
+	}
+	else
+	{
+	  	trace_start=TRACE_BEGIN();
+	  	int hit=parse_cached(buf, command);
+	  	TRACE_END("parse_command", trace_start, hit ? "hit" : "miss");
+	}
+  	command->repeat=repeat==1;
 
   	//print_command(command); // DEBUG: uncomment for debugging
 
@@ -355,11 +1149,36 @@ int prompt(struct command_t *command, history *h)
 }
 //PROTOTYPES
 int process_command(struct command_t *command, history *h, shortdir *shortdirs);
+int exec_command(struct command_t *command, history *h, const char *exe);
+int run_builtin(struct builtin *b, struct command_t *command, history *h, shortdir *shortdirs);
+int resolve_path(const char *name, char *out, size_t size);
+void trace_init();
+void trace_dump();
+int status_code(int status);
+int cache_command(struct command_t *command, history *h, shortdir *shortdirs);
+int source_command(struct command_t *command, history *h, shortdir *shortdirs);
+int watch_command(struct command_t *command, history *h, shortdir *shortdirs);
+int stats_command(struct command_t *command, struct builtin_ctx *ctx);
+int export_command(struct command_t *command, struct builtin_ctx *ctx);
+int unset_command(struct command_t *command, struct builtin_ctx *ctx);
+void prepare_args(struct command_t *command);
+void expand_patterns(struct command_t *command);
+int run_pipeline(struct command_t *command, history *h);
+int time_command(struct command_t *command, history *h, shortdir *shortdirs);
+void time_record(struct time_report *rep, struct stage_usage *stages, int n);
 int save_aliases(shortdir *shortdirs);
 void load_aliases(shortdir *shortdirs);
+int has_extension(const char *filename, const char *ext);
+int kdiff_directories(struct builtin_ctx *ctx, const char *dir1, const char *dir2);
+int kdiff_blocks(struct builtin_ctx *ctx, const char *file1, const char *file2);
+void scheduler_init(history *h, shortdir *shortdirs);
+void scheduler_start();
 
-int main()
+int main(int argc, char **argv)
 {
+	var_init();
+	trace_init();
+
 	//INIT HISTORY
 	history *h=malloc(sizeof(history));
 	memset(h, 0, sizeof(history));
@@ -368,6 +1187,24 @@ int main()
 	shortdir *shortdirs=malloc(sizeof(shortdir)); //shortdirs <- list of shortdirs
 	memset(shortdirs, 0, sizeof(shortdir));
 	load_aliases(shortdirs);
+
+	//INIT EVENT LOOP, before anything forks
+	loop_init();
+
+	//INIT SCHEDULER
+	scheduler_init(h, shortdirs);
+
+	//RUN A SCRIPT, ./seashell file [args]
+	if (argc>1)
+	{
+		int status=script_file(argv[1], argv+1, argc-1, h, shortdirs);
+		save_aliases(shortdirs);
+		trace_dump();
+		stats_save();
+		return status;
+	}
+	hist_index_load();
+	scheduler_start();
 	//atexit(save_aliases(shortdirs));
 	//buggy because of forks exitting!
 
@@ -389,705 +1226,1319 @@ int main()
 		free_command(command);
 
 		//SAVE SESSION
+		uint64_t trace_start=TRACE_BEGIN();
 		save_aliases(shortdirs);
+		TRACE_END("save_aliases", trace_start, NULL);
 	}
 	//SAVE ALIASES
 	save_aliases(shortdirs);
+	trace_dump();
+	stats_save();
 	printf("\n");
 	return 0;
 }
 
 int process_command(struct command_t *command, history *h, shortdir *shortdirs)
 {
-	char cwd[1024];
+	if (command->script)
+		return script_line(command->script, h, shortdirs);
 
-	//CHECK FOR REPEATS BEFORE FORKING
-	if(command->repeat){
+	//INSTANT BUILT-INS
 
-		// If HISTORY ARRAY IS EMPTY PRINT THE MESSAGE "No commands in history."
+	int r;
+	if (strcmp(command->name, "")==0) 
+		return SUCCESS;
 
-		if (h->length <= 1){
-			printf("No commands in history.\n");
-			//DELETE !! from history
-			//printf("%s\n", h->commands[0]);
-			h->length = 0;
-			memset(h->commands[0], 0, sizeof(char) * BUFFERSIZE);
-			//printf("%s\n", h->commands[0]);
-			return SUCCESS;
-		}
-		
-		// Else print the command from the top of the history.
-		else{
-			//char lastbuff[4096];
-			//strcpy(oldbuff, lastbuff);
-			//printf("%s\n",lastbuff);
+	for (struct command_t *c=command; c; c=c->next)
+		expand_patterns(c);
 
-			//h->commands[0] <- h->commands[1]
-			strcpy(command->name, h->commands[1]);
-			strcpy(h->commands[0], h->commands[1]);
+	//name=value before a command, for its environment only
+	if (var_assignment(command->name))
+		return assign_command(command, h, shortdirs);
 
-			//printf("%d\n", h->length);
-			//printf("There is a command in history but it's hidden from me :{\n");
-		}
+	//time prefix, measures whatever follows it
+	if (strcmp(command->name, "time")==0)
+		return time_command(command, h, shortdirs);
 
-		// (NOT REQUIRED)
-		// Replace all !!'s in the command with the string from the top of the history array.
-		// Including the top of history!
+	//cache prefix, replays stored output of deterministic commands
+	if (strcmp(command->name, "cache")==0)
+		return cache_command(command, h, shortdirs);
 
+	//watch prefix, reruns the command when files change
+	if (strcmp(command->name, "watch")==0)
+		return watch_command(command, h, shortdirs);
+
+	if (strcmp(command->name, "exit")==0)
+	{
+		if (command->arg_count>0) // exit n, the status of a script
+			last_status=atoi(command->args[0])&0xff;
+		return EXIT;
 	}
 
-	//INSTANT BUILT-INS
+	//scripts run in the shell, they may exit it
+	if (strcmp(command->name, "source")==0 || strcmp(command->name, ".")==0)
+		return source_command(command, h, shortdirs);
 
-	int r;
-	if (strcmp(command->name, "")==0) 
-		return SUCCESS;
+	// every stage of a pipeline gets exec style arguments
+	for (struct command_t *c=command; c; c=c->next)
+		prepare_args(c);
 
-	if (strcmp(command->name, "exit")==0)
-		return EXIT;
-
-	if (strcmp(command->name, "cd")==0)
+	//a built-in that changes the shell has no stage of its own to run in
+	for (struct command_t *c=command; c && command->next; c=c->next)
 	{
-		if (command->arg_count > 0)
+		struct builtin *sb=find_builtin(c->args[0]);
+		if (sb && sb->flags & BUILTIN_SHELL)
 		{
-			r=chdir(command->args[0]);
-			if (r==-1)
-				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-			return SUCCESS;
+			printf("E: %s changes the shell and can't run in a pipeline\n", c->args[0]);
+			last_status=EXIT_FAILURE;
+			return UNKNOWN;
 		}
 	}
 
-	pid_t pid=fork();
-	if (pid==0) // child
+	//OUR BUILT-IN COMMANDS GO HERE
+	//A built-in on its own runs in the shell, no fork needed, unless it
+	//can take long enough to need Ctrl+C. In a pipeline it runs on a
+	//thread of the shell (see run_pipeline).
+	struct builtin *b=find_builtin(command->args[0]);
+	if (b && !(b->flags & (BUILTIN_FORK|BUILTIN_LONG)) && !command->next)
 	{
-		/// This shows how to do exec with environ (but is not available on MacOs)
-	    //extern char** environ; // environment variables
-		// execvpe(command->name, command->args, environ); // exec+args+path+environ
-
-		/// This shows how to do exec with auto-path resolve
-		// add a NULL argument to the end of args, and the name to the beginning
-		// as required by exec
-
-		// increase args size by 2
-		command->args=(char **)realloc(
-			command->args, sizeof(char *)*(command->arg_count+=2));
+		r=run_builtin(b, command, h, shortdirs);
+		if (r!=BUILTIN_EXTERNAL)
+			return SUCCESS;
+		command->external=true;
+	}
 
-		// shift everything forward by 1
-		for (int i=command->arg_count-2;i>0;--i)
-			command->args[i]=command->args[i-1];
+	//RUN IN CHILD PROCESSES, one per pipeline stage
+	return run_pipeline(command, h);
+}
 
-		// set args[0] as a copy of name
-		command->args[0]=strdup(command->name);
-		// set args[arg_count-1] (last) to NULL
-		command->args[command->arg_count-1]=NULL;
+//open flags of the < > >> redirections
+static const int redirect_flags[3] = { O_RDONLY, O_WRONLY|O_CREAT|O_TRUNC, O_WRONLY|O_CREAT|O_APPEND };
 
-		//OUR BUILT-IN COMMANDS GO HERE
+/**
+ * Run a built-in in the shell process. Its redirections are applied to
+ * the shell's own stdin/stdout for the duration of the call, and under
+ * a capture its output goes to memory instead.
+ * @param  b       [description]
+ * @param  command with args[0] set to the name and NULL terminated
+ * @return         BUILTIN_EXTERNAL if the program in PATH should run
+ *                 instead, SUCCESS otherwise; the exit status goes
+ *                 to last_status
+ */
+int run_builtin(struct builtin *b, struct command_t *command, history *h, shortdir *shortdirs)
+{
+	int saved[2]={-1, -1}, status=SUCCESS;
+	fflush(stdout);
+	for (int i=0;i<3;i++)
+	{
+		if (!command->redirects[i])
+			continue;
+		int target=i==0 ? STDIN_FILENO : STDOUT_FILENO;
+		int fd=open(command->redirects[i], redirect_flags[i], 0644);
+		if (fd==-1)
+		{
+			printf("-%s: %s: %s\n", sysname, command->redirects[i], strerror(errno));
+			status=EXIT;
+			break;
+		}
+		if (saved[target]==-1)
+			saved[target]=fcntl(target, F_DUPFD_CLOEXEC, 10);
+		dup2(fd, target);
+		close(fd);
+	}
 
-		//PART II
-		if (strcmp(command->args[0], "shortdir")==0)
+	if (status==SUCCESS)
+	{
+		uint64_t t0=TRACE_BEGIN();
+		//a capture takes the output straight into memory, unless it
+		//was redirected
+		struct capture *cap=active_capture;
+		char *mem=NULL, *errmem=NULL;
+		size_t memlen=0, errmemlen=0;
+		FILE *out=cap && saved[STDOUT_FILENO]==-1 ? open_memstream(&mem, &memlen) : NULL;
+		FILE *err=out && !cap->outonly ? open_memstream(&errmem, &errmemlen) : NULL;
+		struct builtin_ctx ctx={ STDIN_FILENO, out ? out : stdout, err ? err : stderr, h, shortdirs };
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		status=b->fn(command, &ctx);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (status!=BUILTIN_EXTERNAL)
+			stats_record(command->args[0], start, end, 0, status);
+		if (out)
 		{
-			//printf("SHORTDIRS POINTER: %p\n", (void*)&shortdirs);
-			if (command->arg_count > 0)
+			fclose(out);
+			buffer_append(&cap->out, mem, memlen);
+			if (cap->tee)
+				write_all(STDOUT_FILENO, mem, memlen);
+			free(mem);
+			//a built-in that leaves the shell alone can be stored by
+			//cache like a forked pipeline
+			if (!(b->flags & BUILTIN_SHELL) && status!=BUILTIN_EXTERNAL)
 			{
+				cap->ran=1;
+				cap->status=status;
+			}
+		}
+		if (err)
+		{
+			fclose(err);
+			buffer_append(&cap->err, errmem, errmemlen);
+			if (cap->tee)
+				write_all(STDERR_FILENO, errmem, errmemlen);
+			free(errmem);
+		}
+		fflush(stdout);
+		fflush(stderr);
+		TRACE_END("builtin", t0, command->name);
+	}
 
-				//printf("%s, %s\n", command->args[0], command->args[1]);
+	for (int i=0;i<2;i++)
+		if (saved[i]!=-1)
+		{
+			dup2(saved[i], i);
+			close(saved[i]);
+		}
+	if (status==BUILTIN_EXTERNAL)
+		return BUILTIN_EXTERNAL;
+	last_status=status;
+	return SUCCESS;
+}
 
-				if (strcmp(command->args[1], "set")==0 ){
-					//printf("Not yet implemented\n" );
-					//printf("%s %s\n", command->args[0], command->args[1]);
-					if (!(command->args[1])){
-						printf("error: name not specified for shortdir set.\n" );
-						return UNKNOWN;
-					}
+/**
+ * shortdir built-in, runs in the shell process
+ *   shortdir set|jump|del <name>
+ *   shortdir list|clear
+ * @param  command with args[0] set to the name and NULL terminated
+ * @param  ctx     provides the alias list
+ * @return         SUCCESS or UNKNOWN on bad usage
+ */
+int shortdir_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	shortdir *shortdirs=ctx->shortdirs;
+	char cwd[1024];
+	int r;
 
-					shortdir *s;
-					s = shortdirs;
+	//printf("SHORTDIRS POINTER: %p\n", (void*)&shortdirs);
+	if (command->arg_count > 2) // name, subcommand and the NULL terminator
+	{
 
-					for (; s->next != NULL && strcmp(s->shortName, command->args[2])!=0; s=s->next );
+		//printf("%s, %s\n", command->args[0], command->args[1]);
 
-					//printf("%s %s\n", s->shortName, command->args[2]);
+		if (strcmp(command->args[1], "set")==0 ){
+			//printf("Not yet implemented\n" );
+			//printf("%s %s\n", command->args[0], command->args[1]);
+			if (!(command->args[2])){
+				fprintf(ctx->err, "error: name not specified for shortdir set.\n" );
+				return UNKNOWN;
+			}
 
-					//OVERWRITE DEFINITION
-					if( strcmp(s->shortName, command->args[2])==0 ){
-						//printf("Overwriting: %s with %s \n", s->longName, getcwd(cwd,sizeof(cwd)));
-						strcpy(s->shortName,command->args[2]);
-					    strcpy(s->longName,getcwd(cwd,sizeof(cwd)));
-					}
+			shortdir *s;
+			s = shortdirs;
 
-					else{
-						//printf("Writing: %s\n", getcwd(cwd,sizeof(cwd)));
+			for (; s->next != NULL && strcmp(s->shortName, command->args[2])!=0; s=s->next );
 
-						//ADD NEW DEFINITION
-						strcpy(s->shortName,command->args[2]);
-					    strcpy(s->longName,getcwd(cwd,sizeof(cwd)));
+			//printf("%s %s\n", s->shortName, command->args[2]);
 
-					    //printf("WRITTEN SUCCESSFULLY?\n");
+			//OVERWRITE DEFINITION
+			if( strcmp(s->shortName, command->args[2])==0 ){
+				//printf("Overwriting: %s with %s \n", s->longName, getcwd(cwd,sizeof(cwd)));
+				strcpy(s->shortName,command->args[2]);
+			    strcpy(s->longName,getcwd(cwd,sizeof(cwd)));
+			}
 
-					    //RESERVE NEXT ELEMENT
-					    s->next=malloc(sizeof(shortdir));
-					    memset(s->next, 0, sizeof(shortdir));
-					    s->next->prev = s;
-					}
+			else{
+				//printf("Writing: %s\n", getcwd(cwd,sizeof(cwd)));
 
-				    printf("%s is set as an alias for %s\n",s->shortName,s->longName);
-				}
-				else if (strcmp(command->args[1], "jump")==0 ){
-					//printf("Not yet implemented\n" );
+				//ADD NEW DEFINITION
+				strcpy(s->shortName,command->args[2]);
+			    strcpy(s->longName,getcwd(cwd,sizeof(cwd)));
 
-					if (!(command->args[2])){
-						printf("E: name not specified for shortdir jump.\n" );
-						return UNKNOWN;
-					}
-					shortdir *s;
-					s = shortdirs;
-					for (; s->next != NULL && strcmp(s->shortName, command->args[2])!=0; s=s->next ) {
-						//printf("SHIFTED\n" );
-						//printf("%s : %s\n", s->shortName, s->longName);
-						//printf("%s : %s\n", s->shortName, command->args[1]);
-					}
+			    //printf("WRITTEN SUCCESSFULLY?\n");
 
-					if( strcmp(s->shortName, command->args[2])!=0 ){
-						printf("E: alias %s not found.\n", command->args[2] );
-						return UNKNOWN;
-					}
+			    //RESERVE NEXT ELEMENT
+			    s->next=malloc(sizeof(shortdir));
+			    memset(s->next, 0, sizeof(shortdir));
+			    s->next->prev = s;
+			}
 
-					//printf("%s : %s\n", s->shortName, s->longName);
-					r=chdir(s->longName);
-					if (r==-1)
-						printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-					return SUCCESS;
-				}
-				else if (strcmp(command->args[1], "del")==0 ){
-					//printf("Not yet implemented\n" );
+		    fprintf(ctx->out, "%s is set as an alias for %s\n",s->shortName,s->longName);
+		}
+		else if (strcmp(command->args[1], "jump")==0 ){
+			//printf("Not yet implemented\n" );
 
-					if (!(command->args[2])){
-						printf("E: name not specified for shortdir del.\n" );
-						return UNKNOWN;
-					}
+			if (!(command->args[2])){
+				fprintf(ctx->err, "E: name not specified for shortdir jump.\n" );
+				return UNKNOWN;
+			}
+			shortdir *s;
+			s = shortdirs;
+			for (; s->next != NULL && strcmp(s->shortName, command->args[2])!=0; s=s->next ) {
+				//printf("SHIFTED\n" );
+				//printf("%s : %s\n", s->shortName, s->longName);
+				//printf("%s : %s\n", s->shortName, command->args[1]);
+			}
 
-					shortdir *s;
-					s = shortdirs;
-					int isHead = 1;
+			if( strcmp(s->shortName, command->args[2])!=0 ){
+				fprintf(ctx->err, "E: alias %s not found.\n", command->args[2] );
+				return UNKNOWN;
+			}
 
-					for (; s->next != NULL && strcmp(s->shortName, command->args[2])!=0; s=s->next ) {
-						//printf("SHIFTED\n" );
-						isHead = 0;
-					}
+			//printf("%s : %s\n", s->shortName, s->longName);
+			r=chdir(s->longName);
+			if (r==-1)
+				fprintf(ctx->err, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+			return SUCCESS;
+		}
+		else if (strcmp(command->args[1], "del")==0 ){
+			//printf("Not yet implemented\n" );
 
-					if(strcmp(s->shortName, command->args[2])!=0){
-						printf("E: shortdir alias %s not found.\n", command->args[2]);
-						return UNKNOWN;
-					}
+			if (!(command->args[2])){
+				fprintf(ctx->err, "E: name not specified for shortdir del.\n" );
+				return UNKNOWN;
+			}
 
-					if (!(isHead)){
-						//printf("REMOVED NOT HEAD");
-						//REMOVE S
-						shortdir *head = s->prev, *tail = s->next;
-						head->next = tail; tail->prev = head;
-						free(s);
-					}
-					else{
-						//printf("REMOVED HEAD");
-						//SHIFT SHORTDIRS POINTER!
-						shortdir *tail = s->next;
-
-						//COPY VALUES
-						strcpy(shortdirs->shortName,tail->shortName);
-						strcpy(shortdirs->longName,tail->longName);
-
-						shortdirs->next = tail->next;
-
-						if( tail->next == 0){
-							//NOT NULL BECAUSE WE MEMSET 0
-							//printf("ONLY ONE ENTRY\n");
-						}
-						else{
-							//printf("MORE THAN ONE ENTRY\n");
-							tail->next->prev = shortdirs;
-						}
-						
-						free(tail);
-					}
-				}
-				else if (strcmp(command->args[1], "clear")==0 ){
-					shortdir *s = shortdirs;
-					for (; s->next != NULL; s=s->next ) {
-					}
+			shortdir *s;
+			s = shortdirs;
+			int isHead = 1;
 
-					//REVERSE
-					for (; s != shortdirs; ) {
-						free(s);
-						s=s->prev;
-					}
+			for (; s->next != NULL && strcmp(s->shortName, command->args[2])!=0; s=s->next ) {
+				//printf("SHIFTED\n" );
+				isHead = 0;
+			}
 
-					//AT SHORTDIRS
-					memset(shortdirs,0,sizeof(shortdir));
-				}
-				else if (strcmp(command->args[1], "list")==0 ){
-					shortdir *s;
-					s = shortdirs;
-					for (; s->next->shortName != NULL ; s=s->next ) {
-						printf("%s is an alias for %s\n", s->shortName, s->longName );
-					}
-				}
+			if(strcmp(s->shortName, command->args[2])!=0){
+				fprintf(ctx->err, "E: shortdir alias %s not found.\n", command->args[2]);
+				return UNKNOWN;
+			}
 
-				return SUCCESS;
+			if (!(isHead)){
+				//printf("REMOVED NOT HEAD");
+				//REMOVE S
+				shortdir *head = s->prev, *tail = s->next;
+				head->next = tail; tail->prev = head;
+				free(s);
 			}
-		}
+			else{
+				//printf("REMOVED HEAD");
+				//SHIFT SHORTDIRS POINTER!
+				shortdir *tail = s->next;
 
-		//PART I (No longer mandatory)
-		else if (strcmp(command->args[0], "history")==0)
-		{
-			//printf("Time to make history!\n");
+				//COPY VALUES
+				strcpy(shortdirs->shortName,tail->shortName);
+				strcpy(shortdirs->longName,tail->longName);
 
-		  	int ih = h->length - 1, L = h->length;
-		  	for(;ih>=0;ih--){
-		  		printf("%d %s\n", (L - ih), h->commands[ih]);
-		  	}
+				shortdirs->next = tail->next;
 
-			return SUCCESS;
+				if( tail->next == 0){
+					//NOT NULL BECAUSE WE MEMSET 0
+					//printf("ONLY ONE ENTRY\n");
+				}
+				else{
+					//printf("MORE THAN ONE ENTRY\n");
+					tail->next->prev = shortdirs;
+				}
+				
+				free(tail);
+			}
 		}
+		else if (strcmp(command->args[1], "clear")==0 ){
+			shortdir *s = shortdirs;
+			for (; s->next != NULL; s=s->next ) {
+			}
 
-		//PART III: Word finder for highlighting
-		else if (strcmp(command->args[0], "highlight")==0)
-		{
-			//printf("%d\n", command->arg_count);
-			if (command->arg_count == 5) {
-
-				char word[2048];
-				strcpy(word,command->args[1]);
-
-				char color[2];
-				strcpy(color,command->args[2]);
-
-				char filename[2048];
-				strcpy(filename,command->args[3]);
-
-	    		char * line = NULL;
-	    		size_t len = 0;
-	    		ssize_t read;
-
-	    		FILE *f = fopen(filename, "r");
-	    		if (f == NULL)
-	        		exit(EXIT_FAILURE);
-
-	        	int linecount=0;
-				//getting each line
-	   			while ((read = getline(&line, &len, f)) != -1) {
-
-	   				//printf("Line %d\n", ++linecount);
-	   				//strstrip(line);
-
-					//Checks that the line should be printed or not
-					int stringsOfColor = 0;
-	        		//tokenizing string
-					char *token = strtok(line, " \t\n");
-					//we are copying whole line to this one token by token
-					char lineAbouttaBePrinted[4096]="";
-					//memset(lineAbouttaBePrinted,0,4096*sizeof(char));
-					//going through tokens until the end of line
-					while(token != NULL) {
-						//checking whether this token is what we are looking for
-						if(strcasecmp(token, word) == 0) {
-							//Turn the string into red
-							if(strcmp(color, "r") == 0) {
-								char red[512] = "\e[31m\e[5m\e[1m";
-								strcat(red, token);
-								strcat(red, "\033[1m\033[0m");
-								token = red;
-								stringsOfColor = 1;
-							}
-							//Turn the string into green
-							if(strcmp(color, "g") == 0) {
-								char green[512] = "\e[32m\e[5m\e[1m";
-								strcat(green, token);
-								strcat(green, "\033[1m\033[0m");
-								token = green;
-								stringsOfColor = 1;
-							}
-							//Turn the string into blue
-							if(strcmp(color, "b") == 0) {
-								char blue[512] = "\e[34m\e[5m\e[1m";
-								strcat(blue, token);
-								strcat(blue, "\033[1m\033[0m");
-								token = blue;
-								stringsOfColor = 1;
-							}
-						}
-						//Adding the token to the reconstructed line
-						strcat(lineAbouttaBePrinted, token);
-						strcat(lineAbouttaBePrinted, " ");
-						//Tokenizing for the next loop
-						token = strtok(NULL, " \t\n");
-					}
-					//If stringsOfColor exists we are printling the whole line
-					if(stringsOfColor == 1) {
-						printf("%s\n",lineAbouttaBePrinted);
-					}
-	    		}
-
-	    		fclose(f);
+			//REVERSE
+			for (; s != shortdirs; ) {
+				shortdir *prev = s->prev;
+				free(s);
+				s=prev;
+			}
 
-	    		if (line)
-	        		free(line);
+			//AT SHORTDIRS
+			memset(shortdirs,0,sizeof(shortdir));
+		}
+		else if (strcmp(command->args[1], "list")==0 ){
+			shortdir *s;
+			s = shortdirs;
+			for (; s->next->shortName != NULL ; s=s->next ) {
+				fprintf(ctx->out, "%s is an alias for %s\n", s->shortName, s->longName );
 			}
-			return SUCCESS;
 		}
 
-		//PART IV: alarm
-		else if (strcmp(command->args[0], "goodMorning")==0){
-			//printf("NOT Implemented\n");
+		return SUCCESS;
+	}
+	fprintf(ctx->err, "E: usage: shortdir set|jump|del <name> | shortdir list|clear\n");
+	return UNKNOWN;
+}
 
-			//1. Parse minute, hour and songname
+/**
+ * cd built-in, goes to $HOME without an argument
+ * @param  command with args[0] set to the name and NULL terminated
+ * @param  ctx     [description]
+ * @return         SUCCESS, or EXIT_FAILURE if the directory can't be entered
+ */
+int cd_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	const char *dir=command->args[1] ? command->args[1] : var_lookup("HOME");
+	if (dir==NULL)
+	{
+		fprintf(ctx->err, "-%s: %s: HOME not set\n", sysname, command->args[0]);
+		return EXIT_FAILURE;
+	}
+	if (chdir(dir)==-1)
+	{
+		fprintf(ctx->err, "-%s: %s: %s\n", sysname, command->args[0], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	return SUCCESS;
+}
 
-			int hour,min;
-			sscanf(command->args[1],"%d.%d",&hour,&min);
+/**
+ * Replace unquoted patterns among the arguments with the names they
+ * match, patterns that match nothing stay as they are. This runs with
+ * the command rather than in parse_command so a cached parse stays
+ * right when files come and go.
+ */
+void expand_patterns(struct command_t *command)
+{
+	if (!command->globs)
+		return;
+	char **args=(char **)malloc(sizeof(char *)*command->arg_count);
+	int n=0;
+	for (int i=0;i<command->arg_count;i++)
+	{
+		char **matches;
+		int m;
+		if (command->globs[i] && (m=glob_expand(command->args[i], &matches))>0)
+		{
+			args=(char **)realloc(args, sizeof(char *)*(command->arg_count+n+m));
+			for (int j=0;j<m;j++)
+				args[n++]=matches[j];
+			free(matches);
+			free(command->args[i]);
+			continue;
+		}
+		args[n++]=command->args[i];
+	}
+	free(command->args);
+	free(command->globs);
+	command->args=args;
+	command->globs=NULL;
+	command->arg_count=n;
+}
 
-			char filename[2048];
-			strcpy(filename,command->args[2]);
+/**
+ * Turn parsed arguments into an exec style argument vector
+ * @param  command gets the name as args[0] and a NULL terminator
+ */
+void prepare_args(struct command_t *command)
+{
+	/// This shows how to do exec with environ (but is not available on MacOs)
+    //extern char** environ; // environment variables
+	// execvpe(command->name, command->args, environ); // exec+args+path+environ
+
+	/// This shows how to do exec with auto-path resolve
+	// add a NULL argument to the end of args, and the name to the beginning
+	// as required by exec
+
+	// increase args size by 2
+	command->args=(char **)realloc(
+		command->args, sizeof(char *)*(command->arg_count+=2));
+
+	// shift everything forward by 1
+	for (int i=command->arg_count-2;i>0;--i)
+		command->args[i]=command->args[i-1];
+
+	// set args[0] as a copy of name
+	command->args[0]=strdup(command->name);
+	// set args[arg_count-1] (last) to NULL
+	command->args[command->arg_count-1]=NULL;
+}
 
-			//printf("Hour: %d\nMinute: %d\nFile: %s\n", hour,min,filename);
+/**
+ * Open the < > >> redirections of a command onto stdin/stdout.
+ * Only called in a child, a failure ends the child.
+ */
+static void apply_redirects(struct command_t *command)
+{
+	for (int i=0;i<3;i++)
+	{
+		if (!command->redirects[i])
+			continue;
+		int fd=open(command->redirects[i], redirect_flags[i], 0644);
+		if (fd==-1)
+		{
+			printf("-%s: %s: %s\n", sysname, command->redirects[i], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		dup2(fd, i==0 ? STDIN_FILENO : STDOUT_FILENO);
+		close(fd);
+	}
+}
 
-			//2. Write crontab command to file
+static void stage_exited(pid_t pid, int status, struct rusage *ru, void *arg)
+{
+	struct stage_usage *st=arg;
+	clock_gettime(CLOCK_MONOTONIC, &st->end);
+	st->status=status;
+	st->ru=*ru;
+	st->done=1;
+}
 
-			char FILELOC[128];
-			memset(FILELOC,0,128*sizeof(char));
-			strcat(FILELOC,getenv("HOME"));
-			strcat(FILELOC,alarmfile);
+//one of the two pipes of a capture, read by the event loop as the
+//stages write into it
+struct capture_stream {
+	struct capture *cap;
+	struct buffer *b;
+	int fd;
+	int tofd; // where the tee copy goes
+};
 
-			FILE *fptr = fopen(FILELOC, "w");
+static void capture_input(int fd, uint32_t events, void *arg)
+{
+	struct capture_stream *cs=arg;
+	size_t before=cs->b->len;
+	if (buffer_read_fd(cs->b, fd)<=0)
+	{
+		loop_del(fd);
+		close(fd);
+		cs->fd=-1;
+	}
+	else if (cs->cap->tee)
+	{
+		fflush(stdout);
+		write_all(cs->tofd, cs->b->data+before, cs->b->len-before);
+	}
+}
 
-		    if (fptr == NULL) {
-		        printf("Error! Can't save alarm!");
-		        exit(1);
-		    }
+//BACKGROUND JOBS are reaped by the event loop whenever they finish and
+//reported at the prompt, above the line being typed if there is one
+struct bgjob {
+	int id;
+	char line[128];
+	int left;       // stages still running
+	pid_t last;     // last stage, its status is the job's status
+	int status;
+	struct bgjob *next;
+};
 
-			fprintf(fptr, "%d %d * * * DISPLAY=:0.0 /usr/bin/rhythmbox-client --play %s\n", min, hour, filename);
+static struct bgjob *bgjobs=NULL;
+static struct buffer notices; // finished jobs not reported yet
 
-			fclose(fptr);
+static void bgjob_exited(pid_t pid, int status, struct rusage *ru, void *arg)
+{
+	struct bgjob *job=arg;
+	if (pid==job->last)
+		job->status=status;
+	if (--job->left>0)
+		return;
+
+	char msg[256];
+	int code=status_code(job->status), n;
+	if (code)
+		n=snprintf(msg, sizeof(msg), "[%d]  Exit %d\t%s\n", job->id, code, job->line);
+	else
+		n=snprintf(msg, sizeof(msg), "[%d]  Done\t%s\n", job->id, job->line);
+	if (n>=(int)sizeof(msg))
+		n=sizeof(msg)-1;
+
+	struct bgjob **p=&bgjobs;
+	while (*p!=job)
+		p=&(*p)->next;
+	*p=job->next;
+	free(job);
+
+	if (editor.active)
+		editor_message(msg, n);
+	else
+		buffer_append(&notices, msg, n);
+}
 
-			//3. exec to read crontab
+/**
+ * Print the notices of jobs that finished while a command was running
+ */
+void jobs_notify()
+{
+	if (notices.len==0)
+		return;
+	fflush(stdout);
+	write_all(STDOUT_FILENO, notices.data, notices.len);
+	notices.len=0;
+}
 
-			//$crontab alarm.txt
-			//crontab alarm.txt
-			char *crontabexec[2] = {"crontab", FILELOC};
-			execvp(crontabexec[0], crontabexec);
-			exit(0);
-		}
+static struct bgjob *bgjob_start(struct command_t *command)
+{
+	struct bgjob *job=malloc(sizeof(struct bgjob));
+	memset(job, 0, sizeof(struct bgjob));
+	//smallest free job number
+	for (job->id=1;;job->id++)
+	{
+		struct bgjob *j=bgjobs;
+		while (j && j->id!=job->id)
+			j=j->next;
+		if (!j)
+			break;
+	}
+	size_t len=0;
+	for (struct command_t *c=command; c; c=c->next)
+		for (int i=0;c->args[i] && len<sizeof(job->line)-1;i++)
+			len+=snprintf(job->line+len, sizeof(job->line)-len, "%s%s",
+				i ? " " : c==command ? "" : " | ", c->args[i]);
+	job->next=bgjobs;
+	bgjobs=job;
+	return job;
+}
 
-		//PART V: kdiff
-		else if (strcmp(command->args[0], "kdiff")==0){
-			//printf("NOT Implemented\n");
-			
-			//SWITCH
-			//printf("%d\n", command->arg_count);
-			int mode = 0;
-			if(command->arg_count == 4) mode = 0;
-			else if(command->arg_count == 5){
-				char c;
-				sscanf(command->args[1], "-%c", &c);
-				
-				mode = ((c=='a')?0:1);
-				//printf("Mode: %d\n",mode);
-			}
-			else{
-				printf("E: Incorrect number of arguments for kdiff (2 or 3) \n");
-				return EXIT;
-			}
+//BUILT-INS ON THREADS
+//A built-in in a pipeline runs on a thread of the shell instead of in a
+//forked copy of it. It writes through its own FILE on the stage's pipe,
+//and an eventfd tells the event loop when it returned, so the stage ends
+//like a child that exited and the pipeline waits for both the same way.
+struct stage_thread {
+	pthread_t tid;
+	struct builtin *b;
+	struct command_t *command;
+	history *h;
+	struct stage_usage *st;
+	int fds[3];     // stdin, stdout and stderr of the stage, -1 for the shell's own
+	int efd;        // written when the built-in returned
+	int status;
+	volatile int cancel; // Ctrl+C while the pipeline ran
+};
 
-			//printf("MODE: %d\n",mode);
+static void *stage_thread_main(void *arg)
+{
+	struct stage_thread *t=arg;
+	//a reader that went away is an EPIPE for this stage, not a SIGPIPE
+	//that ends the shell
+	sigset_t pipemask;
+	sigemptyset(&pipemask);
+	sigaddset(&pipemask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipemask, NULL);
+
+	//the FILEs write to duplicates, the stage's own fds stay open in
+	//case the built-in hands the command over to the program in PATH
+	FILE *out=fdopen(fcntl(t->fds[1]!=-1 ? t->fds[1] : STDOUT_FILENO, F_DUPFD_CLOEXEC, 0), "w");
+	FILE *err=t->fds[2]!=-1 ? fdopen(fcntl(t->fds[2], F_DUPFD_CLOEXEC, 0), "w") : stderr;
+	if (out && err)
+	{
+		struct builtin_ctx ctx={ t->fds[0]!=-1 ? t->fds[0] : STDIN_FILENO, out, err, t->h, NULL, &t->cancel };
+		t->status=t->b->fn(t->command, &ctx);
+	}
+	else
+		t->status=EXIT_FAILURE;
+	if (out)
+		fclose(out);
+	if (err && err!=stderr)
+		fclose(err);
+	getrusage(RUSAGE_THREAD, &t->st->ru);
+	clock_gettime(CLOCK_MONOTONIC, &t->st->end);
+
+	uint64_t one=1;
+	if (write(t->efd, &one, sizeof(one))!=sizeof(one))
+		perror("eventfd");
+	return NULL;
+}
 
-			//Check file names
+/**
+ * The built-in returned BUILTIN_EXTERNAL, so the program in PATH takes
+ * over the stage's fds in a child like any other external stage
+ */
+static void stage_thread_external(struct stage_thread *t)
+{
+	struct command_t *c=t->command;
+	char exe[4096];
+	const char *found=resolve_path(c->args[0], exe, sizeof(exe))==0 ? exe : NULL;
+	c->external=true;
+	fflush(stdout);
+	pid_t pid=fork();
+	if (pid==0)
+	{
+		loop_child();
+		for (int i=0;i<3;i++)
+			if (t->fds[i]!=-1)
+				dup2(t->fds[i], i);
+		exit(exec_command(c, t->h, found));
+	}
+	if (pid==-1)
+	{
+		printf("-%s: fork: %s\n", sysname, strerror(errno));
+		t->st->status=W_EXITCODE(EXIT_FAILURE, 0);
+		t->st->done=1;
+		return;
+	}
+	t->st->pid=pid;
+	loop_watch_child(pid, stage_exited, t->st);
+}
 
-			char filename1[2048], filename2[2048];
+static void stage_thread_done(int fd, uint32_t events, void *arg)
+{
+	struct stage_thread *t=arg;
+	loop_del(fd);
+	close(fd);
+	pthread_join(t->tid, NULL);
+	if (t->status==BUILTIN_EXTERNAL && !t->cancel)
+		stage_thread_external(t);
+	else
+	{
+		// a built-in stopped by Ctrl+C ends like a program killed by it
+		t->st->status=W_EXITCODE(t->cancel ? 128+SIGINT : t->status&0xff, 0);
+		t->st->done=1;
+	}
+	//closing the pipe ends here is what lets the neighbors see EOF
+	for (int i=0;i<3;i++)
+		if (t->fds[i]!=-1)
+			close(t->fds[i]);
+}
 
-			if(command->arg_count == 4){
-				strcpy(filename1,command->args[1]);
-				strcpy(filename2,command->args[2]);
-			}
-			else if(command->arg_count == 5){
-				strcpy(filename1,command->args[2]);
-				strcpy(filename2,command->args[3]);
-			}
-			else{
-				//printf("WE'VE GOT A PROBLEM CHIEF\n");
-				return EXIT;
-			}
-			//Make sure .txt
-			//printf("TESTING\n");
+/**
+ * Start a built-in stage on a thread. Its redirections are opened here
+ * the way apply_redirects does in a child.
+ * @param  t  with b, command, h, st and fds set, the fds are taken over
+ * @return    0, or -1 when the stage couldn't start and already failed
+ */
+static int stage_thread_start(struct stage_thread *t)
+{
+	struct command_t *c=t->command;
+	int ok=1;
+	for (int i=0;i<3 && ok;i++)
+	{
+		if (!c->redirects[i])
+			continue;
+		int target=i==0 ? 0 : 1;
+		int fd=open(c->redirects[i], redirect_flags[i]|O_CLOEXEC, 0644);
+		if (fd==-1)
+		{
+			printf("-%s: %s: %s\n", sysname, c->redirects[i], strerror(errno));
+			ok=0;
+			break;
+		}
+		if (t->fds[target]!=-1)
+			close(t->fds[target]);
+		t->fds[target]=fd;
+	}
+	t->cancel=0;
+	t->st->pid=getpid();
+	t->efd=ok ? eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK) : -1;
+	if (t->efd!=-1 && loop_add(t->efd, stage_thread_done, t)==0)
+	{
+		int err=pthread_create(&t->tid, NULL, stage_thread_main, t);
+		if (err==0)
+			return 0;
+		printf("-%s: thread: %s\n", sysname, strerror(err));
+		loop_del(t->efd);
+	}
+	if (t->efd!=-1)
+		close(t->efd);
+	for (int i=0;i<3;i++)
+		if (t->fds[i]!=-1)
+			close(t->fds[i]);
+	t->st->status=W_EXITCODE(EXIT_FAILURE, 0);
+	t->st->done=1;
+	return -1;
+}
 
-			char body[2048],ext[2048];
+/**
+ * Fork one child per stage of a pipeline, connect them with pipes and
+ * wait for all of them unless the command runs in the background.
+ * Exits come in through the event loop with each stage's resource usage,
+ * which is recorded when a time report is being collected. The loop keeps
+ * running timers and job notices while the pipeline runs.
+ * @param  command first stage, prepared with prepare_args
+ * @param  h       [description]
+ * @return         SUCCESS
+ */
+int run_pipeline(struct command_t *command, history *h)
+{
+	struct stage_usage stages[MAXSTAGES];
+	struct stage_thread threads[MAXSTAGES];
+	int nstages=0, nthreads=0, infd=-1;
+
+	//a capture collects stdout of the last stage and stderr of all stages
+	int capfds[2][2]={{-1, -1}, {-1, -1}};
+	struct capture *cap=active_capture;
+	struct capture_stream streams[2];
+	if (cap && (pipe2(capfds[0], O_CLOEXEC)==-1 || (!cap->outonly && pipe2(capfds[1], O_CLOEXEC)==-1)))
+	{
+		printf("-%s: pipe: %s\n", sysname, strerror(errno));
+		cap=NULL;
+	}
+	if (cap)
+		cap->ran=1;
 
-			char *ptr = strtok(filename1, ".\n");strcpy(body,ptr);ptr = strtok(NULL,".\n");strcpy(ext,ptr);
-			//printf("%s . %s \n", body, ext );
-			if(strcmp(ext,"txt")!=0) {
-				printf("E: File 1 is not a .txt file\n");
-				return EXIT;
-			}
+	//time and cache need the result, so they always wait
+	struct bgjob *job=NULL;
+	if (command->background && !active_time && !cap)
+		job=bgjob_start(command);
 
-			ptr = strtok(filename2, ".\n");strcpy(body,ptr);ptr = strtok(NULL,".\n");strcpy(ext,ptr);
-			//printf("%s . %s \n", body, ext );
-			if(strcmp(ext,"txt")!=0) {
-				printf("E: File 2 is not a .txt file\n");
-				return EXIT;
-			}
+	fflush(stdout); // don't let the children inherit pending output
+	var_environ(); // built once here, the children and stage threads only read it
+	for (struct command_t *c=command; c && nstages<MAXSTAGES; c=c->next)
+	{
+		int fds[2]={-1, -1};
+		//close on exec, a thread's pipe ends must not leak into the
+		//children of later stages or they would never see EOF
+		if (c->next && pipe2(fds, O_CLOEXEC)==-1)
+		{
+			printf("-%s: pipe: %s\n", sysname, strerror(errno));
+			break;
+		}
 
-			//ADD BACK .txt extension
-			strcat(filename1,".txt");
-			strcat(filename2,".txt");
-
-			//identical flag
-			int identical = 1;
-
-			//first line
-			int firstline = 1;
-
-			//file end reached flags
-			int f1ended = 0, f2ended=0;
-
-			int linecount = -1, mislinecount=0;
-
-			char * line1 = NULL, *line2 = NULL;
-			char byte1, byte2;
-		    size_t len = 0;
-		    //ssize_t read;
-
-			//PART A (mode = 0)
-			//LINE BY LINE
-			if(mode==0){
-
-				FILE *f1 = fopen(filename1, "r");
-				//FILE *f2 = f1;
-				FILE *f2 = fopen(filename2, "r");
-			    if ( (f1 == NULL) || (f2 == NULL) ){
-			    	//printf("ERROR: %d %d\n", (int)(f1), (int)(f2));
-			        exit(EXIT_FAILURE);
-			    }
-
-			    while ( !f1ended || !f2ended ) {
-
-			    	linecount++;
-
-			    	if (firstline){
-			    		firstline=0;
-			    	}
-			    	//Compare strings
-			    	else if(!f1ended && f2ended){
-			    		printf("%s:Line %d: %s\n", filename1,linecount,line1);
-			    		mislinecount++;
-			    		identical=0;
-			    	}
-			    	else if(f1ended && !f2ended){
-			    		printf("%s:Line %d: %s\n", filename2,linecount,line2);
-			    		mislinecount++;
-			    		identical=0;
-			    	}
-			    	else if(strcmp(line1,line2) != 0){
-			    		printf("%s:Line %d: %s\n", filename1,linecount,line1);
-			    		printf("%s:Line %d: %s\n", filename2,linecount,line2);
-			    		mislinecount++;
-			    		identical=0;
-			    	}
-
-			    	//Read one line from each
-			    	if(getline(&line1, &len, f1) == -1){
-			    		f1ended=1;
-			    	}
-			    	if(getline(&line2, &len, f2) == -1){
-			    		f2ended=1;
-			    	}
-
-			    }
-
-			    //Identical?
-
-			    if(identical){
-			    	printf("The two files are identical\n\n");
-			    }else{
-			    	if(mislinecount==1)
-			    		printf("1 different line found\n\n");
-			    	else
-			    		printf("%d different lines found\n\n", mislinecount);
-			    }
-			}
-			//PART B (mode = 1)
-			else{
-				FILE *f1 = fopen(filename1, "rb");
-				FILE *f2 = fopen(filename2, "rb");
-			    if ( (f1 == NULL) || (f2 == NULL) ){
-			        exit(EXIT_FAILURE);
-			    }
-
-			    while ( !f1ended || !f2ended ) {
-
-			    	//printf("%d\n", linecount);
-
-			    	linecount++;
-
-			    	if (firstline){
-			    		firstline=0;
-			    	}
-			    	//Compare strings
-			    	else if(!f1ended && f2ended){
-			    		//printf("%s:Byte %d: %c\n", filename1,linecount,byte1);
-			    		mislinecount++;
-			    		identical=0;
-			    	}
-			    	else if(f1ended && !f2ended){
-			    		//printf("%s:Byte %d: %c\n", filename2,linecount,byte2);
-			    		mislinecount++;
-			    		identical=0;
-			    	}
-			    	else if( byte1!=byte2 ){
-			    		//printf("%s:Byte %d: %c\n", filename1,linecount,byte1);
-			    		//printf("%s:Byte %d: %c\n", filename2,linecount,byte2);
-			    		mislinecount++;
-			    		identical=0;
-			    	}
-
-			    	//Read one line from each
-			    	if( (byte1 = fgetc(f1)) == EOF ){
-			    		f1ended=1;
-			    	}
-			    	if( (byte2 = fgetc(f2)) == EOF ){
-			    		f2ended=1;
-			    	}
-
-			    }
-
-			    //Identical?
-
-			    if(identical){
-			    	printf("The two files are identical\n\n");
-			    }else{
-			    	if(mislinecount==1)
-			    		printf("1 different byte found\n\n");
-			    	else
-			    		printf("%d different bytes found\n\n", mislinecount);
-			    }
+		struct stage_usage *st=&stages[nstages];
+		memset(st, 0, sizeof(*st));
+		snprintf(st->name, sizeof(st->name), "%s", c->name);
+
+		//BUILT-INS run on a thread of the shell. A background job gets
+		//children, as the shell goes on with the next line meanwhile,
+		//and so does a long one alone, which Ctrl+C must be able to kill
+		//even while it is blocked reading.
+		struct builtin *b=c->external ? NULL : find_builtin(c->args[0]);
+		if (b && !(b->flags & (BUILTIN_SHELL|BUILTIN_FORK|BUILTIN_LOOP)) && !job
+			&& !(b->flags & BUILTIN_LONG && c==command && !c->next))
+		{
+			struct stage_thread *t=&threads[nthreads++];
+			*t=(struct stage_thread){ .b=b, .command=c, .h=h, .st=st, .fds={ infd, fds[1], -1 } };
+			if (cap)
+			{
+				if (fds[1]==-1)
+					t->fds[1]=fcntl(capfds[0][1], F_DUPFD_CLOEXEC, 0);
+				if (capfds[1][1]!=-1)
+					t->fds[2]=fcntl(capfds[1][1], F_DUPFD_CLOEXEC, 0);
 			}
+			clock_gettime(CLOCK_MONOTONIC, &st->start);
+			uint64_t t0=TRACE_BEGIN();
+			stage_thread_start(t);
+			TRACE_END("thread", t0, c->name);
+			st->spawn=elapsed_ns(st->start);
+			nstages++;
+			infd=fds[0]; // the thread owns the rest
+			continue;
+		}
 
-			return SUCCESS;
+		//PATH RESOLUTION happens here so the shell can see what it costs
+		char exe[4096];
+		const char *found=NULL;
+		if (c->external || !find_builtin(c->args[0]))
+		{
+			uint64_t t0=TRACE_BEGIN();
+			if (resolve_path(c->args[0], exe, sizeof(exe))==0)
+				found=exe;
+			TRACE_END("resolve_path", t0, c->name);
 		}
 
-		//PART VI: favorite command
-		else if (strcmp(command->args[0], "myfavorite")==0){
-			//printf("NOT Implemented\n");
-			
-			//h->commands[0]; h->length;
-			
-			int checked[HISTORYSIZE], countOf[HISTORYSIZE];
-			memset(checked, 0, HISTORYSIZE*sizeof(int));
-			memset(countOf, 0, HISTORYSIZE*sizeof(int));
-			
-			//Step 1: Loop over commands
-			//If not checked mark and begin counting
-			//If checked continue
-			int i,j;
-			for(i = 0; i < h->length;i++){
-				if(checked[i]) continue;
-				//Not checked before, checking now
-				countOf[i] = checked[i] = 1;
-				for(j = i + 1; j < h->length ;j++){
-					if(checked[j]) continue;
-					//Not matched before, attempting to match now
-					else if(strcmp(h->commands[i],h->commands[j])==0){
-						countOf[i] += checked[j] = 1;
-					}
-				}
+		trace_spawn_prepare();
+		clock_gettime(CLOCK_MONOTONIC, &st->start);
+		uint64_t t0=TRACE_BEGIN();
+		pid_t pid=fork();
+		if (pid==0) // child
+		{
+			trace_child(found!=NULL);
+			loop_child();
+			if (infd!=-1)
+			{
+				dup2(infd, STDIN_FILENO);
+				close(infd);
 			}
-			
-			//Step 2: Loop over count to find largest count
-			int fav=-1, favcount=-1;
-			for(i = 0; i < h->length ;i++){
-				if(countOf[i] > favcount){
-					favcount = countOf[i];
-					fav = i;
-				}
+			if (fds[1]!=-1)
+			{
+				dup2(fds[1], STDOUT_FILENO);
+				close(fds[0]);
+				close(fds[1]);
 			}
-			
-			//Step 3: Return corresponding string with largest count
-			printf("Your favorite command lately is %s (%d/%d)\n", h->commands[fav], favcount,h->length);
-			
-			    /* checked   count
-				a 1        2
-				b 1        3
-				c 1        1
-				d 1        1
-				b 1        0
-				a 1        0
-				b 1        0
-			    */
-
-			/*printf("\tChecked:\tCount:\tCommand:\n");
-			for(i = h->length - 1; i >= 0 ;i--){
-				printf("\t%d\t%d\t%s\n", checked[i],countOf[i],h->commands[i]);
-			}*/
-
-			return SUCCESS;
+			if (cap)
+			{
+				if (fds[1]==-1)
+					dup2(capfds[0][1], STDOUT_FILENO);
+				if (capfds[1][1]!=-1)
+					dup2(capfds[1][1], STDERR_FILENO);
+			}
+			apply_redirects(c);
+			// built-ins that run in the child exit here instead of
+			// returning into the shell's main loop
+			exit(exec_command(c, h, found));
 		}
-
-		//Non-Builtins
-		else
+		TRACE_END("fork", t0, c->name);
+		st->spawn=elapsed_ns(st->start);
+		trace_spawn_wait(pid, c->name);
+		if (pid==-1)
+			printf("-%s: fork: %s\n", sysname, strerror(errno));
+		else if (job)
 		{
-			//execvp(command->name, command->args); // exec+args+path
-			//exit(0);
-		
-		/// TODO: do your own exec with path resolving using execv()
-		/// DONE
-
-		char *environ = getenv("PATH");
-		char *fileToCheck = environ;
-		char split[] = ":";
-		char *ptr = strtok(environ, split);
-
-		char exeToCheck[2048];
-
-		while(ptr != NULL) {
-
-		  	//char *exeToCheck = strcat(fileToCheck, command->name);
-
-		  	memset(exeToCheck,0,2048*sizeof(char));
-			strcat(exeToCheck,ptr);
-			strcat(exeToCheck,"/");
-			strcat(exeToCheck,command->name);
-		  	//printf("exeToCheck:%s\n", exeToCheck);
-
-		    if(access(exeToCheck, F_OK) == 0){
-		       //printf("EXECUTABLE FOUND\n");
-
-		       strcpy(command->args[0], exeToCheck);
-			   execv(command->args[0], command->args);
-
-			   break;
-			   exit(0);
-		    } else {
-			  //printf("%s\n", "File does not exist");
-		    }
-			ptr = strtok(NULL, split);
+			loop_watch_child(pid, bgjob_exited, job);
+			job->left++;
+			job->last=pid;
 		}
-		printf("%s\n", "E: command not found");
-		exit(0);
+		else
+			loop_watch_child(pid, stage_exited, st);
+		st->pid=pid;
+		st->done=(pid==-1);
+		nstages++;
+
+		if (infd!=-1)
+			close(infd);
+		if (fds[1]!=-1)
+			close(fds[1]);
+		infd=fds[0];
+	}
+	if (infd!=-1)
+		close(infd);
+	if (cap)
+	{
+		for (int k=0;k<2;k++)
+		{
+			streams[k].fd=-1;
+			if (capfds[k][0]==-1)
+				continue;
+			close(capfds[k][1]);
+			streams[k]=(struct capture_stream){ cap, k==0 ? &cap->out : &cap->err, capfds[k][0],
+				k==0 ? STDOUT_FILENO : STDERR_FILENO };
+			loop_add(capfds[k][0], capture_input, &streams[k]);
 		}
-		
-	} else {
-		//Already Implemented
-		if (!command->background){
-			wait(0); // wait for child process to finish
+	}
+
+	if (job)
+	{
+		if (job->left==0) // nothing started
+		{
+			bgjobs=job->next;
+			free(job);
 		}
+		else
+			printf("[%d] %d\n", job->id, (int)job->last);
 		return SUCCESS;
 	}
 
-	// TODO: your implementation here
-
-	printf("-%s: %s: command not found\n", sysname, command->name);
-	return UNKNOWN;
+	//Already Implemented
+	//wait for our own stages and captured output, the event loop
+	//reports the exits
+	uint64_t t0=TRACE_BEGIN();
+	int interrupts=loop_interrupts;
+	while (1)
+	{
+		int left=0;
+		for (int i=0;i<nstages;i++)
+			left+=!stages[i].done;
+		if (cap && (streams[0].fd!=-1 || streams[1].fd!=-1))
+			left++;
+		if (left==0)
+			break;
+		//children get Ctrl+C from the terminal, threads are told
+		if (loop_interrupts!=interrupts)
+			for (int i=0;i<nthreads;i++)
+				threads[i].cancel=1;
+		loop_wait(-1);
+	}
+	TRACE_END("wait", t0, command->name);
+	if (active_time)
+		time_record(active_time, stages, nstages);
+	stats_stages(stages, nstages);
+	if (nstages>0)
+		last_status=status_code(stages[nstages-1].status);
+	if (nstages>0 && (loop_interrupts!=interrupts
+		|| (WIFSIGNALED(stages[nstages-1].status) && WTERMSIG(stages[nstages-1].status)==SIGINT)))
+		printf("\n"); // the prompt goes below the ^C
+	if (cap)
+		cap->status=last_status;
+	return SUCCESS;
 }
 
-int save_aliases(shortdir *shortdirs){
-	//printf("BUG: Make sure aliases.txt and alarm.txt is saved to the root directory (not temp/aliases.txt)\nConsider using getcwd()!\n");
+/**
+ * Find an executable in PATH. Names with a slash are taken as they are.
+ * PATH, the shell's variable, is walked in place.
+ * @param  name [description]
+ * @param  out  receives the full path
+ * @param  size [description]
+ * @return      0 if found, -1 otherwise
+ */
+int resolve_path(const char *name, char *out, size_t size)
+{
+	if (strchr(name, '/'))
+	{
+		snprintf(out, size, "%s", name);
+		return access(out, X_OK)==0 ? 0 : -1;
+	}
+	const char *path=var_lookup("PATH");
+	if (path==NULL || name[0]==0)
+		return -1;
+	while (1)
+	{
+		const char *colon=strchr(path, ':');
+		int len=colon ? (int)(colon-path) : (int)strlen(path);
+		// an empty PATH entry means the current directory
+		snprintf(out, size, "%.*s/%s", len ? len : 1, len ? path : ".", name);
+		struct stat st;
+		if (access(out, X_OK)==0 && stat(out, &st)==0 && S_ISREG(st.st_mode))
+			return 0;
+		if (!colon)
+			return -1;
+		path=colon+1;
+	}
+}
 
-	//SAVE UNDER $HOME
-	char FILELOC[128];
+/**
+ * Run a command inside a forked child: a built-in, or an exec after
+ * resolving the command in PATH
+ * @param  command with args[0] set to the name and NULL terminated
+ * @param  h       [description]
+ * @param  exe     resolved path of an external command, NULL if not found
+ * @return         exit code of the child
+ */
+int exec_command(struct command_t *command, history *h, const char *exe)
+{
+	char path[4096];
+	struct builtin *b=command->external ? NULL : find_builtin(command->args[0]);
+	if (b && b->flags & BUILTIN_SHELL)
+	{
+		printf("E: %s changes the shell and can't run in a pipeline\n", command->args[0]);
+		return UNKNOWN;
+	}
+	if (b)
+	{
+		if (b->flags & BUILTIN_LOOP)
+			loop_subshell();
+		struct builtin_ctx ctx={ STDIN_FILENO, stdout, stderr, h, NULL };
+		int status=b->fn(command, &ctx);
+		if (status!=BUILTIN_EXTERNAL)
+			return status;
+		// the built-in can't do this one, the program in PATH may
+		if (resolve_path(command->args[0], path, sizeof(path))==0)
+			exe=path;
+	}
+
+	//Non-Builtins
+	//execvp(command->name, command->args); // exec+args+path
+	//exit(0);
+
+	/// TODO: do your own exec with path resolving using execv()
+	/// DONE, the shell resolves the path before forking (resolve_path)
+	if (exe != NULL)
+	{
+		trace_exec_begin();
+		execve(exe, command->args, var_environ());
+	}
+	// on stderr, so a capture like $(...) doesn't take it for output
+	fprintf(stderr, "%s\n", "E: command not found");
+	exit(127);
+}
+
+//PART I (No longer mandatory)
+int history_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	history *h=ctx->h;
+
+	//printf("Time to make history!\n");
+
+  	//numbered as !n refers to them, counting earlier sessions
+  	int ih = h->length - 1, L = hist_index_count();
+  	for(;ih>=0;ih--){
+  		fprintf(ctx->out, "%d %s\n", (L - ih), h->commands[ih]);
+  	}
+
+	return SUCCESS;
+}
+
+//PART III: Word finder for highlighting
+//Runs on a pipeline thread too, so it only writes to ctx and keeps no
+//state between lines outside its own stack.
+int highlight_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+
+	//printf("%d\n", command->arg_count);
+	if (command->arg_count == 5) {
+
+		const char *word = command->args[1];
+		const char *color = command->args[2];
+		const char *filename = command->args[3];
+
+		const char *start;
+		if (strcmp(color, "r") == 0)
+			start = COLOR_RED;
+		else if (strcmp(color, "g") == 0)
+			start = COLOR_GREEN;
+		else if (strcmp(color, "b") == 0)
+			start = COLOR_BLUE;
+		else
+			return SUCCESS; // no color, so no line is ever printed
+
+    		char * line = NULL;
+    		size_t len = 0;
+    		ssize_t read;
+
+		//on a pipeline thread /dev/stdin would be the shell's, not the pipe
+		int fromstdin = strcmp(filename, "-") == 0 || strcmp(filename, "/dev/stdin") == 0;
+		//the shell doesn't take SIGINT, so Ctrl+C couldn't stop a read of
+		//the terminal, and there is no program in PATH to hand it to
+		if (fromstdin && isatty(ctx->in)) {
+			fprintf(ctx->err, "-%s: highlight: won't read the terminal, give a file or a pipe\n", sysname);
+			return EXIT;
+		}
+    		FILE *f = fromstdin ? fdopen(fcntl(ctx->in, F_DUPFD_CLOEXEC, 0), "r") : fopen(filename, "r");
+    		if (f == NULL) {
+			fprintf(ctx->err, "-%s: highlight: %s: %s\n", sysname, filename, strerror(errno));
+        		return EXIT;
+		}
+
+		//we are copying whole line to this one token by token
+		struct buffer lineAbouttaBePrinted = {0};
+		//getting each line
+   			while (!builtin_cancelled(ctx) && (read = getline(&line, &len, f)) != -1) {
+
+			//Checks that the line should be printed or not
+			int stringsOfColor = 0;
+			lineAbouttaBePrinted.len = 0;
+        		//tokenizing string
+			char *save;
+			char *token = strtok_r(line, " \t\n", &save);
+			//going through tokens until the end of line
+			while(token != NULL) {
+				//checking whether this token is what we are looking for
+				if(strcasecmp(token, word) == 0) {
+					//Turn the string into the color
+					buffer_append(&lineAbouttaBePrinted, start, strlen(start));
+					buffer_append(&lineAbouttaBePrinted, "\e[5m\e[1m", 8);
+					buffer_append(&lineAbouttaBePrinted, token, strlen(token));
+					buffer_append(&lineAbouttaBePrinted, "\033[1m\033[0m", 8);
+					stringsOfColor = 1;
+				}
+				else
+					buffer_append(&lineAbouttaBePrinted, token, strlen(token));
+				//Adding the token to the reconstructed line
+				buffer_append(&lineAbouttaBePrinted, " ", 1);
+				//Tokenizing for the next loop
+				token = strtok_r(NULL, " \t\n", &save);
+			}
+			//If stringsOfColor exists we are printling the whole line
+			if(stringsOfColor == 1) {
+				fprintf(ctx->out, "%s\n", lineAbouttaBePrinted.data);
+			}
+    		}
+
+    		fclose(f);
+		free(lineAbouttaBePrinted.data);
+
+    		if (line)
+        		free(line);
+	}
+	return SUCCESS;
+}
+
+//PART V: kdiff
+int kdiff_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+
+	//printf("NOT Implemented\n");
+	
+	//SWITCH
+	//printf("%d\n", command->arg_count);
+	int mode = 0;
+	if(command->arg_count == 4) mode = 0;
+	else if(command->arg_count == 5){
+		char c;
+		sscanf(command->args[1], "-%c", &c);
+		
+		mode = ((c=='a')?0:1);
+		//printf("Mode: %d\n",mode);
+	}
+	else{
+		fprintf(ctx->err, "E: Incorrect number of arguments for kdiff (2 or 3) \n");
+		return EXIT;
+	}
+
+	//printf("MODE: %d\n",mode);
+
+	//Check file names
+
+	char filename1[2048], filename2[2048];
+
+	if(command->arg_count == 4){
+		strcpy(filename1,command->args[1]);
+		strcpy(filename2,command->args[2]);
+	}
+	else if(command->arg_count == 5){
+		strcpy(filename1,command->args[2]);
+		strcpy(filename2,command->args[3]);
+	}
+	else{
+		//printf("WE'VE GOT A PROBLEM CHIEF\n");
+		return EXIT;
+	}
+	//DIRECTORY MODE
+	//Two directories are compared recursively by relative path
+	struct stat st1, st2;
+	int isdir1 = (stat(filename1, &st1) == 0 && S_ISDIR(st1.st_mode));
+	int isdir2 = (stat(filename2, &st2) == 0 && S_ISDIR(st2.st_mode));
+	if (isdir1 && isdir2)
+		return kdiff_directories(ctx, filename1, filename2);
+	if (isdir1 || isdir2){
+		fprintf(ctx->err, "E: Cannot compare a directory with a file\n");
+		return EXIT;
+	}
+
+	//PART B (mode = 1)
+	//BLOCK DELTA, the .txt restriction only applies to line mode
+	if (mode == 1)
+		return kdiff_blocks(ctx, filename1, filename2);
+
+	//Make sure .txt
+	if(!has_extension(filename1, "txt")) {
+		fprintf(ctx->err, "E: File 1 is not a .txt file\n");
+		return EXIT;
+	}
+	if(!has_extension(filename2, "txt")) {
+		fprintf(ctx->err, "E: File 2 is not a .txt file\n");
+		return EXIT;
+	}
+
+	//identical flag
+	int identical = 1;
+
+	//first line
+	int firstline = 1;
+
+	//file end reached flags
+	int f1ended = 0, f2ended=0;
+
+	int linecount = -1, mislinecount=0;
+
+	char * line1 = NULL, *line2 = NULL;
+    size_t len1 = 0, len2 = 0; // one per line, getline grows each buffer
+    //ssize_t read;
+
+	//PART A (mode = 0)
+	//LINE BY LINE
+	if(mode==0){
+
+		FILE *f1 = fopen(filename1, "r");
+		//FILE *f2 = f1;
+		FILE *f2 = fopen(filename2, "r");
+	    if ( (f1 == NULL) || (f2 == NULL) ){
+	    	//printf("ERROR: %d %d\n", (int)(f1), (int)(f2));
+	    	fprintf(ctx->err, "-%s: kdiff: %s: %s\n", sysname, f1 ? filename2 : filename1, strerror(errno));
+	    	if (f1) fclose(f1);
+	    	if (f2) fclose(f2);
+	        return EXIT;
+	    }
+
+	    while ( (!f1ended || !f2ended) && !builtin_cancelled(ctx) ) {
+
+	    	linecount++;
+
+	    	if (firstline){
+	    		firstline=0;
+	    	}
+	    	//Compare strings
+	    	else if(!f1ended && f2ended){
+	    		fprintf(ctx->out, "%s:Line %d: %s\n", filename1,linecount,line1);
+	    		mislinecount++;
+	    		identical=0;
+	    	}
+	    	else if(f1ended && !f2ended){
+	    		fprintf(ctx->out, "%s:Line %d: %s\n", filename2,linecount,line2);
+	    		mislinecount++;
+	    		identical=0;
+	    	}
+	    	else if(strcmp(line1,line2) != 0){
+	    		fprintf(ctx->out, "%s:Line %d: %s\n", filename1,linecount,line1);
+	    		fprintf(ctx->out, "%s:Line %d: %s\n", filename2,linecount,line2);
+	    		mislinecount++;
+	    		identical=0;
+	    	}
+
+	    	//Read one line from each
+	    	if(getline(&line1, &len1, f1) == -1){
+	    		f1ended=1;
+	    	}
+	    	if(getline(&line2, &len2, f2) == -1){
+	    		f2ended=1;
+	    	}
+
+	    }
+	    fclose(f1);
+	    fclose(f2);
+	    free(line1);
+	    free(line2);
+	    if (builtin_cancelled(ctx))
+	    	return SUCCESS; // stopped part way, no summary
+
+	    //Identical?
+
+	    if(identical){
+	    	fprintf(ctx->out, "The two files are identical\n\n");
+	    }else{
+	    	if(mislinecount==1)
+	    		fprintf(ctx->out, "1 different line found\n\n");
+	    	else
+	    		fprintf(ctx->out, "%d different lines found\n\n", mislinecount);
+	    }
+	}
+
+	return SUCCESS;
+}
+
+//PART VI: favorite command
+int myfavorite_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	history *h=ctx->h;
+
+	//printf("NOT Implemented\n");
+	
+	//h->commands[0]; h->length;
+	
+	int checked[HISTORYSIZE], countOf[HISTORYSIZE];
+	memset(checked, 0, HISTORYSIZE*sizeof(int));
+	memset(countOf, 0, HISTORYSIZE*sizeof(int));
+	
+	//Step 1: Loop over commands
+	//If not checked mark and begin counting
+	//If checked continue
+	int i,j;
+	for(i = 0; i < h->length;i++){
+		if(checked[i]) continue;
+		//Not checked before, checking now
+		countOf[i] = checked[i] = 1;
+		for(j = i + 1; j < h->length ;j++){
+			if(checked[j]) continue;
+			//Not matched before, attempting to match now
+			else if(strcmp(h->commands[i],h->commands[j])==0){
+				countOf[i] += checked[j] = 1;
+			}
+		}
+	}
+	
+	//Step 2: Loop over count to find largest count
+	int fav=-1, favcount=-1;
+	for(i = 0; i < h->length ;i++){
+		if(countOf[i] > favcount){
+			favcount = countOf[i];
+			fav = i;
+		}
+	}
+	
+	//Step 3: Return corresponding string with largest count
+	fprintf(ctx->out, "Your favorite command lately is %s (%d/%d)\n", h->commands[fav], favcount,h->length);
+	
+	    /* checked   count
+		a 1        2
+		b 1        3
+		c 1        1
+		d 1        1
+		b 1        0
+		a 1        0
+		b 1        0
+	    */
+
+	/*printf("\tChecked:\tCount:\tCommand:\n");
+	for(i = h->length - 1; i >= 0 ;i--){
+		printf("\t%d\t%d\t%s\n", checked[i],countOf[i],h->commands[i]);
+	}*/
+
+	return SUCCESS;
+}
+
+int save_aliases(shortdir *shortdirs){
+	//printf("BUG: Make sure aliases.txt and alarm.txt is saved to the root directory (not temp/aliases.txt)\nConsider using getcwd()!\n");
+
+	//SAVE UNDER $HOME
+	char FILELOC[128];
 	memset(FILELOC,0,128*sizeof(char));
 	strcat(FILELOC,getenv("HOME"));
 	strcat(FILELOC,aliasfile);
@@ -1165,3 +2616,6146 @@ void load_aliases(shortdir *shortdirs){
 	}*/
 }
 
+
+/**
+ * Check whether a filename ends with the given extension
+ * Only the last dot counts, so "a.tar.txt" has the extension "txt"
+ * @param  filename [description]
+ * @param  ext      extension without the dot
+ * @return          1 if it matches, 0 otherwise
+ */
+int has_extension(const char *filename, const char *ext)
+{
+	const char *base = strrchr(filename, '/');
+	base = base ? base + 1 : filename;
+	const char *dot = strrchr(base, '.');
+	if (dot == NULL || dot == base)
+		return 0;
+	return strcmp(dot + 1, ext) == 0;
+}
+
+//KDIFF DIRECTORY MODE
+
+#define KDIFF_CHUNK (256*1024)
+#define KDIFF_MAXTHREADS 16
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+static uint64_t xxh_read64(const unsigned char *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static uint32_t xxh_read32(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = xxh_rotl(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/**
+ * 64-bit xxHash of a buffer
+ * @param  data [description]
+ * @param  len  [description]
+ * @param  seed [description]
+ * @return      the digest
+ */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data, *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = seed + XXH_PRIME64_2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME64_1;
+		const unsigned char *limit = end - 32;
+		do {
+			v1 = xxh_round(v1, xxh_read64(p)); p += 8;
+			v2 = xxh_round(v2, xxh_read64(p)); p += 8;
+			v3 = xxh_round(v3, xxh_read64(p)); p += 8;
+			v4 = xxh_round(v4, xxh_read64(p)); p += 8;
+		} while (p <= limit);
+		h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	}
+	else
+		h = seed + XXH_PRIME64_5;
+
+	h += (uint64_t)len;
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh_round(0, xxh_read64(p));
+		h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+		h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= (*p) * XXH_PRIME64_5;
+		h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+struct kdiff_entry {
+	char *rel; // path relative to the tree root
+	off_t size;
+	struct timespec mtime;
+	mode_t mode;
+};
+
+struct kdiff_tree {
+	struct kdiff_entry *entries;
+	int count;
+	int cap;
+};
+
+struct kdiff_job {
+	const struct kdiff_entry *a, *b;
+	int changed;
+};
+
+struct kdiff_pool {
+	const char *root1, *root2;
+	struct kdiff_job **jobs;
+	int njobs;
+	int next; // next job index, taken atomically by workers
+	volatile int *cancel; // from the built-in's ctx, workers stop taking jobs
+};
+
+static int kdiff_entry_cmp(const void *x, const void *y)
+{
+	return strcmp(((const struct kdiff_entry *)x)->rel, ((const struct kdiff_entry *)y)->rel);
+}
+
+/**
+ * Recursively collect regular files and symlinks below root/rel
+ * @param  root [description]
+ * @param  rel  relative directory, "" for the root itself
+ * @param  t    tree to append to
+ */
+static void kdiff_walk(struct builtin_ctx *ctx, const char *root, const char *rel, struct kdiff_tree *t)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", root, rel); // fit as childpath below
+	DIR *d = opendir(path);
+	if (d == NULL) {
+		fprintf(ctx->err, "-%s: kdiff: %s: %s\n", sysname, path, strerror(errno));
+		return;
+	}
+
+	struct dirent *de;
+	while (!builtin_cancelled(ctx) && (de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		char childrel[PATH_MAX], childpath[PATH_MAX];
+		int n = rel[0] ? snprintf(childrel, sizeof(childrel), "%s/%s", rel, de->d_name)
+			: snprintf(childrel, sizeof(childrel), "%s", de->d_name);
+		//a cut path would name some other file
+		if (n >= (int)sizeof(childrel)
+			|| snprintf(childpath, sizeof(childpath), "%s/%s", root, childrel) >= (int)sizeof(childpath)) {
+			fprintf(ctx->err, "-%s: kdiff: %s/%s: %s\n", sysname, path, de->d_name, strerror(ENAMETOOLONG));
+			continue;
+		}
+
+		struct stat st;
+		if (lstat(childpath, &st) == -1)
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			kdiff_walk(ctx, root, childrel, t);
+			continue;
+		}
+		if (!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode))
+			continue;
+
+		if (t->count == t->cap) {
+			t->cap = t->cap ? t->cap * 2 : 256;
+			t->entries = realloc(t->entries, sizeof(struct kdiff_entry) * t->cap);
+		}
+		struct kdiff_entry *e = &t->entries[t->count++];
+		e->rel = strdup(childrel);
+		e->size = st.st_size;
+		e->mtime = st.st_mtim;
+		e->mode = st.st_mode;
+	}
+	closedir(d);
+}
+
+/**
+ * Compare two files chunk by chunk with xxh64, stopping at the first
+ * chunk whose digests differ. Both files are known to have the same size.
+ * @return 1 if the contents differ, 0 if they match
+ */
+static int kdiff_hash_compare(const char *path1, const char *path2, const struct kdiff_entry *e,
+	unsigned char *buf1, unsigned char *buf2)
+{
+	if (S_ISLNK(e->mode)) {
+		ssize_t n1 = readlink(path1, (char *)buf1, KDIFF_CHUNK);
+		ssize_t n2 = readlink(path2, (char *)buf2, KDIFF_CHUNK);
+		return n1 != n2 || n1 < 0 || xxh64(buf1, n1, 0) != xxh64(buf2, n2, 0);
+	}
+
+	int fd1 = open(path1, O_RDONLY), fd2 = open(path2, O_RDONLY);
+	int changed = 0;
+	if (fd1 == -1 || fd2 == -1) {
+		changed = 1;
+		goto done;
+	}
+	posix_fadvise(fd1, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fd2, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while (1) {
+		ssize_t n1 = read(fd1, buf1, KDIFF_CHUNK);
+		ssize_t n2 = read(fd2, buf2, KDIFF_CHUNK);
+		// short reads are only expected at the end, retry until the chunks line up
+		while (n1 > 0 && n1 < n2) {
+			ssize_t r = read(fd1, buf1 + n1, n2 - n1);
+			if (r <= 0) break;
+			n1 += r;
+		}
+		while (n2 > 0 && n2 < n1) {
+			ssize_t r = read(fd2, buf2 + n2, n1 - n2);
+			if (r <= 0) break;
+			n2 += r;
+		}
+		if (n1 != n2 || n1 < 0) {
+			changed = 1;
+			break;
+		}
+		if (n1 == 0)
+			break;
+		if (xxh64(buf1, n1, 0) != xxh64(buf2, n2, 0)) {
+			changed = 1;
+			break;
+		}
+	}
+
+done:
+	if (fd1 != -1) close(fd1);
+	if (fd2 != -1) close(fd2);
+	return changed;
+}
+
+static void *kdiff_worker(void *arg)
+{
+	struct kdiff_pool *pool = arg;
+	unsigned char *buf1 = malloc(KDIFF_CHUNK), *buf2 = malloc(KDIFF_CHUNK);
+	char path1[PATH_MAX], path2[PATH_MAX]; // fit, kdiff_walk skipped longer ones
+
+	while (1) {
+		int i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+		if (i >= pool->njobs || (pool->cancel && *pool->cancel))
+			break;
+		struct kdiff_job *job = pool->jobs[i];
+		snprintf(path1, sizeof(path1), "%s/%s", pool->root1, job->a->rel);
+		snprintf(path2, sizeof(path2), "%s/%s", pool->root2, job->b->rel);
+		job->changed = kdiff_hash_compare(path1, path2, job->a, buf1, buf2);
+	}
+
+	free(buf1);
+	free(buf2);
+	return NULL;
+}
+
+/**
+ * kdiff for two directory trees
+ * Files are paired by relative path. Pairs with different sizes or types
+ * are changed, pairs with equal size and mtime are assumed identical and
+ * everything else is hashed in parallel on a small thread pool.
+ * @param  dir1 [description]
+ * @param  dir2 [description]
+ * @return      SUCCESS
+ */
+int kdiff_directories(struct builtin_ctx *ctx, const char *dir1, const char *dir2)
+{
+	struct kdiff_tree t1 = {0}, t2 = {0};
+	kdiff_walk(ctx, dir1, "", &t1);
+	kdiff_walk(ctx, dir2, "", &t2);
+	qsort(t1.entries, t1.count, sizeof(struct kdiff_entry), kdiff_entry_cmp);
+	qsort(t2.entries, t2.count, sizeof(struct kdiff_entry), kdiff_entry_cmp);
+
+	//Merge the two sorted lists, every pair gets a job slot
+	int maxpairs = (t1.count < t2.count ? t1.count : t2.count) + 1;
+	int npairs = 0;
+	struct kdiff_job *jobs = malloc(sizeof(struct kdiff_job) * maxpairs);
+	struct kdiff_job **tohash = malloc(sizeof(struct kdiff_job *) * maxpairs);
+	int nhash = 0;
+	int i = 0, j = 0;
+	while (i < t1.count && j < t2.count) {
+		int c = strcmp(t1.entries[i].rel, t2.entries[j].rel);
+		if (c < 0) { i++; continue; }
+		if (c > 0) { j++; continue; }
+		struct kdiff_entry *a = &t1.entries[i++], *b = &t2.entries[j++];
+		struct kdiff_job *job = &jobs[npairs++];
+		job->a = a;
+		job->b = b;
+		if ((a->mode & S_IFMT) != (b->mode & S_IFMT) || a->size != b->size)
+			job->changed = 1;
+		else if (a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec)
+			job->changed = 0;
+		else
+			tohash[nhash++] = job;
+	}
+
+	//Hash the remaining pairs on a thread pool
+	if (nhash > 0) {
+		struct kdiff_pool pool = { dir1, dir2, tohash, nhash, 0, ctx->cancel };
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		int nthreads = ncpu > 0 ? (int)ncpu : 1;
+		if (nthreads > KDIFF_MAXTHREADS) nthreads = KDIFF_MAXTHREADS;
+		if (nthreads > nhash) nthreads = nhash;
+
+		pthread_t threads[KDIFF_MAXTHREADS];
+		int started = 0;
+		for (; started < nthreads - 1; started++)
+			if (pthread_create(&threads[started], NULL, kdiff_worker, &pool) != 0)
+				break;
+		kdiff_worker(&pool); // the calling thread works too
+		for (int k = 0; k < started; k++)
+			pthread_join(threads[k], NULL);
+	}
+
+	//Report in path order
+	int added = 0, removed = 0, changed = 0, p = 0;
+	i = j = 0;
+	if (builtin_cancelled(ctx))
+		goto done; // the walk or the hashing stopped part way
+	while (i < t1.count || j < t2.count) {
+		int c = (i == t1.count) ? 1 : (j == t2.count) ? -1 : strcmp(t1.entries[i].rel, t2.entries[j].rel);
+		if (c < 0) {
+			fprintf(ctx->out, "- %s\n", t1.entries[i++].rel);
+			removed++;
+		}
+		else if (c > 0) {
+			fprintf(ctx->out, "+ %s\n", t2.entries[j++].rel);
+			added++;
+		}
+		else {
+			if (jobs[p++].changed) {
+				fprintf(ctx->out, "~ %s\n", t1.entries[i].rel);
+				changed++;
+			}
+			i++;
+			j++;
+		}
+	}
+
+	if (added + removed + changed == 0)
+		fprintf(ctx->out, "The two directories are identical\n\n");
+	else
+		fprintf(ctx->out, "%d added, %d removed, %d changed\n\n", added, removed, changed);
+
+done:
+	for (i = 0; i < t1.count; i++) free(t1.entries[i].rel);
+	for (j = 0; j < t2.count; j++) free(t2.entries[j].rel);
+	free(t1.entries);
+	free(t2.entries);
+	free(jobs);
+	free(tohash);
+	return SUCCESS;
+}
+
+//KDIFF BLOCK DELTA (-b)
+
+#define KDIFF_MINBLOCK 512
+#define KDIFF_MAXBLOCK (64*1024)
+#define KDIFF_MAXREGIONS 64
+
+struct kdiff_block {
+	uint32_t weak;
+	uint64_t strong;
+	int next; // next block in the same weak hash bucket, -1 ends the chain
+};
+
+struct kdiff_index {
+	struct kdiff_block *blocks;
+	int nblocks;    // full blocks only
+	int *buckets;
+	uint32_t mask;
+	int blocksize;
+	int taillen;    // size of the trailing partial block
+	uint32_t tailweak;
+	uint64_t tailstrong;
+};
+
+struct kdiff_region {
+	int type;       // 0 matched in order, 1 moved (out of order), 2 literal
+	off_t start;    // offset in file 2
+	off_t len;
+	off_t from;     // offset in file 1 for matched/moved
+	int printed;
+	off_t bytes[3];
+	FILE *out;
+};
+
+/**
+ * rsync's weak checksum of a block: a = sum of bytes, b = sum of prefix sums
+ */
+static uint32_t kdiff_weak(const unsigned char *p, int len, uint32_t *a, uint32_t *b)
+{
+	uint32_t s1 = 0, s2 = 0;
+	for (int i = 0; i < len; i++) {
+		s1 += p[i];
+		s2 += (uint32_t)(len - i) * p[i];
+	}
+	*a = s1 & 0xffff;
+	*b = s2 & 0xffff;
+	return *a | (*b << 16);
+}
+
+static uint32_t kdiff_bucket(uint32_t weak, uint32_t mask)
+{
+	return (weak * 2654435761u) & mask;
+}
+
+static ssize_t kdiff_fill(int fd, unsigned char *buf, size_t want)
+{
+	size_t got = 0;
+	while (got < want) {
+		ssize_t r = read(fd, buf + got, want - got);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) break;
+		got += r;
+	}
+	return got;
+}
+
+/**
+ * Index every block of file 1 with a weak and a strong checksum
+ * @return 0 on success, -1 if the file can't be read
+ */
+static int kdiff_build_index(const char *file, struct kdiff_index *idx, struct builtin_ctx *ctx)
+{
+	int fd = open(file, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		if (fd != -1) close(fd);
+		return -1;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	//block size grows with the square root of the file, like rsync
+	int bs = KDIFF_MINBLOCK;
+	while (bs < KDIFF_MAXBLOCK && (off_t)bs * bs < st.st_size)
+		bs <<= 1;
+	idx->blocksize = bs;
+	idx->nblocks = 0;
+	idx->taillen = 0;
+	idx->tailweak = 0;
+	idx->tailstrong = 0;
+
+	int cap = st.st_size / bs + 1;
+	idx->blocks = malloc(sizeof(struct kdiff_block) * cap);
+	uint32_t nb = 16;
+	while (nb < (uint32_t)cap * 2) nb <<= 1;
+	idx->mask = nb - 1;
+	idx->buckets = malloc(sizeof(int) * nb);
+	memset(idx->buckets, 0xff, sizeof(int) * nb);
+
+	unsigned char *buf = malloc(bs);
+	ssize_t n;
+	uint32_t a, b;
+	while (!builtin_cancelled(ctx) && (n = kdiff_fill(fd, buf, bs)) > 0) {
+		if (n < bs) {
+			idx->taillen = n;
+			idx->tailweak = kdiff_weak(buf, n, &a, &b);
+			idx->tailstrong = xxh64(buf, n, 0);
+			break;
+		}
+		if (idx->nblocks == cap) {
+			cap *= 2;
+			idx->blocks = realloc(idx->blocks, sizeof(struct kdiff_block) * cap);
+		}
+		struct kdiff_block *blk = &idx->blocks[idx->nblocks];
+		blk->weak = kdiff_weak(buf, bs, &a, &b);
+		blk->strong = xxh64(buf, bs, 0);
+		uint32_t h = kdiff_bucket(blk->weak, idx->mask);
+		blk->next = idx->buckets[h];
+		idx->buckets[h] = idx->nblocks++;
+	}
+
+	free(buf);
+	close(fd);
+	return 0;
+}
+
+static void kdiff_print_region(struct kdiff_region *r)
+{
+	static const char *names[] = { "matched", "moved", "literal" };
+	if (r->len <= 0 || r->printed++ >= KDIFF_MAXREGIONS)
+		return;
+	if (r->type == 2)
+		fprintf(r->out, "  %10lld +%-10lld %s\n", (long long)r->start, (long long)r->len, names[r->type]);
+	else
+		fprintf(r->out, "  %10lld +%-10lld %s from %lld\n", (long long)r->start, (long long)r->len,
+			names[r->type], (long long)r->from);
+}
+
+/**
+ * Append a run to the delta, merging it with the previous run when it
+ * continues it. Only the first KDIFF_MAXREGIONS runs are printed.
+ */
+static void kdiff_emit(struct kdiff_region *r, int type, off_t start, off_t len, off_t from)
+{
+	if (len <= 0)
+		return;
+	r->bytes[type] += len;
+	if (r->len > 0 && r->type == type && r->start + r->len == start
+		&& (type == 2 || r->from + r->len == from)) {
+		r->len += len;
+		return;
+	}
+	kdiff_print_region(r);
+	r->type = type;
+	r->start = start;
+	r->len = len;
+	r->from = from;
+}
+
+/**
+ * kdiff -b: rsync-style delta of file 2 against file 1
+ * File 1 is indexed block by block, then file 2 is streamed through a
+ * rolling checksum window and described as blocks matched in order,
+ * blocks moved from elsewhere and literal bytes. Memory use is bounded by
+ * the block index plus one fixed size read buffer.
+ * @param  file1 [description]
+ * @param  file2 [description]
+ * @return       SUCCESS, or UNKNOWN when a file can't be read
+ */
+int kdiff_blocks(struct builtin_ctx *ctx, const char *file1, const char *file2)
+{
+	struct kdiff_index idx;
+	if (kdiff_build_index(file1, &idx, ctx) == -1) {
+		fprintf(ctx->err, "-%s: kdiff: %s: %s\n", sysname, file1, strerror(errno));
+		return UNKNOWN;
+	}
+	int fd = builtin_cancelled(ctx) ? -1 : open(file2, O_RDONLY);
+	if (fd == -1) {
+		if (builtin_cancelled(ctx)) {
+			free(idx.blocks);
+			free(idx.buckets);
+			return SUCCESS;
+		}
+		fprintf(ctx->err, "-%s: kdiff: %s: %s\n", sysname, file2, strerror(errno));
+		free(idx.blocks);
+		free(idx.buckets);
+		return UNKNOWN;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	const int bs = idx.blocksize;
+	const size_t cap = bs * 8 > 256 * 1024 ? bs * 8 : 256 * 1024;
+	unsigned char *buf = malloc(cap);
+	size_t have = 0, pos = 0; // valid bytes in buf, window start in buf
+	off_t base = 0;           // file 2 offset of buf[0]
+	off_t literal = 0;        // start of the pending literal run
+	int eof = 0, rolling = 0;
+	int expect = 0;           // blocks below this one would be out of order
+	uint32_t a = 0, b = 0;
+	struct kdiff_region r = { .out = ctx->out };
+
+	fprintf(ctx->out, "%s -> %s: block size %d, %d blocks indexed\n", file1, file2, bs, idx.nblocks);
+
+	while (1) {
+		//keep a whole window in the buffer, sliding it forward as needed
+		if (!eof && have - pos <= (size_t)bs) {
+			if (builtin_cancelled(ctx))
+				goto done;
+			memmove(buf, buf + pos, have - pos);
+			base += pos;
+			have -= pos;
+			pos = 0;
+			ssize_t n = kdiff_fill(fd, buf + have, cap - have);
+			if (n <= 0) eof = 1;
+			have += n > 0 ? n : 0;
+		}
+		size_t avail = have - pos;
+		if (avail < (size_t)bs)
+			break;
+
+		unsigned char *win = buf + pos;
+		if (!rolling) {
+			kdiff_weak(win, bs, &a, &b);
+			rolling = 1;
+		}
+		uint32_t weak = a | (b << 16);
+
+		int hit = -1;
+		int h = idx.buckets[kdiff_bucket(weak, idx.mask)];
+		if (h != -1) {
+			uint64_t strong = 0;
+			int hashed = 0;
+			//prefer the block that continues the current run
+			for (int k = h; k != -1; k = idx.blocks[k].next) {
+				if (idx.blocks[k].weak != weak)
+					continue;
+				if (!hashed) {
+					strong = xxh64(win, bs, 0);
+					hashed = 1;
+				}
+				if (idx.blocks[k].strong != strong)
+					continue;
+				hit = k;
+				if (k == expect)
+					break;
+			}
+		}
+
+		off_t off = base + pos;
+		if (hit != -1) {
+			kdiff_emit(&r, 2, literal, off - literal, 0);
+			kdiff_emit(&r, hit >= expect ? 0 : 1, off, bs, (off_t)hit * bs);
+			expect = hit + 1;
+			pos += bs;
+			literal = base + pos;
+			rolling = 0;
+			continue;
+		}
+
+		//no match, roll the window by one byte
+		if (avail == (size_t)bs && eof) {
+			pos++;
+			break;
+		}
+		unsigned char out = win[0], in = win[bs];
+		a = (a - out + in) & 0xffff;
+		b = (b - (uint32_t)bs * out + a) & 0xffff;
+		pos++;
+	}
+
+	//whatever is left is shorter than a block, it can only be file 1's tail
+	size_t rest = have - pos;
+	if (idx.taillen > 0 && rest == (size_t)idx.taillen && literal == base + (off_t)pos) {
+		uint32_t ta, tb;
+		if (kdiff_weak(buf + pos, rest, &ta, &tb) == idx.tailweak
+			&& xxh64(buf + pos, rest, 0) == idx.tailstrong) {
+			kdiff_emit(&r, idx.nblocks >= expect ? 0 : 1, base + pos, rest, (off_t)idx.nblocks * bs);
+			literal = base + have;
+		}
+	}
+	kdiff_emit(&r, 2, literal, base + have - literal, 0);
+	kdiff_print_region(&r);
+	if (r.printed > KDIFF_MAXREGIONS)
+		fprintf(ctx->out, "  ... %d more regions\n", r.printed - KDIFF_MAXREGIONS);
+
+	off_t total = base + have;
+
+	off_t size1 = (off_t)idx.nblocks * bs + idx.taillen;
+	if (r.bytes[1] == 0 && r.bytes[2] == 0 && total == size1)
+		fprintf(ctx->out, "The two files are identical\n\n");
+	else
+		fprintf(ctx->out, "%lld bytes matched, %lld moved, %lld literal (%.1f%% reused)\n\n",
+			(long long)r.bytes[0], (long long)r.bytes[1], (long long)r.bytes[2],
+			total ? 100.0 * (r.bytes[0] + r.bytes[1]) / total : 100.0);
+
+done:
+	free(buf);
+	free(idx.blocks);
+	free(idx.buckets);
+	close(fd);
+	return SUCCESS;
+}
+
+//TIMER SCHEDULER
+//Jobs live in a hierarchical timing wheel with one second ticks: level 0
+//holds jobs due within 64s, level 1 within 64^2s and so on. A single
+//timerfd wakes the event loop once per second while jobs are pending, each
+//tick only touches one slot, and upper levels cascade down as time
+//passes, so the cost per tick does not grow with the number of jobs.
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_RANGE ((time_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+#define DAY_SECONDS 86400
+
+struct timer_job {
+	char name[64];
+	char *line;     // command line, run through the shell's own parser
+	time_t due;
+	int period;     // seconds between runs, 0 for one shot jobs
+	struct timer_job *next, *prev; // wheel slot list
+	struct timer_job *chain;       // next in the same name bucket
+};
+
+struct scheduler {
+	struct timer_job *slots[WHEEL_LEVELS][WHEEL_SIZE];
+	time_t now;     // last processed tick
+	int count;
+	int fd;         // timerfd, -1 when unavailable
+	int armed;
+	int dirty;      // the file on disk is out of date
+	history *h;
+	shortdir *shortdirs;
+	struct timer_job **names; // jobs by name, chained
+	int nnames;               // buckets, power of two
+};
+
+static struct scheduler sched = { .fd = -1 };
+
+static void scheduler_link(struct timer_job *job)
+{
+	time_t due = job->due <= sched.now ? sched.now + 1 : job->due;
+	time_t delta = due - sched.now;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >= ((time_t)1 << (WHEEL_BITS * (level + 1))))
+		level++;
+	if (delta >= WHEEL_RANGE) // far future, parked and re-filed when cascaded
+		due = sched.now + WHEEL_RANGE - 1;
+	int slot = (due >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+
+	job->prev = NULL;
+	job->next = sched.slots[level][slot];
+	if (job->next)
+		job->next->prev = job;
+	sched.slots[level][slot] = job;
+}
+
+static void scheduler_unlink(struct timer_job *job)
+{
+	if (job->prev)
+		job->prev->next = job->next;
+	else {
+		//head of some slot, find which one
+		for (int l = 0; l < WHEEL_LEVELS; l++)
+			for (int i = 0; i < WHEEL_SIZE; i++)
+				if (sched.slots[l][i] == job)
+					sched.slots[l][i] = job->next;
+	}
+	if (job->next)
+		job->next->prev = job->prev;
+	job->next = job->prev = NULL;
+}
+
+/**
+ * Start or stop the one second tick depending on whether jobs are pending
+ */
+static void scheduler_arm()
+{
+	if (sched.fd == -1)
+		return;
+	int want = sched.count > 0;
+	if (want == sched.armed)
+		return;
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (want) {
+		//tick on whole seconds of the wall clock
+		its.it_value.tv_sec = time(NULL) + 1;
+		its.it_interval.tv_sec = 1;
+	}
+	timerfd_settime(sched.fd, TFD_TIMER_ABSTIME, &its, NULL);
+	sched.armed = want;
+}
+
+/**
+ * Visit every pending job
+ */
+static void scheduler_foreach(void (*fn)(struct timer_job *, void *), void *arg)
+{
+	for (int l = 0; l < WHEEL_LEVELS; l++)
+		for (int i = 0; i < WHEEL_SIZE; i++)
+			for (struct timer_job *j = sched.slots[l][i], *n; j; j = n) {
+				n = j->next;
+				fn(j, arg);
+			}
+}
+
+static struct timer_job **scheduler_bucket(const char *name)
+{
+	return &sched.names[xxh64(name, strlen(name), 0) & (sched.nnames - 1)];
+}
+
+static struct timer_job *scheduler_find(const char *name)
+{
+	if (sched.nnames == 0)
+		return NULL;
+	for (struct timer_job *j = *scheduler_bucket(name); j; j = j->chain)
+		if (strcmp(j->name, name) == 0)
+			return j;
+	return NULL;
+}
+
+/**
+ * Index a new job by name, doubling the buckets to keep chains short
+ */
+static void scheduler_index(struct timer_job *job)
+{
+	if (sched.count >= sched.nnames) {
+		int n = sched.nnames ? sched.nnames * 2 : 64;
+		struct timer_job **old = sched.names;
+		int nold = sched.nnames;
+		sched.names = calloc(n, sizeof(struct timer_job *));
+		sched.nnames = n;
+		for (int i = 0; i < nold; i++)
+			for (struct timer_job *j = old[i], *next; j; j = next) {
+				next = j->chain;
+				struct timer_job **b = scheduler_bucket(j->name);
+				j->chain = *b;
+				*b = j;
+			}
+		free(old);
+	}
+	struct timer_job **b = scheduler_bucket(job->name);
+	job->chain = *b;
+	*b = job;
+}
+
+static void scheduler_write_job(struct timer_job *job, void *arg)
+{
+	fprintf((FILE *)arg, "%s %lld %d %s\n", job->name, (long long)job->due, job->period, job->line);
+}
+
+/**
+ * Path of the jobs file under $HOME
+ * @param  path PATH_MAX bytes
+ * @return      0, or -1 when it doesn't fit and would name another file
+ */
+static int scheduler_file(char *path)
+{
+	return snprintf(path, PATH_MAX, "%s%s", getenv("HOME"), alarmfile) < PATH_MAX ? 0 : -1;
+}
+
+/**
+ * Save the pending jobs under $HOME
+ */
+static void scheduler_save()
+{
+	char FILELOC[PATH_MAX];
+	FILE *fptr = scheduler_file(FILELOC) == 0 ? fopen(FILELOC, "w") : NULL;
+	if (fptr == NULL) {
+		printf("Error! Can't save alarms!\n");
+		return;
+	}
+	scheduler_foreach(scheduler_write_job, fptr);
+	fclose(fptr);
+	sched.dirty = 0;
+}
+
+/**
+ * Add a job, replacing any job with the same name
+ */
+static void scheduler_add(const char *name, time_t due, int period, const char *line)
+{
+	struct timer_job *job = scheduler_find(name);
+	if (job) {
+		scheduler_unlink(job);
+		free(job->line);
+	}
+	else {
+		job = malloc(sizeof(struct timer_job));
+		memset(job, 0, sizeof(struct timer_job));
+		snprintf(job->name, sizeof(job->name), "%s", name);
+		scheduler_index(job);
+		sched.count++;
+	}
+	job->line = strdup(line);
+	job->due = due;
+	job->period = period;
+	scheduler_link(job);
+	sched.dirty = 1;
+	scheduler_arm();
+}
+
+static void scheduler_free(struct timer_job *job)
+{
+	struct timer_job **link = scheduler_bucket(job->name);
+	while (*link != job)
+		link = &(*link)->chain;
+	*link = job->chain;
+	free(job->line);
+	free(job);
+	sched.count--;
+}
+
+/**
+ * Next run of a periodic job. Daily jobs follow the local calendar so
+ * an alarm stays at the same time of day across DST changes.
+ */
+static time_t scheduler_next(time_t due, int period)
+{
+	if (period == DAY_SECONDS) {
+		struct tm tm = *localtime(&due);
+		tm.tm_mday++;
+		tm.tm_isdst = -1;
+		return mktime(&tm);
+	}
+	return due + period;
+}
+
+/**
+ * Run a job's command line in the background. The child parses and
+ * processes it like a typed line and exits when it is done.
+ */
+static void scheduler_run(struct timer_job *job)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid != 0)
+		return;
+
+	//the child is a shell of its own, with its own event loop
+	close(sched.fd);
+	loop_reset();
+	char buf[BUFFERSIZE];
+	snprintf(buf, sizeof(buf), "%s", job->line);
+	struct command_t *command = malloc(sizeof(struct command_t));
+	memset(command, 0, sizeof(struct command_t));
+	parse_command(buf, command);
+	int code = process_command(command, sched.h, sched.shortdirs);
+	fflush(stdout);
+	_exit(code);
+}
+
+/**
+ * Process one tick of the wheel: cascade upper levels whose slot comes
+ * due and run the jobs in the current level 0 slot
+ */
+static void scheduler_tick()
+{
+	time_t t = ++sched.now;
+	for (int l = 1; l < WHEEL_LEVELS; l++) {
+		if ((t & ((1 << (WHEEL_BITS * l)) - 1)) != 0)
+			break;
+		int slot = (t >> (WHEEL_BITS * l)) & (WHEEL_SIZE - 1);
+		struct timer_job *j = sched.slots[l][slot];
+		sched.slots[l][slot] = NULL;
+		while (j) {
+			struct timer_job *n = j->next;
+			if (j->due <= t) {
+				//due on this tick, scheduler_link would put it on the next
+				int now = t & (WHEEL_SIZE - 1);
+				j->prev = NULL;
+				j->next = sched.slots[0][now];
+				if (j->next)
+					j->next->prev = j;
+				sched.slots[0][now] = j;
+			}
+			else
+				scheduler_link(j);
+			j = n;
+		}
+	}
+
+	int slot = t & (WHEEL_SIZE - 1);
+	struct timer_job *j = sched.slots[0][slot];
+	sched.slots[0][slot] = NULL;
+	while (j) {
+		struct timer_job *n = j->next;
+		if (j->due > t) // parked far future job, not ours yet
+			scheduler_link(j);
+		else {
+			scheduler_run(j);
+			if (j->period > 0) {
+				while (j->due <= t)
+					j->due = scheduler_next(j->due, j->period);
+				scheduler_link(j);
+			}
+			else {
+				scheduler_free(j);
+				sched.dirty = 1;
+			}
+		}
+		j = n;
+	}
+}
+
+/**
+ * Called when the timerfd fires: catch the wheel up to the wall clock.
+ * Finished jobs are reaped by the event loop like any other child.
+ */
+static void scheduler_expire(int fd, uint32_t events, void *arg)
+{
+	uint64_t expirations;
+	if (read(sched.fd, &expirations, sizeof(expirations)) <= 0)
+		return;
+
+	time_t now = time(NULL);
+	if (now < sched.now) // clock went backwards, wait for it
+		return;
+	while (sched.now < now)
+		scheduler_tick();
+
+	if (sched.dirty)
+		scheduler_save();
+	scheduler_arm();
+}
+
+/**
+ * Load saved jobs. Scripts load them too, so that goodMorning sees and
+ * saves back the whole list, but only the interactive shell runs them.
+ * @param h         history handed to scheduled commands
+ * @param shortdirs aliases handed to scheduled commands
+ */
+void scheduler_init(history *h, shortdir *shortdirs)
+{
+	sched.h = h;
+	sched.shortdirs = shortdirs;
+	sched.now = time(NULL);
+
+	char FILELOC[PATH_MAX];
+	FILE *f = scheduler_file(FILELOC) == 0 ? fopen(FILELOC, "r") : NULL;
+	if (f == NULL)
+		return;
+
+	char *line = NULL;
+	size_t len = 0;
+	while (getline(&line, &len, f) != -1) {
+		char name[64];
+		long long due;
+		int period, n = 0;
+		line[strcspn(line, "\n")] = 0;
+		// lines in the old crontab format don't parse and are skipped
+		if (sscanf(line, "%63s %lld %d %n", name, &due, &period, &n) != 3 || n == 0 || !line[n])
+			continue;
+		//missed runs of periodic jobs are skipped, missed one shots run now
+		if (period > 0)
+			while (due <= sched.now)
+				due = scheduler_next(due, period);
+		scheduler_add(name, due, period, line + n);
+	}
+	free(line);
+	fclose(f);
+	sched.dirty = 0;
+}
+
+/**
+ * Create the timerfd that runs the loaded jobs from the event loop
+ */
+void scheduler_start()
+{
+	sched.fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (sched.fd == -1)
+		return;
+	loop_add(sched.fd, scheduler_expire, NULL);
+	scheduler_arm();
+}
+
+static int scheduler_when(const char *when, time_t *due, int *period)
+{
+	time_t now = time(NULL);
+	int hour, min;
+	char unit = 's';
+	long n;
+
+	if ((when[0] == '+' || when[0] == '*') && sscanf(when + 1, "%ld%c", &n, &unit) >= 1 && n > 0) {
+		switch (unit) {
+			case 's': break;
+			case 'm': n *= 60; break;
+			case 'h': n *= 3600; break;
+			case 'd': n *= DAY_SECONDS; break;
+			default: return -1;
+		}
+		*due = now + n;
+		*period = when[0] == '*' ? (int)n : 0;
+		return 0;
+	}
+	if (sscanf(when, "%d.%d", &hour, &min) == 2 && hour >= 0 && hour < 24 && min >= 0 && min < 60) {
+		struct tm tm = *localtime(&now);
+		tm.tm_hour = hour;
+		tm.tm_min = min;
+		tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		*due = mktime(&tm);
+		if (*due <= now)
+			*due = scheduler_next(*due, DAY_SECONDS);
+		*period = DAY_SECONDS;
+		return 0;
+	}
+	return -1;
+}
+
+static int timer_job_cmp(const void *a, const void *b)
+{
+	const struct timer_job *x = *(struct timer_job * const *)a, *y = *(struct timer_job * const *)b;
+	return (x->due > y->due) - (x->due < y->due);
+}
+
+struct timer_list {
+	struct timer_job **jobs;
+	int count;
+};
+
+static void scheduler_collect(struct timer_job *job, void *arg)
+{
+	struct timer_list *l = arg;
+	l->jobs[l->count++] = job;
+}
+
+/**
+ * goodMorning built-in, runs in the shell process
+ *   goodMorning <hour.min> <song>             daily alarm playing a song
+ *   goodMorning add <name> <when> <command>   schedule any command line
+ *   goodMorning list                          list pending jobs
+ *   goodMorning del <name>                    remove a job
+ * <when> is hour.min (daily), +N[smhd] (once) or *N[smhd] (every N)
+ * @param  command with args[0] set to the name and NULL terminated
+ * @return         SUCCESS or UNKNOWN on bad usage
+ */
+int goodmorning_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	char **args = command->args;
+	int argc = command->arg_count - 1; // without the NULL terminator
+
+	if (argc == 2 && strcmp(args[1], "list") == 0) {
+		struct timer_list l = { malloc(sizeof(struct timer_job *) * (sched.count + 1)), 0 };
+		scheduler_foreach(scheduler_collect, &l);
+		qsort(l.jobs, l.count, sizeof(struct timer_job *), timer_job_cmp);
+		for (int i = 0; i < l.count; i++) {
+			char when[64];
+			strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&l.jobs[i]->due));
+			if (l.jobs[i]->period == DAY_SECONDS)
+				fprintf(ctx->out, "%s\t%s\tdaily\t%s\n", l.jobs[i]->name, when, l.jobs[i]->line);
+			else if (l.jobs[i]->period > 0)
+				fprintf(ctx->out, "%s\t%s\tevery %ds\t%s\n", l.jobs[i]->name, when, l.jobs[i]->period, l.jobs[i]->line);
+			else
+				fprintf(ctx->out, "%s\t%s\tonce\t%s\n", l.jobs[i]->name, when, l.jobs[i]->line);
+		}
+		free(l.jobs);
+		return SUCCESS;
+	}
+
+	if (argc == 3 && strcmp(args[1], "del") == 0) {
+		struct timer_job *job = scheduler_find(args[2]);
+		if (job == NULL) {
+			fprintf(ctx->err, "E: alarm %s not found.\n", args[2]);
+			return UNKNOWN;
+		}
+		scheduler_unlink(job);
+		scheduler_free(job);
+		scheduler_save();
+		scheduler_arm();
+		return SUCCESS;
+	}
+
+	time_t due;
+	int period;
+	char line[BUFFERSIZE] = "", name[64];
+
+	if (argc >= 5 && strcmp(args[1], "add") == 0) {
+		if (scheduler_when(args[3], &due, &period) == -1) {
+			fprintf(ctx->err, "E: can't parse time %s (use hour.min, +N[smhd] or *N[smhd])\n", args[3]);
+			return UNKNOWN;
+		}
+		snprintf(name, sizeof(name), "%s", args[2]);
+		for (int i = 4; i < argc; i++) {
+			if (i > 4) strncat(line, " ", sizeof(line) - strlen(line) - 1);
+			strncat(line, args[i], sizeof(line) - strlen(line) - 1);
+		}
+	}
+	else if (argc == 3 && strchr(args[1], '.')) {
+		if (scheduler_when(args[1], &due, &period) == -1) {
+			fprintf(ctx->err, "E: can't parse time %s (use hour.min)\n", args[1]);
+			return UNKNOWN;
+		}
+		snprintf(name, sizeof(name), "alarm-%s", args[1]);
+		snprintf(line, sizeof(line), "rhythmbox-client --play %s", args[2]);
+	}
+	else {
+		fprintf(ctx->err, "E: usage: goodMorning <hour.min> <song> | add <name> <when> <command> | list | del <name>\n");
+		return UNKNOWN;
+	}
+
+	scheduler_add(name, due, period, line);
+	scheduler_save();
+
+	char when[64];
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&due));
+	fprintf(ctx->out, "%s is scheduled for %s\n", name, when);
+	return SUCCESS;
+}
+
+//TIME PREFIX
+
+static double timespec_seconds(struct timespec a, struct timespec b)
+{
+	return (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+}
+
+static double timeval_seconds(struct timeval t)
+{
+	return t.tv_sec + t.tv_usec / 1e6;
+}
+
+int status_code(int status)
+{
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return 0;
+}
+
+/**
+ * Add the stages of a finished pipeline to a time report
+ */
+void time_record(struct time_report *rep, struct stage_usage *stages, int n)
+{
+	for (int i = 0; i < n && rep->nstages < MAXSTAGES; i++)
+		rep->stages[rep->nstages++] = stages[i];
+}
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void json_usage(FILE *f, double wall, struct rusage *ru, int status)
+{
+	fprintf(f, "\"wall\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+		"\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,\"status\":%d",
+		wall, timeval_seconds(ru->ru_utime), timeval_seconds(ru->ru_stime), ru->ru_maxrss,
+		ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw, status);
+}
+
+static void text_usage(FILE *f, const char *label, const char *name, double wall, struct rusage *ru, const char *status)
+{
+	fprintf(f, "%-6s %-14.14s %9.4f %9.4f %9.4f %8ld %8ld %7ld %7ld %7ld %6s\n",
+		label, name, wall, timeval_seconds(ru->ru_utime), timeval_seconds(ru->ru_stime),
+		ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw, status);
+}
+
+/**
+ * time built-in: run the rest of the line and report wall time, CPU
+ * time, max RSS, page faults and context switches per pipeline stage
+ * and in total. Commands that don't fork are measured on the shell.
+ *   time [-j] [-o file] command...
+ * -j prints one line of JSON, -o appends that line to a file instead.
+ * The report goes to stderr.
+ * @param  command the time command, rewritten in place to the timed one
+ * @return         what the timed command returned
+ */
+int time_command(struct command_t *command, history *h, shortdir *shortdirs)
+{
+	int json = 0, k = 0;
+	const char *outfile = NULL;
+	for (; k < command->arg_count && command->args[k][0] == '-'; k++) {
+		if (strcmp(command->args[k], "-j") == 0 || strcmp(command->args[k], "--json") == 0)
+			json = 1;
+		else if (strcmp(command->args[k], "-o") == 0 && k + 1 < command->arg_count)
+			outfile = command->args[++k];
+		else
+			break;
+	}
+	if (k >= command->arg_count) {
+		printf("E: usage: time [-j] [-o file] command...\n");
+		return UNKNOWN;
+	}
+	if (active_time) {
+		printf("E: time can't be nested\n");
+		return UNKNOWN;
+	}
+
+	//the first argument after the options becomes the command
+	char *opts[8];
+	int nopts = 0;
+	for (int i = 0; i < k; i++)
+		if (nopts < 8) opts[nopts++] = command->args[i];
+	free(command->name);
+	command->name = command->args[k];
+	for (int i = k + 1; i < command->arg_count; i++)
+		command->args[i - k - 1] = command->args[i];
+	command->arg_count -= k + 1;
+
+	struct time_report *rep = malloc(sizeof(struct time_report));
+	memset(rep, 0, sizeof(struct time_report));
+	getrusage(RUSAGE_SELF, &rep->self0);
+	clock_gettime(CLOCK_MONOTONIC, &rep->start);
+	active_time = rep;
+	int code = process_command(command, h, shortdirs);
+	active_time = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &rep->end);
+	getrusage(RUSAGE_SELF, &rep->self1);
+
+	//a built-in that ran in the shell is reported as a single stage
+	if (rep->nstages == 0) {
+		struct stage_usage *st = &rep->stages[rep->nstages++];
+		snprintf(st->name, sizeof(st->name), "%s", command->name);
+		st->pid = getpid();
+		st->start = rep->start;
+		st->end = rep->end;
+		st->ru = rep->self1;
+		st->ru.ru_utime.tv_sec -= rep->self0.ru_utime.tv_sec;
+		st->ru.ru_utime.tv_usec -= rep->self0.ru_utime.tv_usec;
+		st->ru.ru_stime.tv_sec -= rep->self0.ru_stime.tv_sec;
+		st->ru.ru_stime.tv_usec -= rep->self0.ru_stime.tv_usec;
+		st->ru.ru_minflt -= rep->self0.ru_minflt;
+		st->ru.ru_majflt -= rep->self0.ru_majflt;
+		st->ru.ru_nvcsw -= rep->self0.ru_nvcsw;
+		st->ru.ru_nivcsw -= rep->self0.ru_nivcsw;
+		st->status = last_status << 8;
+	}
+
+	struct rusage total;
+	memset(&total, 0, sizeof(total));
+	for (int i = 0; i < rep->nstages; i++) {
+		struct rusage *ru = &rep->stages[i].ru;
+		double u = timeval_seconds(total.ru_utime) + timeval_seconds(ru->ru_utime);
+		double s = timeval_seconds(total.ru_stime) + timeval_seconds(ru->ru_stime);
+		total.ru_utime.tv_sec = (time_t)u;
+		total.ru_utime.tv_usec = (suseconds_t)((u - (time_t)u) * 1e6);
+		total.ru_stime.tv_sec = (time_t)s;
+		total.ru_stime.tv_usec = (suseconds_t)((s - (time_t)s) * 1e6);
+		if (ru->ru_maxrss > total.ru_maxrss)
+			total.ru_maxrss = ru->ru_maxrss;
+		total.ru_minflt += ru->ru_minflt;
+		total.ru_majflt += ru->ru_majflt;
+		total.ru_nvcsw += ru->ru_nvcsw;
+		total.ru_nivcsw += ru->ru_nivcsw;
+	}
+	double wall = timespec_seconds(rep->start, rep->end);
+	int laststatus = status_code(rep->stages[rep->nstages - 1].status);
+
+	fflush(stdout);
+	if (json || outfile) {
+		FILE *f = stderr;
+		if (outfile && (f = fopen(outfile, "a")) == NULL) {
+			printf("-%s: %s: %s\n", sysname, outfile, strerror(errno));
+			f = stderr;
+		}
+		fprintf(f, "{\"command\":");
+		char line[BUFFERSIZE] = "";
+		for (int i = 0; i < rep->nstages; i++) {
+			if (i) strncat(line, " | ", sizeof(line) - strlen(line) - 1);
+			strncat(line, rep->stages[i].name, sizeof(line) - strlen(line) - 1);
+		}
+		json_string(f, line);
+		fprintf(f, ",\"stages\":[");
+		for (int i = 0; i < rep->nstages; i++) {
+			struct stage_usage *st = &rep->stages[i];
+			fprintf(f, "%s{\"name\":", i ? "," : "");
+			json_string(f, st->name);
+			fprintf(f, ",\"pid\":%d,", (int)st->pid);
+			json_usage(f, timespec_seconds(st->start, st->end), &st->ru, status_code(st->status));
+			fprintf(f, "}");
+		}
+		fprintf(f, "],\"total\":{");
+		json_usage(f, wall, &total, laststatus);
+		fprintf(f, "}}\n");
+		if (f != stderr)
+			fclose(f);
+	}
+	else {
+		fprintf(stderr, "%-6s %-14s %9s %9s %9s %8s %8s %7s %7s %7s %6s\n", "stage", "command",
+			"real", "user", "sys", "maxrss", "minflt", "majflt", "nvcsw", "nivcsw", "status");
+		for (int i = 0; i < rep->nstages; i++) {
+			struct stage_usage *st = &rep->stages[i];
+			char label[16], status[16];
+			snprintf(label, sizeof(label), "%d", i + 1);
+			snprintf(status, sizeof(status), "%d", status_code(st->status));
+			text_usage(stderr, label, st->name, timespec_seconds(st->start, st->end), &st->ru, status);
+		}
+		char status[16];
+		snprintf(status, sizeof(status), "%d", laststatus);
+		text_usage(stderr, "total", "", wall, &total, status);
+	}
+
+	for (int i = 0; i < nopts; i++)
+		free(opts[i]);
+	free(rep);
+	return code;
+}
+
+//TRACING
+
+#define TRACE_RING 16384
+
+struct trace_event {
+	const char *name;   // always a string literal
+	uint64_t start, dur; // nanoseconds, CLOCK_MONOTONIC
+	pid_t pid;
+	char detail[40];
+};
+
+static struct trace_event *trace_ring;
+static uint64_t trace_count;  // total spans recorded, the ring keeps the last TRACE_RING
+static const char *trace_file;
+static pid_t trace_pid;
+static int trace_pipe[2] = { -1, -1 };
+
+uint64_t trace_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void trace_record(const char *name, uint64_t start, uint64_t end, pid_t pid, const char *detail)
+{
+	struct trace_event *e = &trace_ring[trace_count++ % TRACE_RING];
+	e->name = name;
+	e->start = start;
+	e->dur = end - start;
+	e->pid = pid;
+	if (detail)
+		snprintf(e->detail, sizeof(e->detail), "%s", detail);
+	else
+		e->detail[0] = 0;
+}
+
+/**
+ * Close a span that started at start (from TRACE_BEGIN)
+ */
+void trace_span(const char *name, uint64_t start, const char *detail)
+{
+	trace_record(name, start, trace_now(), trace_pid, detail);
+}
+
+/**
+ * Turn tracing on when SEASHELL_TRACE names an output file
+ */
+void trace_init()
+{
+	trace_file = getenv("SEASHELL_TRACE");
+	if (trace_file == NULL || trace_file[0] == 0)
+		return;
+	trace_ring = calloc(TRACE_RING, sizeof(struct trace_event));
+	trace_pid = getpid();
+	trace_enabled = trace_ring != NULL;
+}
+
+/**
+ * Before a fork: a close-on-exec pipe lets the shell see when the
+ * child's exec has completed
+ */
+void trace_spawn_prepare()
+{
+	if (trace_enabled && pipe2(trace_pipe, O_CLOEXEC) == -1)
+		trace_pipe[0] = trace_pipe[1] = -1;
+}
+
+/**
+ * In the child right after fork. Children that won't exec let go of the
+ * pipe at once so the shell doesn't wait for them.
+ */
+void trace_child(int will_exec)
+{
+	if (trace_pipe[0] == -1)
+		return;
+	close(trace_pipe[0]);
+	if (!will_exec) {
+		close(trace_pipe[1]);
+		trace_pipe[1] = -1;
+	}
+	trace_enabled = 0; // the child's ring is never dumped
+}
+
+/**
+ * In the child just before execv: send the start of the exec span
+ */
+void trace_exec_begin()
+{
+	if (trace_pipe[1] == -1)
+		return;
+	uint64_t t = trace_now();
+	if (write(trace_pipe[1], &t, sizeof(t)) != sizeof(t))
+		close(trace_pipe[1]);
+}
+
+/**
+ * In the shell after fork: the pipe reaches EOF once the child has
+ * exec'd (or exited), which ends its exec span
+ */
+void trace_spawn_wait(pid_t pid, const char *name)
+{
+	if (trace_pipe[0] == -1)
+		return;
+	close(trace_pipe[1]);
+	uint64_t start, scratch;
+	ssize_t n = pid > 0 ? read(trace_pipe[0], &start, sizeof(start)) : 0;
+	if (n == sizeof(start)) {
+		while (read(trace_pipe[0], &scratch, sizeof(scratch)) > 0);
+		trace_record("exec", start, trace_now(), pid, name);
+	}
+	close(trace_pipe[0]);
+	trace_pipe[0] = trace_pipe[1] = -1;
+}
+
+/**
+ * Write the ring buffer as Chrome trace JSON (chrome://tracing, Perfetto)
+ */
+void trace_dump()
+{
+	if (!trace_enabled || getpid() != trace_pid)
+		return;
+	FILE *f = fopen(trace_file, "w");
+	if (f == NULL) {
+		printf("-%s: %s: %s\n", sysname, trace_file, strerror(errno));
+		return;
+	}
+
+	uint64_t first = trace_count > TRACE_RING ? trace_count - TRACE_RING : 0;
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", (int)trace_pid, sysname);
+	for (uint64_t i = first; i < trace_count; i++) {
+		struct trace_event *e = &trace_ring[i % TRACE_RING];
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+			e->name, e->start / 1000.0, e->dur / 1000.0, (int)e->pid, (int)e->pid);
+		if (e->detail[0]) {
+			fprintf(f, ",\"args\":{\"detail\":");
+			json_string(f, e->detail);
+			fprintf(f, "}");
+		}
+		fprintf(f, "}");
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+}
+
+//BUFFERS
+
+void buffer_append(struct buffer *b, const void *data, size_t len)
+{
+	if (b->len + len + 1 > b->cap) {
+		size_t cap = b->cap ? b->cap : 4096;
+		while (cap < b->len + len + 1)
+			cap *= 2;
+		b->data = realloc(b->data, cap);
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	b->data[b->len] = 0; // keep it usable as a string
+}
+
+/**
+ * Append whatever one read() on fd returns
+ * @return bytes read, 0 at EOF, -1 on error
+ */
+ssize_t buffer_read_fd(struct buffer *b, int fd)
+{
+	char chunk[65536];
+	ssize_t n = read(fd, chunk, sizeof(chunk));
+	if (n > 0)
+		buffer_append(b, chunk, n);
+	return n;
+}
+
+void write_all(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		data += n;
+		len -= n;
+	}
+}
+
+//PARALLEL
+
+struct pjob {
+	pid_t pid;
+	int outfd, errfd;      // -1 once at EOF
+	struct buffer out, err;
+	int status;
+	int exited, done, printed;
+	struct stage_usage usage;
+};
+
+static void parallel_exited(pid_t pid, int status, struct rusage *ru, void *arg)
+{
+	struct pjob *job = arg;
+	job->exited = 1;
+	job->status = status;
+	clock_gettime(CLOCK_MONOTONIC, &job->usage.end);
+	job->usage.ru = *ru;
+	job->usage.status = status;
+	job->usage.done = 1;
+	if (active_time)
+		time_record(active_time, &job->usage, 1);
+	stats_stages(&job->usage, 1);
+}
+
+static void parallel_input(int fd, uint32_t events, void *arg)
+{
+	struct pjob *job = arg;
+	int isout = fd == job->outfd;
+	if (buffer_read_fd(isout ? &job->out : &job->err, fd) <= 0) {
+		loop_del(fd);
+		close(fd);
+		if (isout)
+			job->outfd = -1;
+		else
+			job->errfd = -1;
+	}
+}
+
+/**
+ * Fork one job: the template with {} replaced by arg, or arg appended
+ * when the template has no {}. Output goes to pipes read by the shell.
+ */
+static int parallel_spawn(struct pjob *job, char **tmpl, int ntmpl, const char *arg, struct builtin_ctx *ctx)
+{
+	struct command_t *c = malloc(sizeof(struct command_t));
+	memset(c, 0, sizeof(struct command_t));
+	c->name = strdup(tmpl[0]);
+	c->args = malloc(sizeof(char *) * (ntmpl + 1));
+	int replaced = 0;
+	for (int i = 1; i < ntmpl; i++) {
+		char *brace = strstr(tmpl[i], "{}");
+		if (brace) {
+			struct buffer b = {0};
+			buffer_append(&b, tmpl[i], brace - tmpl[i]);
+			buffer_append(&b, arg, strlen(arg));
+			buffer_append(&b, brace + 2, strlen(brace + 2));
+			c->args[c->arg_count++] = b.data;
+			replaced = 1;
+		}
+		else
+			c->args[c->arg_count++] = strdup(tmpl[i]);
+	}
+	if (!replaced)
+		c->args[c->arg_count++] = strdup(arg);
+	prepare_args(c);
+	var_environ();
+
+	char exe[4096];
+	const char *found = NULL;
+	if (!find_builtin(c->args[0]) && resolve_path(c->args[0], exe, sizeof(exe)) == 0)
+		found = exe;
+
+	int outp[2], errp[2];
+	if (pipe2(outp, O_CLOEXEC) == -1 || pipe2(errp, O_CLOEXEC) == -1) {
+		fprintf(ctx->err, "-%s: pipe: %s\n", sysname, strerror(errno));
+		free_command(c);
+		return -1;
+	}
+
+	memset(job, 0, sizeof(*job));
+	snprintf(job->usage.name, sizeof(job->usage.name), "%s", c->name);
+	clock_gettime(CLOCK_MONOTONIC, &job->usage.start);
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		//a group of its own, so stopping a job reaches all it started
+		setpgid(0, 0);
+		loop_child();
+		int devnull = open("/dev/null", O_RDONLY);
+		if (devnull != -1) {
+			dup2(devnull, STDIN_FILENO);
+			close(devnull);
+		}
+		dup2(outp[1], STDOUT_FILENO);
+		dup2(errp[1], STDERR_FILENO);
+		exit(exec_command(c, ctx->h, found));
+	}
+	close(outp[1]);
+	close(errp[1]);
+	free_command(c);
+	if (pid == -1) {
+		fprintf(ctx->err, "-%s: fork: %s\n", sysname, strerror(errno));
+		close(outp[0]);
+		close(errp[0]);
+		return -1;
+	}
+	setpgid(pid, pid);
+	job->pid = pid;
+	job->usage.pid = pid;
+	job->usage.spawn = elapsed_ns(job->usage.start);
+	job->outfd = outp[0];
+	job->errfd = errp[0];
+	loop_watch_child(pid, parallel_exited, job);
+	loop_add(job->outfd, parallel_input, job);
+	loop_add(job->errfd, parallel_input, job);
+	return 0;
+}
+
+static void parallel_print(struct pjob *job, struct builtin_ctx *ctx)
+{
+	if (job->out.len) fwrite(job->out.data, 1, job->out.len, ctx->out);
+	if (job->err.len) fwrite(job->err.data, 1, job->err.len, ctx->err);
+	fflush(ctx->out); // a job's output shows as soon as it is done
+	fflush(ctx->err);
+	free(job->out.data);
+	free(job->err.data);
+	job->printed = 1;
+}
+
+static void parallel_stop(struct pjob *jobs, int started)
+{
+	for (int k = 0; k < started; k++)
+		if (!jobs[k].exited)
+			kill(-jobs[k].pid, SIGTERM);
+}
+
+/**
+ * parallel built-in: run a command once per argument, up to N at a time
+ *   parallel [-j N] [-k] [--halt] command... ::: arg...
+ * Finished children are replaced as the event loop reports them. Each job's
+ * stdout and stderr are buffered and printed together when it finishes,
+ * in completion order, or in input order with -k. --halt stops at the
+ * first failing job and terminates the ones still running. Jobs are not
+ * in the terminal's group, Ctrl+C stops them the same way.
+ * @param  command with args[0] set to the name and NULL terminated
+ * @param  ctx     [description]
+ * @return         SUCCESS if every job succeeded, 128+SIGINT after
+ *                 Ctrl+C, UNKNOWN otherwise
+ */
+int parallel_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	char **args = command->args;
+	int argc = command->arg_count - 1; // without the NULL terminator
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int slots = ncpu > 0 ? (int)ncpu : 1, keeporder = 0, halt = 0, i = 1;
+
+	for (; i < argc && args[i][0] == '-'; i++) {
+		if (strcmp(args[i], "-j") == 0 && i + 1 < argc)
+			slots = atoi(args[++i]);
+		else if (strncmp(args[i], "-j", 2) == 0 && args[i][2])
+			slots = atoi(args[i] + 2);
+		else if (strcmp(args[i], "-k") == 0 || strcmp(args[i], "--keep-order") == 0)
+			keeporder = 1;
+		else if (strcmp(args[i], "--halt") == 0)
+			halt = 1;
+		else
+			break;
+	}
+	int tmplstart = i;
+	while (i < argc && strcmp(args[i], ":::") != 0)
+		i++;
+	int ntmpl = i - tmplstart, njobs = argc - i - 1;
+	if (ntmpl == 0 || i == argc || slots < 1) {
+		fprintf(ctx->err, "E: usage: parallel [-j N] [-k] [--halt] command... ::: arg...\n");
+		return UNKNOWN;
+	}
+	if (njobs <= 0)
+		return SUCCESS;
+	char **tmpl = args + tmplstart, **inputs = args + i + 1;
+
+	struct pjob *jobs = calloc(njobs, sizeof(struct pjob));
+	int started = 0, running = 0, finished = 0, nextprint = 0, failed = 0, halting = 0;
+	int interrupts = loop_interrupts;
+
+	while (finished < started || (!halting && started < njobs)) {
+		//fill free slots
+		while (!halting && running < slots && started < njobs) {
+			if (parallel_spawn(&jobs[started], tmpl, ntmpl, inputs[started], ctx) == -1) {
+				jobs[started].exited = jobs[started].done = 1;
+				jobs[started].status = 127 << 8;
+				failed++;
+				finished++;
+				started++;
+				if (halt) halting = 1;
+				continue;
+			}
+			started++;
+			running++;
+		}
+
+		//output and exits come in through the event loop
+		if (finished < started)
+			loop_wait(-1);
+		if (loop_interrupts != interrupts && !halting) {
+			halting = 1;
+			parallel_stop(jobs, started);
+		}
+
+		//complete jobs
+		for (int j = 0; j < started; j++) {
+			struct pjob *job = &jobs[j];
+			if (job->done) continue;
+			if (!job->exited || job->outfd != -1 || job->errfd != -1)
+				continue;
+			job->done = 1;
+			running--;
+			finished++;
+			if (!keeporder)
+				parallel_print(job, ctx);
+			if (job->status != 0) {
+				failed++;
+				if (halt && !halting) {
+					halting = 1;
+					fprintf(ctx->err, "parallel: job %d (%s) failed, halting\n", j + 1, inputs[j]);
+					parallel_stop(jobs, started);
+				}
+			}
+		}
+		if (keeporder)
+			while (nextprint < started && jobs[nextprint].done)
+				parallel_print(&jobs[nextprint++], ctx);
+	}
+
+	free(jobs);
+	if (loop_interrupts != interrupts)
+		return 128 + SIGINT;
+	return failed ? UNKNOWN : SUCCESS;
+}
+
+//RESULT CACHE
+//Entries live in $HOME/.seashell_cache, one file per key holding the exit
+//status, stdout and stderr of a run. A hit refreshes the file's mtime, so
+//evicting the oldest mtimes first gives LRU order.
+
+const char * cachedir = "/.seashell_cache";
+
+#define CACHE_MAXBYTES (64 * 1024 * 1024)
+#define CACHE_MAXENTRIES 1024
+
+static long cache_hits, cache_misses;
+
+struct cache_file {
+	char name[64];
+	off_t size;
+	struct timespec mtime;
+};
+
+static int cache_file_cmp(const void *a, const void *b)
+{
+	const struct cache_file *x = a, *y = b;
+	if (x->mtime.tv_sec != y->mtime.tv_sec)
+		return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+	return (x->mtime.tv_nsec > y->mtime.tv_nsec) - (x->mtime.tv_nsec < y->mtime.tv_nsec);
+}
+
+/**
+ * Path of a cache entry
+ * @param  path PATH_MAX bytes
+ * @return      0, or -1 when it doesn't fit and would name another file
+ */
+static int cache_path(char *path, const char *dir, const char *name)
+{
+	return snprintf(path, PATH_MAX, "%s/%s", dir, name) < PATH_MAX ? 0 : -1;
+}
+
+/**
+ * List the cache entries, oldest use first
+ * @return number of entries, *files must be freed
+ */
+static int cache_list(const char *dir, struct cache_file **files, off_t *total)
+{
+	*files = NULL;
+	*total = 0;
+	DIR *d = opendir(dir);
+	if (d == NULL)
+		return 0;
+	int n = 0, cap = 0;
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		//keys are 32 hex digits, anything longer isn't an entry
+		if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof((*files)[n].name))
+			continue;
+		char path[PATH_MAX];
+		struct stat st;
+		if (cache_path(path, dir, de->d_name) == -1 || stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			*files = realloc(*files, sizeof(struct cache_file) * cap);
+		}
+		strcpy((*files)[n].name, de->d_name);
+		(*files)[n].size = st.st_size;
+		(*files)[n].mtime = st.st_mtim;
+		*total += st.st_size;
+		n++;
+	}
+	closedir(d);
+	qsort(*files, n, sizeof(struct cache_file), cache_file_cmp);
+	return n;
+}
+
+/**
+ * Remove least recently used entries until the cache fits its limits
+ */
+static void cache_evict(const char *dir)
+{
+	struct cache_file *files;
+	off_t total;
+	int n = cache_list(dir, &files, &total);
+	for (int i = 0; i < n && (total > CACHE_MAXBYTES || n - i > CACHE_MAXENTRIES); i++) {
+		char path[PATH_MAX];
+		if (cache_path(path, dir, files[i].name) == 0 && unlink(path) == 0)
+			total -= files[i].size;
+	}
+	free(files);
+}
+
+static void cache_key_file(struct buffer *b, const struct stat *st)
+{
+	buffer_append(b, &st->st_size, sizeof(st->st_size));
+	buffer_append(b, &st->st_mtim, sizeof(st->st_mtim));
+	buffer_append(b, &st->st_ino, sizeof(st->st_ino));
+	buffer_append(b, &st->st_dev, sizeof(st->st_dev));
+}
+
+/**
+ * Hash the argument vectors, the cwd and the identity of every program
+ * and file argument into a 128-bit key
+ * @return 0, or -1 when the command shouldn't be cached
+ */
+static int cache_key(struct command_t *command, char *key, size_t size)
+{
+	struct buffer b = {0};
+	char cwd[4096];
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		return -1;
+	buffer_append(&b, cwd, strlen(cwd) + 1);
+
+	for (struct command_t *c = command; c; c = c->next) {
+		// output sent to a file isn't seen by the cache, and a background
+		// run has nothing to replay
+		if (c->redirects[1] || c->redirects[2] || c->background) {
+			free(b.data);
+			return -1;
+		}
+		buffer_append(&b, "|", 2);
+		buffer_append(&b, c->name, strlen(c->name) + 1);
+		//a rebuilt program misses, a built-in is known by its name alone
+		//unless the program in PATH may stand in for it
+		struct builtin *bi = c->external ? NULL : find_builtin(c->name);
+		char exe[4096];
+		struct stat st;
+		if ((bi == NULL || bi->flags & BUILTIN_UTILITY)
+			&& resolve_path(c->name, exe, sizeof(exe)) == 0 && stat(exe, &st) == 0) {
+			buffer_append(&b, exe, strlen(exe) + 1);
+			cache_key_file(&b, &st);
+		}
+		for (int i = 0; i <= c->arg_count; i++) {
+			const char *arg = i < c->arg_count ? c->args[i] : c->redirects[0];
+			if (arg == NULL)
+				continue;
+			buffer_append(&b, arg, strlen(arg) + 1);
+			if (stat(arg, &st) == -1)
+				continue;
+			//a directory's mtime says nothing about the files below it
+			if (S_ISDIR(st.st_mode)) {
+				free(b.data);
+				return -1;
+			}
+			cache_key_file(&b, &st);
+		}
+	}
+
+	snprintf(key, size, "%016llx%016llx", (unsigned long long)xxh64(b.data, b.len, 0),
+		(unsigned long long)xxh64(b.data, b.len, 0x5eed));
+	free(b.data);
+	return 0;
+}
+
+/**
+ * Write output as if it came from a command run under cap: into cap,
+ * and to the terminal as well when it tees. With NULL it goes to the
+ * terminal.
+ */
+static void cache_output(struct capture *cap, const char *out, size_t outlen, const char *err, size_t errlen)
+{
+	fflush(stdout);
+	if (cap && outlen)
+		buffer_append(&cap->out, out, outlen);
+	if (cap && !cap->outonly && errlen)
+		buffer_append(&cap->err, err, errlen);
+	if (cap == NULL || cap->tee)
+		write_all(STDOUT_FILENO, out, outlen);
+	if (cap == NULL || cap->tee || cap->outonly)
+		write_all(STDERR_FILENO, err, errlen);
+}
+
+/**
+ * Replay a stored entry, into outer when cache runs under a capture
+ * @return 0 on a hit, -1 if the entry is missing or unreadable
+ */
+static int cache_replay(const char *path, struct capture *outer)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	struct buffer b = {0};
+	ssize_t n;
+	while ((n = buffer_read_fd(&b, fd)) > 0);
+	int status;
+	size_t outlen, errlen;
+	int hdr = 0;
+	if (n < 0 || b.len == 0
+		|| sscanf(b.data, "seashell-cache 1 %d %zu %zu\n%n", &status, &outlen, &errlen, &hdr) != 3
+		|| hdr == 0 || hdr + outlen + errlen != b.len) {
+		close(fd);
+		free(b.data);
+		return -1;
+	}
+	futimens(fd, NULL); // mark as recently used
+	close(fd);
+
+	cache_output(outer, b.data + hdr, outlen, b.data + hdr + outlen, errlen);
+	if (outer) {
+		outer->ran = 1;
+		outer->status = status;
+	}
+	last_status = status;
+	free(b.data);
+	return 0;
+}
+
+static void cache_store(const char *dir, const char *path, struct capture *cap)
+{
+	if (cap->out.len + cap->err.len > CACHE_MAXBYTES / 4)
+		return;
+	mkdir(dir, 0700);
+	char tmp[PATH_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s/.tmp.%d", dir, (int)getpid()) >= (int)sizeof(tmp))
+		return;
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL)
+		return;
+	fprintf(f, "seashell-cache 1 %d %zu %zu\n", cap->status, cap->out.len, cap->err.len);
+	if (cap->out.len) fwrite(cap->out.data, 1, cap->out.len, f);
+	if (cap->err.len) fwrite(cap->err.data, 1, cap->err.len, f);
+	if (fclose(f) != 0 || rename(tmp, path) == -1) {
+		unlink(tmp);
+		return;
+	}
+	cache_evict(dir);
+}
+
+/**
+ * cache built-in
+ *   cache command...   run through the cache
+ *   cache -s           show entries, size and this session's hits/misses,
+ *                      and those of the parse cache
+ *   cache -c           drop every entry
+ * The key covers the argument vectors, the cwd and the size, mtime and
+ * inode of every argument that names a file. A hit replays the stored
+ * output and exit status without forking. Commands with output
+ * redirections, in the background or with directory arguments run
+ * uncached.
+ * @param  command the cache command, rewritten in place to the cached one
+ * @return         what the command returned
+ */
+int cache_command(struct command_t *command, history *h, shortdir *shortdirs)
+{
+	char dir[PATH_MAX];
+	//without a directory of its own everything runs uncached
+	int hasdir = snprintf(dir, sizeof(dir), "%s%s", getenv("HOME"), cachedir) < (int)sizeof(dir);
+
+	if (command->arg_count == 1 && (strcmp(command->args[0], "-s") == 0 || strcmp(command->args[0], "-c") == 0)) {
+		if (!hasdir) {
+			printf("-%s: cache: %s%s: %s\n", sysname, getenv("HOME"), cachedir, strerror(ENAMETOOLONG));
+			return UNKNOWN;
+		}
+		struct cache_file *files;
+		off_t total;
+		int n = cache_list(dir, &files, &total);
+		if (command->args[0][1] == 'c') {
+			for (int i = 0; i < n; i++) {
+				char path[PATH_MAX];
+				if (cache_path(path, dir, files[i].name) == 0)
+					unlink(path);
+			}
+			printf("%d cache entries removed\n", n);
+		}
+		else {
+			printf("%d entries, %lld bytes, %ld hits, %ld misses this session\n",
+				n, (long long)total, cache_hits, cache_misses);
+			printf("parsed lines: %ld hits, %ld misses this session\n", parse_hits, parse_misses);
+		}
+		free(files);
+		return SUCCESS;
+	}
+	if (command->arg_count == 0) {
+		printf("E: usage: cache command... | cache -s | cache -c\n");
+		return UNKNOWN;
+	}
+	//under $(...) or another cache the output is handed on to that capture
+	struct capture *outer = active_capture;
+
+	//the first argument becomes the command
+	free(command->name);
+	command->name = command->args[0];
+	for (int i = 1; i < command->arg_count; i++)
+		command->args[i - 1] = command->args[i];
+	command->arg_count--;
+
+	char key[64], path[PATH_MAX];
+	if (!hasdir || cache_key(command, key, sizeof(key)) == -1 || cache_path(path, dir, key) == -1)
+		return process_command(command, h, shortdirs);
+
+	if (cache_replay(path, outer) == 0) {
+		cache_hits++;
+		return SUCCESS;
+	}
+	cache_misses++;
+
+	struct capture cap;
+	memset(&cap, 0, sizeof(cap));
+	cap.tee = outer == NULL;
+	active_capture = &cap;
+	int code = process_command(command, h, shortdirs);
+	active_capture = outer;
+	if (outer) {
+		cache_output(outer, cap.out.data, cap.out.len, cap.err.data, cap.err.len);
+		if (cap.ran) {
+			outer->ran = 1;
+			outer->status = cap.status;
+		}
+	}
+
+	// only forked pipelines and built-ins that don't change the shell
+	// are stored, the others must run every time
+	if (cap.ran)
+		cache_store(dir, path, &cap);
+	free(cap.out.data);
+	free(cap.err.data);
+	return code;
+}
+
+//PATHNAME EXPANSION
+//Directories are read with getdents64 into a large buffer and kept in a
+//small cache keyed by path and validated by the directory's mtime, so a
+//repeated glob in a huge directory is served from memory. Patterns are
+//compiled once per component and only the matches get sorted.
+
+#define GLOB_DENTS_BUF (1 << 20)
+#define GLOB_CACHE_DIRS 32
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct dir_listing {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	time_t readat;      // listings read in the same second as a change are re-read
+	char *names;        // all names, NUL separated
+	uint32_t *offsets;  // start of each name in names
+	unsigned char *types;
+	int count;
+	unsigned long lastuse;
+};
+
+static struct dir_listing glob_cache[GLOB_CACHE_DIRS];
+static unsigned long glob_clock;
+
+enum glob_op { GLOB_CHAR, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
+
+struct glob_token {
+	enum glob_op op;
+	unsigned char c;
+	unsigned char set[32]; // bitmap for [...]
+};
+
+struct glob_pattern {
+	struct glob_token *tokens;
+	int ntokens;
+	char prefix[256];   // literal text before the first wildcard
+	int prefixlen;
+	char suffix[256];   // literal text after the last *
+	int suffixlen;
+};
+
+/**
+ * Compile one path component of a glob
+ */
+static void glob_compile(const char *pat, int len, struct glob_pattern *g)
+{
+	g->tokens = malloc(sizeof(struct glob_token) * (len + 1));
+	g->ntokens = 0;
+	for (int i = 0; i < len; i++) {
+		struct glob_token *t = &g->tokens[g->ntokens++];
+		if (pat[i] == '*') {
+			t->op = GLOB_STAR;
+			while (i + 1 < len && pat[i + 1] == '*') i++;
+		}
+		else if (pat[i] == '?')
+			t->op = GLOB_ANY;
+		else if (pat[i] == '[') {
+			int j = i + 1, negate = 0;
+			if (j < len && (pat[j] == '!' || pat[j] == '^')) { negate = 1; j++; }
+			int start = j;
+			while (j < len && (pat[j] != ']' || j == start)) j++;
+			if (j >= len) { // no closing bracket, a literal [
+				t->op = GLOB_CHAR;
+				t->c = '[';
+				continue;
+			}
+			t->op = GLOB_CLASS;
+			memset(t->set, 0, sizeof(t->set));
+			for (int k = start; k < j; k++) {
+				unsigned char lo = pat[k], hi = pat[k];
+				if (k + 2 < j && pat[k + 1] == '-') {
+					hi = pat[k + 2];
+					k += 2;
+				}
+				for (int c = lo; c <= hi; c++)
+					t->set[c >> 3] |= 1 << (c & 7);
+			}
+			if (negate)
+				for (int k = 0; k < 32; k++)
+					t->set[k] = ~t->set[k];
+			i = j;
+		}
+		else {
+			t->op = GLOB_CHAR;
+			t->c = pat[i];
+		}
+	}
+
+	//literal prefix and suffix reject most names with a memcmp
+	g->prefixlen = 0;
+	for (int i = 0; i < g->ntokens && g->tokens[i].op == GLOB_CHAR && g->prefixlen < 255; i++)
+		g->prefix[g->prefixlen++] = g->tokens[i].c;
+	g->suffixlen = 0;
+	int laststar = -1;
+	for (int i = 0; i < g->ntokens; i++)
+		if (g->tokens[i].op == GLOB_STAR) laststar = i;
+	if (laststar != -1) {
+		int ok = 1;
+		for (int i = laststar + 1; i < g->ntokens; i++)
+			if (g->tokens[i].op != GLOB_CHAR) ok = 0;
+		if (ok && g->ntokens - laststar - 1 < 256)
+			for (int i = laststar + 1; i < g->ntokens; i++)
+				g->suffix[g->suffixlen++] = g->tokens[i].c;
+	}
+}
+
+/**
+ * Match a name against a compiled component. A failed match after a *
+ * backtracks to the latest star only, which is enough for globs.
+ */
+static int glob_match(const struct glob_pattern *g, const char *name, int namelen)
+{
+	if (namelen < g->prefixlen || memcmp(name, g->prefix, g->prefixlen) != 0)
+		return 0;
+	if (g->suffixlen && (namelen < g->suffixlen
+		|| memcmp(name + namelen - g->suffixlen, g->suffix, g->suffixlen) != 0))
+		return 0;
+
+	int t = 0, n = 0, star = -1, starn = 0;
+	while (n < namelen) {
+		if (t < g->ntokens) {
+			const struct glob_token *tok = &g->tokens[t];
+			unsigned char c = name[n];
+			if (tok->op == GLOB_STAR) {
+				star = t++;
+				starn = n;
+				continue;
+			}
+			if ((tok->op == GLOB_CHAR && tok->c == c) || tok->op == GLOB_ANY
+				|| (tok->op == GLOB_CLASS && (tok->set[c >> 3] & (1 << (c & 7))))) {
+				t++;
+				n++;
+				continue;
+			}
+		}
+		if (star == -1)
+			return 0;
+		t = star + 1;
+		n = ++starn;
+	}
+	while (t < g->ntokens && g->tokens[t].op == GLOB_STAR)
+		t++;
+	return t == g->ntokens;
+}
+
+static void dir_listing_free(struct dir_listing *l)
+{
+	free(l->path);
+	free(l->names);
+	free(l->offsets);
+	free(l->types);
+	memset(l, 0, sizeof(*l));
+}
+
+/**
+ * Get the entries of a directory, from the cache when its mtime hasn't
+ * changed since it was read
+ * @return the listing, NULL if the directory can't be read
+ */
+static struct dir_listing *glob_listdir(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+		return NULL;
+
+	struct dir_listing *slot = NULL;
+	for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+		struct dir_listing *l = &glob_cache[i];
+		if (l->path && strcmp(l->path, path) == 0) {
+			if (l->dev == st.st_dev && l->ino == st.st_ino
+				&& l->mtime.tv_sec == st.st_mtim.tv_sec && l->mtime.tv_nsec == st.st_mtim.tv_nsec
+				&& l->readat > st.st_mtim.tv_sec) {
+				l->lastuse = ++glob_clock;
+				return l;
+			}
+			dir_listing_free(l);
+			slot = l;
+			break;
+		}
+	}
+	if (slot == NULL) {
+		//a free slot, or the least recently used one
+		slot = &glob_cache[0];
+		for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+			if (glob_cache[i].path == NULL) { slot = &glob_cache[i]; break; }
+			if (glob_cache[i].lastuse < slot->lastuse) slot = &glob_cache[i];
+		}
+		dir_listing_free(slot);
+	}
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	static char *dents;
+	if (dents == NULL)
+		dents = malloc(GLOB_DENTS_BUF);
+	struct buffer names = {0};
+	int cap = 0;
+	slot->readat = time(NULL);
+	while (1) {
+		long n = syscall(SYS_getdents64, fd, dents, GLOB_DENTS_BUF);
+		if (n <= 0)
+			break;
+		for (long off = 0; off < n; ) {
+			struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + off);
+			off += d->d_reclen;
+			if (d->d_name[0] == '.' && (d->d_name[1] == 0 || (d->d_name[1] == '.' && d->d_name[2] == 0)))
+				continue;
+			if (slot->count == cap) {
+				cap = cap ? cap * 2 : 256;
+				slot->offsets = realloc(slot->offsets, sizeof(uint32_t) * cap);
+				slot->types = realloc(slot->types, cap);
+			}
+			slot->offsets[slot->count] = names.len;
+			slot->types[slot->count++] = d->d_type;
+			buffer_append(&names, d->d_name, strlen(d->d_name) + 1);
+		}
+	}
+	close(fd);
+
+	slot->path = strdup(path);
+	slot->names = names.data;
+	slot->dev = st.st_dev;
+	slot->ino = st.st_ino;
+	slot->mtime = st.st_mtim;
+	slot->lastuse = ++glob_clock;
+	return slot;
+}
+
+struct glob_result {
+	char **paths;
+	int count;
+	int cap;
+};
+
+static int glob_strcmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void glob_add(struct glob_result *r, char *path)
+{
+	if (r->count == r->cap) {
+		r->cap = r->cap ? r->cap * 2 : 16;
+		r->paths = realloc(r->paths, sizeof(char *) * r->cap);
+	}
+	r->paths[r->count++] = path;
+}
+
+/**
+ * Expand the components of pattern starting at rest, below prefix
+ */
+static void glob_walk(const char *prefix, const char *rest, struct glob_result *r)
+{
+	while (*rest == '/')
+		rest++;
+	if (*rest == 0) {
+		glob_add(r, strdup(prefix));
+		return;
+	}
+	const char *slash = strchr(rest, '/');
+	int complen = slash ? (int)(slash - rest) : (int)strlen(rest);
+	int last = slash == NULL;
+	size_t plen = strlen(prefix);
+	int needslash = plen > 0 && prefix[plen - 1] != '/';
+
+	//literal component, no listing needed
+	if (memchr(rest, '*', complen) == NULL && memchr(rest, '?', complen) == NULL
+		&& memchr(rest, '[', complen) == NULL) {
+		char *next = malloc(plen + complen + 2);
+		sprintf(next, "%s%s%.*s", prefix, needslash ? "/" : "", complen, rest);
+		struct stat st;
+		if (lstat(next, &st) == 0)
+			glob_walk(next, rest + complen, r);
+		free(next);
+		return;
+	}
+
+	struct dir_listing *l = glob_listdir(plen ? prefix : ".");
+	if (l == NULL)
+		return;
+	struct glob_pattern g;
+	glob_compile(rest, complen, &g);
+
+	//collect this level's matches, sort just those, then descend. The
+	//paths are built now: descending lists other directories, which
+	//may evict this listing from the cache.
+	struct glob_result level = {0};
+	for (int i = 0; i < l->count; i++) {
+		const char *name = l->names + l->offsets[i];
+		if (name[0] == '.' && rest[0] != '.') // hidden files need an explicit dot
+			continue;
+		if (!last && l->types[i] != DT_DIR && l->types[i] != DT_LNK && l->types[i] != DT_UNKNOWN)
+			continue;
+		if (glob_match(&g, name, strlen(name))) {
+			char *next = malloc(plen + strlen(name) + 2);
+			sprintf(next, "%s%s%s", prefix, needslash ? "/" : "", name);
+			glob_add(&level, next);
+		}
+	}
+	free(g.tokens);
+	if (level.count > 1)
+		qsort(level.paths, level.count, sizeof(char *), glob_strcmp);
+
+	for (int i = 0; i < level.count; i++) {
+		char *next = level.paths[i];
+		if (last)
+			glob_add(r, next);
+		else {
+			struct stat st;
+			if (stat(next, &st) == 0 && S_ISDIR(st.st_mode))
+				glob_walk(next, rest + complen, r);
+			free(next);
+		}
+	}
+	free(level.paths);
+}
+
+/**
+ * Expand a pathname pattern with *, ? and [...]
+ * @param  pattern [description]
+ * @param  matches receives a malloc'd array of malloc'd paths, in order
+ * @return         number of matches
+ */
+int glob_expand(const char *pattern, char ***matches)
+{
+	struct glob_result r = {0};
+	glob_walk(pattern[0] == '/' ? "/" : "", pattern, &r);
+	*matches = r.paths;
+	return r.count;
+}
+
+//CORE UTILITIES
+//echo, printf, test/[, true, false, pwd and cat run inside the shell so
+//a script loop doesn't create a process for each of them. They behave
+//like the GNU programs for what they implement and hand anything else
+//(cat -n, printf %q, ...) to the program in PATH.
+
+/**
+ * Decode the escape sequence after a backslash
+ * @param  s      first character after the backslash
+ * @param  c      receives the character, -1 for \c, -2 if s isn't an escape
+ * @param  octal0 octal escapes are \0nnn (echo -e, %b) instead of \nnn
+ * @return        number of characters used after the backslash
+ */
+static int decode_escape(const char *s, int *c, int octal0)
+{
+	static const char from[] = "abefnrtv\\", to[] = "\a\b\033\f\n\r\t\v\\";
+	const char *p = *s ? strchr(from, *s) : NULL;
+	if (p) {
+		*c = to[p - from];
+		return 1;
+	}
+	if (*s == 'c') {
+		*c = -1;
+		return 1;
+	}
+	int n = 0, v = 0;
+	if (*s == 'x') {
+		while (n < 2 && isxdigit((unsigned char)s[n + 1])) {
+			v = v * 16 + (isdigit((unsigned char)s[n + 1]) ? s[n + 1] - '0' : (tolower((unsigned char)s[n + 1]) - 'a' + 10));
+			n++;
+		}
+		*c = n ? v : -2;
+		return n ? n + 1 : 0;
+	}
+	int start = (octal0 && *s == '0') ? 1 : 0;
+	if (start == 0 && (octal0 || *s < '0' || *s > '7')) {
+		*c = -2;
+		return 0;
+	}
+	for (n = start; n < start + 3 && s[n] >= '0' && s[n] <= '7'; n++)
+		v = v * 8 + s[n] - '0';
+	*c = v & 0xff;
+	return n;
+}
+
+/**
+ * Write s expanding backslash escapes
+ * @return 1 if \c asked to stop all further output
+ */
+static int print_escaped(FILE *out, const char *s, int octal0)
+{
+	for (; *s; s++) {
+		int c;
+		if (*s != '\\' || s[1] == 0) {
+			fputc(*s, out);
+			continue;
+		}
+		int n = decode_escape(s + 1, &c, octal0);
+		if (c == -1)
+			return 1;
+		if (c == -2)
+			fputc('\\', out);
+		else {
+			fputc(c, out);
+			s += n;
+		}
+	}
+	return 0;
+}
+
+/**
+ * echo built-in
+ *   echo [-neE] [arg...]
+ * -n drops the newline, -e expands backslash escapes, -E doesn't.
+ * An argument is an option only if all of its letters are n, e or E.
+ */
+int echo_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	char **args = command->args + 1;
+	int newline = 1, escapes = 0;
+	for (; *args && (*args)[0] == '-' && (*args)[1] && strspn(*args + 1, "neE") == strlen(*args + 1); args++)
+		for (const char *o = *args + 1; *o; o++) {
+			if (*o == 'n')
+				newline = 0;
+			else
+				escapes = (*o == 'e');
+		}
+	for (char **a = args; *a; a++) {
+		if (a != args)
+			fputc(' ', ctx->out);
+		if (escapes) {
+			if (print_escaped(ctx->out, *a, 1))
+				return SUCCESS;
+		}
+		else
+			fputs(*a, ctx->out);
+	}
+	if (newline)
+		fputc('\n', ctx->out);
+	return SUCCESS;
+}
+
+/**
+ * Check that every conversion of a printf format is one printf_command
+ * knows, so unsupported formats go to the program in PATH untouched
+ */
+static int printf_supported(const char *f)
+{
+	for (; *f; f++) {
+		if (*f == '\\' && f[1]) {
+			f++;
+			continue;
+		}
+		if (*f != '%')
+			continue;
+		if (*++f == '%')
+			continue;
+		f += strspn(f, "-+ #0");
+		f += *f == '*' ? 1 : strspn(f, "0123456789");
+		if (*f == '.') {
+			f++;
+			f += *f == '*' ? 1 : strspn(f, "0123456789");
+		}
+		if (*f == 0 || !strchr("diouxXcsbfFeEgGaA", *f))
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Numeric argument of printf: decimal, 0x hex, 0 octal, or 'c for the
+ * value of a character. A missing argument is 0, a bad one is reported.
+ */
+static long long printf_integer(const char *s, int is_unsigned, int *status, struct builtin_ctx *ctx)
+{
+	if (s == NULL)
+		return 0;
+	if (s[0] == '\'' || s[0] == '"')
+		return (unsigned char)s[1];
+	char *end;
+	errno = 0;
+	long long v = is_unsigned && s[0] != '-' ? (long long)strtoull(s, &end, 0) : strtoll(s, &end, 0);
+	if (end == s || *end || errno) {
+		fprintf(ctx->err, "-%s: printf: %s: invalid number\n", sysname, s);
+		*status = EXIT_FAILURE;
+	}
+	return v;
+}
+
+static double printf_double(const char *s, int *status, struct builtin_ctx *ctx)
+{
+	if (s == NULL)
+		return 0;
+	if (s[0] == '\'' || s[0] == '"')
+		return (unsigned char)s[1];
+	char *end;
+	errno = 0;
+	double v = strtod(s, &end);
+	if (end == s || *end || errno) {
+		fprintf(ctx->err, "-%s: printf: %s: invalid number\n", sysname, s);
+		*status = EXIT_FAILURE;
+	}
+	return v;
+}
+
+/**
+ * Print the format once, taking arguments from *argp as conversions need them
+ * @return 1 if \c asked to stop all further output
+ */
+static int printf_format(struct builtin_ctx *ctx, const char *f, char ***argp, int *status)
+{
+	char **args = *argp;
+	for (; *f; f++) {
+		if (*f == '\\' && f[1]) {
+			int c, n = decode_escape(f + 1, &c, 0);
+			if (c == -1)
+				return 1;
+			if (c == -2)
+				fputc('\\', ctx->out);
+			else {
+				fputc(c, ctx->out);
+				f += n;
+			}
+			continue;
+		}
+		if (*f != '%') {
+			fputc(*f, ctx->out);
+			continue;
+		}
+		if (f[1] == '%') {
+			fputc('%', ctx->out);
+			f++;
+			continue;
+		}
+
+		//rebuild the conversion for fprintf, with * replaced by its value
+		char spec[64] = "%";
+		size_t n = 1;
+		f++;
+		while (*f && strchr("-+ #0", *f) && n < 16)
+			spec[n++] = *f++;
+		for (int part = 0; part < 2; part++) {
+			if (part == 1) {
+				if (*f != '.')
+					break;
+				spec[n++] = *f++;
+			}
+			if (*f == '*') {
+				long long v = printf_integer(*args ? *args++ : NULL, 0, status, ctx);
+				n += snprintf(spec + n, sizeof(spec) - n, "%d", (int)(v > 9999 ? 9999 : v < -9999 ? -9999 : v));
+				f++;
+			}
+			else
+				while (isdigit((unsigned char)*f) && n < 40)
+					spec[n++] = *f++;
+		}
+		char conv = *f;
+		const char *arg = *args ? *args++ : NULL;
+		spec[n] = 0;
+		switch (conv) {
+			case 'd': case 'i':
+				strcat(spec, "lld");
+				fprintf(ctx->out, spec, printf_integer(arg, 0, status, ctx));
+				break;
+			case 'o': case 'u': case 'x': case 'X':
+				strcat(spec, conv == 'o' ? "llo" : conv == 'u' ? "llu" : conv == 'x' ? "llx" : "llX");
+				fprintf(ctx->out, spec, (unsigned long long)printf_integer(arg, 1, status, ctx));
+				break;
+			case 'c': {
+				char one[2] = { arg ? arg[0] : 0, 0 };
+				strcat(spec, "s");
+				fprintf(ctx->out, spec, one);
+				break;
+			}
+			case 's':
+				strcat(spec, "s");
+				fprintf(ctx->out, spec, arg ? arg : "");
+				break;
+			case 'b': {
+				char *buf = NULL;
+				size_t len = 0;
+				FILE *m = open_memstream(&buf, &len);
+				int stop = print_escaped(m, arg ? arg : "", 1);
+				fclose(m);
+				strcat(spec, "s");
+				fprintf(ctx->out, spec, buf);
+				free(buf);
+				if (stop)
+					return 1;
+				break;
+			}
+			default: {
+				char c[2] = { conv, 0 };
+				strcat(spec, c);
+				fprintf(ctx->out, spec, printf_double(arg, status, ctx));
+			}
+		}
+	}
+	*argp = args;
+	return 0;
+}
+
+/**
+ * printf built-in
+ *   printf format [arg...]
+ * Conversions d i o u x X c s b f F e E g G a A with flags, width and
+ * precision. The format is reused while arguments remain.
+ */
+int printf_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	char **args = command->args + 1;
+	if (*args && strcmp(*args, "--") == 0)
+		args++;
+	if (*args == NULL) {
+		fprintf(ctx->err, "-%s: printf: usage: printf format [arguments]\n", sysname);
+		return UNKNOWN;
+	}
+	const char *format = *args++;
+	if (!printf_supported(format))
+		return BUILTIN_EXTERNAL;
+
+	int status = SUCCESS;
+	while (1) {
+		char **before = args;
+		if (printf_format(ctx, format, &args, &status))
+			break;
+		// stop when everything is used, or the format takes no arguments
+		if (*args == NULL || args == before)
+			break;
+	}
+	return status;
+}
+
+//state of the test expression parser
+struct test_parser {
+	char **argv;
+	int argc;
+	int pos;
+	const char *error;
+	const char *bad; // the argument the error is about
+};
+
+static int test_is_unary(const char *s)
+{
+	return s[0] == '-' && s[1] && !s[2] && strchr("bcdefghkLnprsStuwxzOG", s[1]);
+}
+
+static int test_is_binary(const char *s)
+{
+	static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+		"-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+	for (int i = 0; ops[i]; i++)
+		if (strcmp(s, ops[i]) == 0)
+			return 1;
+	return 0;
+}
+
+static int test_unary(const char *op, const char *arg)
+{
+	struct stat st;
+	switch (op[1]) {
+		case 'n': return arg[0] != 0;
+		case 'z': return arg[0] == 0;
+		case 't': return isatty(atoi(arg));
+		case 'r': return access(arg, R_OK) == 0;
+		case 'w': return access(arg, W_OK) == 0;
+		case 'x': return access(arg, X_OK) == 0;
+		case 'h': case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+	}
+	if (stat(arg, &st) == -1)
+		return 0;
+	switch (op[1]) {
+		case 'b': return S_ISBLK(st.st_mode);
+		case 'c': return S_ISCHR(st.st_mode);
+		case 'd': return S_ISDIR(st.st_mode);
+		case 'f': return S_ISREG(st.st_mode);
+		case 'p': return S_ISFIFO(st.st_mode);
+		case 'S': return S_ISSOCK(st.st_mode);
+		case 's': return st.st_size > 0;
+		case 'g': return (st.st_mode & S_ISGID) != 0;
+		case 'u': return (st.st_mode & S_ISUID) != 0;
+		case 'k': return (st.st_mode & S_ISVTX) != 0;
+		case 'O': return st.st_uid == geteuid();
+		case 'G': return st.st_gid == getegid();
+	}
+	return 1; // -e
+}
+
+static long long test_integer(struct test_parser *t, const char *s)
+{
+	char *end;
+	errno = 0;
+	long long v = strtoll(s, &end, 10);
+	while (isspace((unsigned char)*end))
+		end++;
+	if (end == s || *end || errno) {
+		t->error = "integer expression expected";
+		t->bad = s;
+	}
+	return v;
+}
+
+static int test_binary(struct test_parser *t, const char *a, const char *op, const char *b)
+{
+	if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+		return strcmp(a, b) == 0;
+	if (strcmp(op, "!=") == 0)
+		return strcmp(a, b) != 0;
+	if (strcmp(op, "<") == 0)
+		return strcoll(a, b) < 0;
+	if (strcmp(op, ">") == 0)
+		return strcoll(a, b) > 0;
+	if ((op[1] == 'n' && op[2] == 't') || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f')) {
+		struct stat sa, sb;
+		int ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+		if (op[1] == 'e')
+			return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+		if (!ha || !hb)
+			return op[1] == 'n' ? ha : hb;
+		int newer = sa.st_mtim.tv_sec != sb.st_mtim.tv_sec ? sa.st_mtim.tv_sec > sb.st_mtim.tv_sec
+			: sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec;
+		int older = sa.st_mtim.tv_sec != sb.st_mtim.tv_sec ? sa.st_mtim.tv_sec < sb.st_mtim.tv_sec
+			: sa.st_mtim.tv_nsec < sb.st_mtim.tv_nsec;
+		return op[1] == 'n' ? newer : older;
+	}
+	long long x = test_integer(t, a), y = test_integer(t, b);
+	switch (op[1] * 256 + op[2]) {
+		case 'e' * 256 + 'q': return x == y;
+		case 'n' * 256 + 'e': return x != y;
+		case 'l' * 256 + 't': return x < y;
+		case 'l' * 256 + 'e': return x <= y;
+		case 'g' * 256 + 't': return x > y;
+	}
+	return x >= y; // -ge
+}
+
+static int test_or(struct test_parser *t);
+
+/**
+ * primary: ! primary | ( expr ) | arg binop arg | unop arg | arg
+ * A binary operator in second place wins, as POSIX asks for three arguments.
+ */
+static int test_primary(struct test_parser *t)
+{
+	int left = t->argc - t->pos;
+	char **a = t->argv + t->pos;
+	if (left <= 0) {
+		t->error = "argument expected";
+		return 0;
+	}
+	if (left >= 3 && test_is_binary(a[1])) {
+		t->pos += 3;
+		return test_binary(t, a[0], a[1], a[2]);
+	}
+	if (strcmp(a[0], "!") == 0 && left >= 2) {
+		t->pos++;
+		return !test_primary(t);
+	}
+	if (strcmp(a[0], "(") == 0 && left >= 2) {
+		t->pos++;
+		int v = test_or(t);
+		if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")") != 0) {
+			if (!t->error)
+				t->error = "')' expected";
+			return 0;
+		}
+		t->pos++;
+		return v;
+	}
+	if (left >= 2 && test_is_unary(a[0])) {
+		t->pos += 2;
+		return test_unary(a[0], a[1]);
+	}
+	t->pos++;
+	return a[0][0] != 0;
+}
+
+static int test_and(struct test_parser *t)
+{
+	int v = test_primary(t);
+	while (!t->error && t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0) {
+		t->pos++;
+		v = test_primary(t) && v;
+	}
+	return v;
+}
+
+static int test_or(struct test_parser *t)
+{
+	int v = test_and(t);
+	while (!t->error && t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0) {
+		t->pos++;
+		v = test_and(t) || v;
+	}
+	return v;
+}
+
+/**
+ * test and [ built-ins
+ *   test expression
+ *   [ expression ]
+ * @return SUCCESS if true, EXIT_FAILURE if false, UNKNOWN on a bad expression
+ */
+int test_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	int argc = command->arg_count - 2; // without the name and the NULL terminator
+	char **argv = command->args + 1;
+	if (strcmp(command->args[0], "[") == 0) {
+		if (argc == 0 || strcmp(argv[argc - 1], "]") != 0) {
+			fprintf(ctx->err, "-%s: [: missing ']'\n", sysname);
+			return UNKNOWN;
+		}
+		argc--;
+	}
+	if (argc == 0)
+		return EXIT_FAILURE;
+
+	struct test_parser t = { argv, argc, 0, NULL, NULL };
+	int v = test_or(&t);
+	if (!t.error && t.pos < argc) {
+		t.error = "unexpected argument";
+		t.bad = argv[t.pos];
+	}
+	if (t.error) {
+		if (t.bad)
+			fprintf(ctx->err, "-%s: %s: %s: %s\n", sysname, command->args[0], t.bad, t.error);
+		else
+			fprintf(ctx->err, "-%s: %s: %s\n", sysname, command->args[0], t.error);
+		return UNKNOWN;
+	}
+	return v ? SUCCESS : EXIT_FAILURE;
+}
+
+int true_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	return SUCCESS;
+}
+
+int false_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	return EXIT_FAILURE;
+}
+
+int pwd_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	char cwd[4096];
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		fprintf(ctx->err, "-%s: pwd: %s\n", sysname, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	fprintf(ctx->out, "%s\n", cwd);
+	return SUCCESS;
+}
+
+/**
+ * cat built-in, copies files or stdin ("-") to the output
+ *   cat [-u] [file...]
+ * Any other option is left to the program in PATH.
+ */
+int cat_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	char **args = command->args + 1;
+	int nfiles = 0, options = 1, readstdin = 0;
+	for (char **a = args; *a; a++) {
+		if (options && strcmp(*a, "--") == 0)
+			options = 0;
+		else if (options && (*a)[0] == '-' && (*a)[1] && strcmp(*a, "-u") != 0)
+			return BUILTIN_EXTERNAL;
+		else if (!(options && strcmp(*a, "-u") == 0))
+			nfiles++;
+		if (strcmp(*a, "-") == 0 || strcmp(*a, "/dev/stdin") == 0)
+			readstdin = 1;
+	}
+	//the shell doesn't take SIGINT, so Ctrl+C couldn't stop a built-in
+	//cat reading the terminal; the program in PATH can be
+	if ((nfiles == 0 || readstdin) && isatty(ctx->in))
+		return BUILTIN_EXTERNAL;
+
+	char buf[65536];
+	int status = SUCCESS;
+	options = 1;
+	for (char **a = args; *a || nfiles == 0; a++) {
+		const char *name = nfiles ? *a : "-";
+		if (nfiles && options && (strcmp(name, "--") == 0 || strcmp(name, "-u") == 0)) {
+			options = strcmp(name, "--") != 0;
+			continue;
+		}
+		//on a pipeline thread /dev/stdin would be the shell's, not the pipe
+		int fd = strcmp(name, "-") == 0 || strcmp(name, "/dev/stdin") == 0 ? ctx->in : open(name, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			fprintf(ctx->err, "-%s: cat: %s: %s\n", sysname, name, strerror(errno));
+			status = EXIT_FAILURE;
+			continue;
+		}
+		ssize_t n;
+		while ((n = read(fd, buf, sizeof(buf))) != 0) {
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				fprintf(ctx->err, "-%s: cat: %s: %s\n", sysname, name, strerror(errno));
+				status = EXIT_FAILURE;
+				break;
+			}
+			if (fwrite(buf, 1, n, ctx->out) != (size_t)n || builtin_cancelled(ctx))
+				break; // the reader is gone or Ctrl+C
+		}
+		if (fd != ctx->in)
+			close(fd);
+		if (nfiles == 0 || ferror(ctx->out) || builtin_cancelled(ctx))
+			break;
+	}
+	return status;
+}
+
+/**
+ * enable built-in, switches the utility built-ins off to compare them
+ * with the programs in PATH
+ *   enable               list the built-ins, "enable -n" marks disabled ones
+ *   enable -n [name...]  use the programs in PATH, all utilities without names
+ *   enable [-a] [name...] use the built-ins again, all of them with -a
+ */
+int enable_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	char **args = command->args + 1;
+	bool disable = false, all = false;
+	for (; *args && (*args)[0] == '-' && (*args)[1]; args++) {
+		if (strcmp(*args, "-n") == 0)
+			disable = true;
+		else if (strcmp(*args, "-a") == 0)
+			all = true;
+		else {
+			fprintf(ctx->err, "E: usage: enable [-n] [-a] [name...]\n");
+			return UNKNOWN;
+		}
+	}
+
+	if (*args == NULL && !disable && !all) {
+		for (struct builtin *b = builtins; b->name; b++)
+			fprintf(ctx->out, "enable %s%s\n", b->disabled ? "-n " : "", b->name);
+		return SUCCESS;
+	}
+	if (*args == NULL) {
+		for (struct builtin *b = builtins; b->name; b++)
+			if (b->flags & BUILTIN_UTILITY)
+				b->disabled = disable;
+		return SUCCESS;
+	}
+
+	int status = SUCCESS;
+	for (; *args; args++) {
+		struct builtin *b = builtins;
+		while (b->name && strcmp(b->name, *args) != 0)
+			b++;
+		if (b->name == NULL || !(b->flags & BUILTIN_UTILITY)) {
+			fprintf(ctx->err, "-%s: enable: %s: %s\n", sysname, *args,
+				b->name ? "not a utility, it has no program to fall back to" : "not a built-in");
+			status = EXIT_FAILURE;
+			continue;
+		}
+		b->disabled = disable;
+	}
+	return status;
+}
+
+//BUILT-IN TABLE
+struct builtin builtins[] = {
+	{ "cd", cd_command, BUILTIN_SHELL },
+	{ "shortdir", shortdir_command, BUILTIN_SHELL },
+	{ "goodMorning", goodmorning_command, BUILTIN_SHELL },
+	{ "parallel", parallel_command, BUILTIN_LOOP },
+	{ "enable", enable_command, BUILTIN_SHELL },
+	{ "history", history_command, 0 },
+	{ "myfavorite", myfavorite_command, 0 },
+	{ "highlight", highlight_command, BUILTIN_LONG },
+	{ "kdiff", kdiff_command, BUILTIN_LONG },
+	{ "echo", echo_command, BUILTIN_UTILITY },
+	{ "printf", printf_command, BUILTIN_UTILITY },
+	{ "test", test_command, BUILTIN_UTILITY },
+	{ "[", test_command, BUILTIN_UTILITY },
+	{ "true", true_command, BUILTIN_UTILITY },
+	{ "false", false_command, BUILTIN_UTILITY },
+	{ "pwd", pwd_command, BUILTIN_UTILITY },
+	{ "cat", cat_command, BUILTIN_UTILITY },
+	{ "stats", stats_command, 0 },
+	{ "export", export_command, BUILTIN_SHELL },
+	{ "unset", unset_command, BUILTIN_SHELL },
+	{ NULL, NULL, 0 },
+};
+
+/**
+ * Look a command name up in the built-in table
+ * @return the enabled built-in, or NULL
+ */
+struct builtin *find_builtin(const char *name)
+{
+	for (struct builtin *b = builtins; b->name; b++)
+		if (strcmp(b->name, name) == 0)
+			return b->disabled ? NULL : b;
+	return NULL;
+}
+
+//EVENT LOOP
+//The shell waits in exactly one place: epoll over the terminal while a
+//line is typed, a signalfd for SIGCHLD, SIGINT and SIGWINCH, the
+//scheduler's timerfd and the pipes a running command is read through.
+//Those signals stay blocked in the shell and are only read from the
+//signalfd, so there are no handlers and no window where one can get
+//lost or interrupt the shell half way. Children get the original mask
+//back before they exec. Every exit is reaped here and handed to the
+//callback registered for that pid.
+
+#define LOOP_MAXFD 1024
+
+struct event_source {
+	event_fn fn;
+	void *arg;
+	int always; // regular files can't be polled and are always ready
+};
+
+struct child_watch {
+	pid_t pid;
+	child_fn fn;
+	void *arg;
+};
+
+static struct {
+	int epfd, sigfd;
+	sigset_t orig;   // mask the shell started with, restored in children
+	sigset_t mask;   // what the signalfd reads
+	struct event_source sources[LOOP_MAXFD];
+	int nalways;
+	struct child_watch *children;
+	int nchildren, capchildren;
+} loop = { .epfd = -1, .sigfd = -1 };
+
+static void term_size()
+{
+	struct winsize ws;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+		term_cols = ws.ws_col;
+}
+
+/**
+ * Reap every child that exited and run the callback watching it.
+ * Children nobody watches, like scheduled jobs, are just reaped.
+ */
+static void loop_reap()
+{
+	int status;
+	struct rusage ru;
+	pid_t pid;
+	while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+		for (int i = 0; i < loop.nchildren; i++) {
+			if (loop.children[i].pid != pid)
+				continue;
+			struct child_watch w = loop.children[i];
+			loop.children[i] = loop.children[--loop.nchildren];
+			w.fn(pid, status, &ru, w.arg);
+			break;
+		}
+	}
+}
+
+static void loop_signal(int fd, uint32_t events, void *arg)
+{
+	struct signalfd_siginfo si;
+	int chld = 0;
+	while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGCHLD)
+			chld = 1;
+		else if (si.ssi_signo == SIGINT) {
+			loop_interrupts++;
+			editor_interrupt(); // a foreground child got it too and ends
+		}
+		else if (si.ssi_signo == SIGWINCH)
+			term_size();
+	}
+	//several exits can share one SIGCHLD, loop_reap takes all of them
+	if (chld)
+		loop_reap();
+}
+
+static void loop_open()
+{
+	loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+	loop.sigfd = signalfd(-1, &loop.mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (loop.epfd == -1 || loop.sigfd == -1) {
+		printf("-%s: event loop: %s\n", sysname, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	loop_add(loop.sigfd, loop_signal, NULL);
+}
+
+/**
+ * Block the signals the loop reads and create the epoll set
+ */
+void loop_init()
+{
+	sigemptyset(&loop.mask);
+	sigaddset(&loop.mask, SIGCHLD);
+	sigaddset(&loop.mask, SIGINT);
+	sigaddset(&loop.mask, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &loop.mask, &loop.orig);
+	loop_open();
+	term_size();
+}
+
+/**
+ * Start over with an empty loop in a forked child that keeps running
+ * shell code, the epoll set is otherwise shared with the parent
+ */
+void loop_reset()
+{
+	close(loop.epfd);
+	close(loop.sigfd);
+	memset(loop.sources, 0, sizeof(loop.sources));
+	loop.nalways = 0;
+	loop.nchildren = 0;
+	loop_open();
+}
+
+/**
+ * In a forked child that is about to exec or run a built-in
+ */
+void loop_child()
+{
+	sigprocmask(SIG_SETMASK, &loop.orig, NULL);
+}
+
+/**
+ * In a forked child, after loop_child, that runs a built-in waiting on
+ * the event loop: a loop of its own to reap its children. Ctrl+C is read
+ * by that loop as in the shell, so the built-in can stop its children
+ * before the stage ends.
+ */
+void loop_subshell()
+{
+	sigprocmask(SIG_BLOCK, &loop.mask, NULL);
+	loop_reset();
+}
+
+/**
+ * Call fn whenever fd is readable, until loop_del
+ * @return 0, or -1 if the fd can't be watched
+ */
+int loop_add(int fd, event_fn fn, void *arg)
+{
+	if (fd < 0 || fd >= LOOP_MAXFD)
+		return -1;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	loop.sources[fd] = (struct event_source){ fn, arg, 0 };
+	if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		if (errno != EPERM) {
+			loop.sources[fd].fn = NULL;
+			return -1;
+		}
+		loop.sources[fd].always = 1;
+		loop.nalways++;
+	}
+	return 0;
+}
+
+void loop_del(int fd)
+{
+	if (fd < 0 || fd >= LOOP_MAXFD || loop.sources[fd].fn == NULL)
+		return;
+	if (loop.sources[fd].always)
+		loop.nalways--;
+	else
+		epoll_ctl(loop.epfd, EPOLL_CTL_DEL, fd, NULL);
+	loop.sources[fd].fn = NULL;
+	loop.sources[fd].always = 0;
+}
+
+/**
+ * Call fn once the child exits. Must be called right after fork, before
+ * the loop runs again, so the exit can't be reaped unclaimed.
+ */
+void loop_watch_child(pid_t pid, child_fn fn, void *arg)
+{
+	if (loop.nchildren == loop.capchildren) {
+		loop.capchildren = loop.capchildren ? loop.capchildren * 2 : 16;
+		loop.children = realloc(loop.children, sizeof(struct child_watch) * loop.capchildren);
+	}
+	loop.children[loop.nchildren++] = (struct child_watch){ pid, fn, arg };
+}
+
+/**
+ * Wait for events once and dispatch them
+ * @param timeout milliseconds, -1 to wait as long as it takes
+ */
+void loop_wait(int timeout)
+{
+	struct epoll_event evs[16];
+	fflush(stdout);
+	int n = epoll_wait(loop.epfd, evs, 16, loop.nalways ? 0 : timeout);
+	for (int i = 0; i < n; i++) {
+		struct event_source *s = &loop.sources[evs[i].data.fd];
+		if (s->fn)
+			s->fn(evs[i].data.fd, evs[i].events, s->arg);
+	}
+	for (int fd = 0; loop.nalways && fd < LOOP_MAXFD; fd++)
+		if (loop.sources[fd].always && loop.sources[fd].fn)
+			loop.sources[fd].fn(fd, EPOLLIN, loop.sources[fd].arg);
+}
+
+//PATH CACHE
+//Names of the executables in PATH, in an open addressing hash set. It is
+//checked once per prompt: rebuilt when PATH changes or one of its
+//directories has a new mtime, which costs a stat per directory.
+
+struct path_dir {
+	char *name;
+	struct timespec mtime;
+};
+
+static struct {
+	char *path;          // PATH the set was built from
+	struct path_dir *dirs;
+	int ndirs;
+	char **slots;
+	size_t nslots;       // power of two
+	size_t count;
+} pathcache;
+
+static void path_cache_insert(const char *name)
+{
+	if ((pathcache.count + 1) * 2 > pathcache.nslots) {
+		size_t n = pathcache.nslots ? pathcache.nslots * 2 : 1024;
+		char **slots = calloc(n, sizeof(char *));
+		for (size_t i = 0; i < pathcache.nslots; i++) {
+			if (!pathcache.slots[i])
+				continue;
+			size_t h = xxh64(pathcache.slots[i], strlen(pathcache.slots[i]), 0) & (n - 1);
+			while (slots[h])
+				h = (h + 1) & (n - 1);
+			slots[h] = pathcache.slots[i];
+		}
+		free(pathcache.slots);
+		pathcache.slots = slots;
+		pathcache.nslots = n;
+	}
+	size_t h = xxh64(name, strlen(name), 0) & (pathcache.nslots - 1);
+	while (pathcache.slots[h]) {
+		if (strcmp(pathcache.slots[h], name) == 0)
+			return;
+		h = (h + 1) & (pathcache.nslots - 1);
+	}
+	pathcache.slots[h] = strdup(name);
+	pathcache.count++;
+}
+
+int path_cache_has(const char *name)
+{
+	if (pathcache.count == 0)
+		return 0;
+	size_t h = xxh64(name, strlen(name), 0) & (pathcache.nslots - 1);
+	while (pathcache.slots[h]) {
+		if (strcmp(pathcache.slots[h], name) == 0)
+			return 1;
+		h = (h + 1) & (pathcache.nslots - 1);
+	}
+	return 0;
+}
+
+static void path_cache_clear()
+{
+	for (size_t i = 0; i < pathcache.nslots; i++)
+		free(pathcache.slots[i]);
+	free(pathcache.slots);
+	for (int i = 0; i < pathcache.ndirs; i++)
+		free(pathcache.dirs[i].name);
+	free(pathcache.dirs);
+	free(pathcache.path);
+	memset(&pathcache, 0, sizeof(pathcache));
+}
+
+static void path_cache_build(const char *path)
+{
+	path_cache_clear();
+	pathcache.path = strdup(path);
+	for (const char *p = path;; p++) {
+		const char *colon = strchr(p, ':');
+		int len = colon ? (int)(colon - p) : (int)strlen(p);
+		struct path_dir *d;
+		pathcache.dirs = realloc(pathcache.dirs, sizeof(struct path_dir) * (pathcache.ndirs + 1));
+		d = &pathcache.dirs[pathcache.ndirs++];
+		// an empty PATH entry means the current directory
+		d->name = len ? strndup(p, len) : strdup(".");
+		struct stat st;
+		memset(&d->mtime, 0, sizeof(d->mtime));
+		DIR *dir = opendir(d->name);
+		if (dir && fstat(dirfd(dir), &st) == 0)
+			d->mtime = st.st_mtim;
+		struct dirent *e;
+		while (dir && (e = readdir(dir)) != NULL) {
+			if (e->d_name[0] == '.' || e->d_type == DT_DIR)
+				continue;
+			if (faccessat(dirfd(dir), e->d_name, X_OK, 0) == 0)
+				path_cache_insert(e->d_name);
+		}
+		if (dir)
+			closedir(dir);
+		if (!colon)
+			break;
+		p = colon;
+	}
+}
+
+/**
+ * Make sure the set matches PATH and the directories in it
+ */
+void path_cache_refresh()
+{
+	const char *path = var_lookup("PATH");
+	if (path == NULL)
+		path = "";
+	if (pathcache.path && strcmp(pathcache.path, path) == 0) {
+		int i;
+		for (i = 0; i < pathcache.ndirs; i++) {
+			struct stat st;
+			struct timespec m = { 0, 0 };
+			if (stat(pathcache.dirs[i].name, &st) == 0)
+				m = st.st_mtim;
+			if (m.tv_sec != pathcache.dirs[i].mtime.tv_sec || m.tv_nsec != pathcache.dirs[i].mtime.tv_nsec)
+				break;
+		}
+		if (i == pathcache.ndirs)
+			return;
+	}
+	uint64_t t0 = TRACE_BEGIN();
+	path_cache_build(path);
+	TRACE_END("path_cache_build", t0, NULL);
+}
+
+//HISTORY INDEX
+//Every line entered, also from earlier sessions through $HOME/.seashell_history,
+//in a radix trie. Each node remembers the most recent and the most frequent
+//line below it, updated along the path on insert, so the suggestion for a
+//prefix is found by walking the prefix alone, whatever the history size.
+//SEASHELL_SUGGEST=frequent prefers the most used line, =off disables it.
+//
+//The log numbers every use for !n, and a trigram index over the distinct
+//lines answers !?substr by checking only the lines that hold its rarest
+//trigram.
+
+const char * historyfile = "/.seashell_history";
+
+struct hist_line {
+	char *line;
+	unsigned count;
+	unsigned last;       // sequence number of the latest use
+};
+
+struct trigram {
+	uint32_t key;        // the three bytes, never 0 as lines hold no NUL
+	int n, cap;
+	int *lines;          // in the order they were first entered
+};
+
+struct hist_node {
+	const char *label;   // edge from the parent, points into a line
+	int len;
+	int child, next;     // first child and next sibling, -1 for none
+	int line;            // line ending here, -1 for none
+	int recent, frequent;
+};
+
+static struct {
+	struct hist_line *lines;
+	int nlines, linecap;
+	struct hist_node *nodes;
+	int nnodes, nodecap;
+	int *log;            // line of every use, oldest first, !n is log[n-1]
+	int nlog, logcap;
+	struct trigram *trigrams; // open addressing, key 0 is a free slot
+	size_t ntrigrams, trigramslots; // trigramslots is a power of two
+	unsigned seq;
+	int mode;            // 0 off, 1 most recent, 2 most frequent
+	FILE *file;
+} histindex;
+
+static int hist_node_new(const char *label, int len)
+{
+	if (histindex.nnodes == histindex.nodecap) {
+		histindex.nodecap = histindex.nodecap ? histindex.nodecap * 2 : 1024;
+		histindex.nodes = realloc(histindex.nodes, sizeof(struct hist_node) * histindex.nodecap);
+	}
+	struct hist_node *n = &histindex.nodes[histindex.nnodes];
+	n->label = label;
+	n->len = len;
+	n->child = n->next = n->line = -1;
+	n->recent = n->frequent = -1;
+	return histindex.nnodes++;
+}
+
+static struct trigram *trigram_slot(uint32_t key)
+{
+	size_t mask = histindex.trigramslots - 1;
+	size_t h = (key * 0x9E3779B97F4A7C15ull) >> 32 & mask;
+	while (histindex.trigrams[h].key && histindex.trigrams[h].key != key)
+		h = (h + 1) & mask;
+	return &histindex.trigrams[h];
+}
+
+static void trigram_add(int l, const char *line)
+{
+	for (int i = 0; line[i] && line[i + 1] && line[i + 2]; i++) {
+		if ((histindex.ntrigrams + 1) * 2 > histindex.trigramslots) {
+			struct trigram *old = histindex.trigrams;
+			size_t n = histindex.trigramslots;
+			histindex.trigramslots = n ? n * 2 : 4096;
+			histindex.trigrams = calloc(histindex.trigramslots, sizeof(struct trigram));
+			for (size_t j = 0; j < n; j++)
+				if (old[j].key)
+					*trigram_slot(old[j].key) = old[j];
+			free(old);
+		}
+		uint32_t key = (unsigned char)line[i] << 16 | (unsigned char)line[i + 1] << 8 | (unsigned char)line[i + 2];
+		struct trigram *t = trigram_slot(key);
+		if (t->key == 0) {
+			t->key = key;
+			histindex.ntrigrams++;
+		}
+		if (t->n && t->lines[t->n - 1] == l)
+			continue; // repeated within the line
+		if (t->n == t->cap) {
+			t->cap = t->cap ? t->cap * 2 : 4;
+			t->lines = realloc(t->lines, sizeof(int) * t->cap);
+		}
+		t->lines[t->n++] = l;
+	}
+}
+
+static int hist_line_new(const char *line)
+{
+	if (histindex.nlines == histindex.linecap) {
+		histindex.linecap = histindex.linecap ? histindex.linecap * 2 : 1024;
+		histindex.lines = realloc(histindex.lines, sizeof(struct hist_line) * histindex.linecap);
+	}
+	struct hist_line *l = &histindex.lines[histindex.nlines];
+	l->line = strdup(line);
+	l->count = 0;
+	l->last = 0;
+	trigram_add(histindex.nlines, l->line);
+	return histindex.nlines++;
+}
+
+static int hist_child(int node, char c)
+{
+	int k;
+	for (k = histindex.nodes[node].child; k != -1; k = histindex.nodes[k].next)
+		if (histindex.nodes[k].label[0] == c)
+			break;
+	return k;
+}
+
+/**
+ * Add a use of line to the index
+ * @param line
+ */
+void hist_index_add(const char *line)
+{
+	int len = strlen(line);
+	if (len == 0 || len >= BUFFERSIZE)
+		return;
+	if (histindex.nnodes == 0)
+		hist_node_new("", 0);
+	int path[BUFFERSIZE + 1];
+	int npath = 0;
+	int node = 0, i = 0;
+	path[npath++] = 0;
+	while (i < len) {
+		int c = hist_child(node, line[i]);
+		if (c == -1) {
+			int l = hist_line_new(line);
+			c = hist_node_new(histindex.lines[l].line + i, len - i);
+			histindex.nodes[c].line = l;
+			histindex.nodes[c].next = histindex.nodes[node].child;
+			histindex.nodes[node].child = c;
+			path[npath++] = c;
+			node = c;
+			break;
+		}
+		struct hist_node *n = &histindex.nodes[c];
+		int m = 1;
+		while (m < n->len && i + m < len && n->label[m] == line[i + m])
+			m++;
+		if (m < n->len) {
+			//split the edge, the new node takes c's place among the siblings
+			int mid = hist_node_new(n->label, m);
+			struct hist_node *cn = &histindex.nodes[c], *mn = &histindex.nodes[mid];
+			mn->recent = cn->recent;
+			mn->frequent = cn->frequent;
+			mn->next = cn->next;
+			mn->child = c;
+			cn->next = -1;
+			cn->label += m;
+			cn->len -= m;
+			int *link = &histindex.nodes[node].child;
+			while (*link != c)
+				link = &histindex.nodes[*link].next;
+			*link = mid;
+			c = mid;
+		}
+		path[npath++] = c;
+		node = c;
+		i += m;
+	}
+	if (histindex.nodes[node].line == -1)
+		histindex.nodes[node].line = hist_line_new(line);
+
+	int l = histindex.nodes[node].line;
+	struct hist_line *hl = &histindex.lines[l];
+	hl->count++;
+	hl->last = ++histindex.seq;
+	if (histindex.nlog == histindex.logcap) {
+		histindex.logcap = histindex.logcap ? histindex.logcap * 2 : 1024;
+		histindex.log = realloc(histindex.log, sizeof(int) * histindex.logcap);
+	}
+	histindex.log[histindex.nlog++] = l;
+	//only this line changed, so it is the latest everywhere on its path
+	//and the most frequent wherever it caught up with the old one
+	for (int p = 0; p < npath; p++) {
+		struct hist_node *n = &histindex.nodes[path[p]];
+		n->recent = l;
+		if (n->frequent == -1 || histindex.lines[n->frequent].count <= hl->count)
+			n->frequent = l;
+	}
+}
+
+/**
+ * Find the node whose subtree holds the lines starting with prefix
+ * @return the node, -1 when no line starts with prefix
+ */
+static int hist_walk(const char *prefix, int len)
+{
+	if (histindex.nnodes == 0)
+		return -1;
+	int node = 0, i = 0;
+	while (i < len) {
+		int c = hist_child(node, prefix[i]);
+		if (c == -1)
+			return -1;
+		struct hist_node *n = &histindex.nodes[c];
+		int m = n->len < len - i ? n->len : len - i;
+		if (memcmp(n->label, prefix + i, m) != 0)
+			return -1;
+		i += m;
+		node = c;
+	}
+	return node;
+}
+
+/**
+ * Find the line to suggest for what has been typed so far
+ * @param  prefix typed text, not null terminated
+ * @param  len
+ * @return        a longer history line starting with prefix, or NULL
+ */
+const char *hist_index_suggest(const char *prefix, int len)
+{
+	if (histindex.mode == 0 || len == 0)
+		return NULL;
+	int node = hist_walk(prefix, len);
+	if (node == -1)
+		return NULL;
+	struct hist_node *n = &histindex.nodes[node];
+	int l = histindex.mode == 2 ? n->frequent : n->recent;
+	if (l == -1 || histindex.lines[l].line[len] == 0)
+		return NULL;
+	return histindex.lines[l].line;
+}
+
+/**
+ * Load the history file into the index and keep it open for appending
+ */
+void hist_index_load()
+{
+	const char *mode = getenv("SEASHELL_SUGGEST");
+	histindex.mode = mode && strcmp(mode, "off") == 0 ? 0 : mode && strcmp(mode, "frequent") == 0 ? 2 : 1;
+
+	char FILELOC[BUFFERSIZE];
+	snprintf(FILELOC, sizeof(FILELOC), "%s%s", getenv("HOME"), historyfile);
+	uint64_t t0 = TRACE_BEGIN();
+	FILE *f = fopen(FILELOC, "r");
+	if (f) {
+		char *line = NULL;
+		size_t cap = 0;
+		ssize_t n;
+		while ((n = getline(&line, &cap, f)) != -1) {
+			if (n > 0 && line[n - 1] == '\n')
+				line[n - 1] = 0;
+			hist_index_add(line);
+		}
+		free(line);
+		fclose(f);
+	}
+	TRACE_END("history_load", t0, NULL);
+	histindex.file = fopen(FILELOC, "a");
+}
+
+/**
+ * Remember a line entered at the prompt, in the index and the history file
+ * @param line
+ */
+void hist_index_record(const char *line)
+{
+	if (line[0] == 0)
+		return;
+	hist_index_add(line);
+	if (histindex.file) {
+		fprintf(histindex.file, "%s\n", line);
+		fflush(histindex.file);
+	}
+}
+
+/**
+ * @return the number of the latest history entry, the count of uses
+ */
+int hist_index_count()
+{
+	return histindex.nlog;
+}
+
+/**
+ * Most recent line containing s. Lines are taken from the list of the
+ * rarest trigram of s; shorter strings walk the log back to the first
+ * line that has them.
+ */
+static int hist_containing(const char *s, int len)
+{
+	if (len < 3) {
+		for (int i = histindex.nlog - 1; i >= 0; i--)
+			if (memmem(histindex.lines[histindex.log[i]].line, strlen(histindex.lines[histindex.log[i]].line), s, len))
+				return histindex.log[i];
+		return -1;
+	}
+	if (histindex.trigramslots == 0)
+		return -1;
+	struct trigram *rare = NULL;
+	for (int i = 0; i + 2 < len; i++) {
+		uint32_t key = (unsigned char)s[i] << 16 | (unsigned char)s[i + 1] << 8 | (unsigned char)s[i + 2];
+		struct trigram *t = trigram_slot(key);
+		if (t->key == 0)
+			return -1;
+		if (rare == NULL || t->n < rare->n)
+			rare = t;
+	}
+	int best = -1;
+	for (int i = 0; i < rare->n; i++) {
+		struct hist_line *l = &histindex.lines[rare->lines[i]];
+		if ((best == -1 || l->last > histindex.lines[best].last) && memmem(l->line, strlen(l->line), s, len))
+			best = rare->lines[i];
+	}
+	return best;
+}
+
+/**
+ * Resolve the event designator after a '!'
+ * @param  p   the text after the '!', advanced past the designator
+ * @return     the line, -1 when there is none
+ */
+static int hist_event(const char **p)
+{
+	const char *s = *p;
+	int prev = histindex.nlog ? histindex.log[histindex.nlog - 1] : -1;
+	if (*s == '!') {
+		*p = s + 1;
+		return prev;
+	}
+	if (*s == '$' || *s == '*' || *s == '^' || *s == ':')
+		return prev; // a word of the previous line
+	if (isdigit((unsigned char)*s) || (*s == '-' && isdigit((unsigned char)s[1]))) {
+		char *end;
+		long n = strtol(s, &end, 10);
+		*p = end;
+		if (n < 0)
+			n += histindex.nlog + 1;
+		return n >= 1 && n <= histindex.nlog ? histindex.log[n - 1] : -1;
+	}
+	if (*s == '?') {
+		const char *end = strchr(s + 1, '?');
+		int len = end ? end - s - 1 : (int)strlen(s + 1);
+		*p = s + 1 + len + (end != NULL);
+		return len ? hist_containing(s + 1, len) : -1;
+	}
+	int len = strcspn(s, " \t:");
+	*p = s + len;
+	int node = hist_walk(s, len);
+	return node == -1 ? -1 : histindex.nodes[node].recent;
+}
+
+/**
+ * Apply a word designator, :n :n-m :n* :^ :$ :* or ^ $ * without the colon
+ * @param  p    the text after the event, advanced past the designator
+ * @param  line the event's line
+ * @param  out  gets the words
+ * @return      0, or -1 for a word the line doesn't have
+ */
+static int hist_words(const char **p, const char *line, struct buffer *out)
+{
+	const char *s = *p;
+	if (*s == ':' && s[1] && strchr("0123456789^$*-", s[1]))
+		s++;
+	else if (*s != '^' && *s != '$' && *s != '*') {
+		buffer_append(out, line, strlen(line));
+		return 0;
+	}
+
+	//word boundaries, split at whitespace as parse_command does
+	const char *words[BUFFERSIZE / 2];
+	int lens[BUFFERSIZE / 2], n = 0;
+	for (const char *w = line; *w; ) {
+		w += strspn(w, " \t");
+		if (*w == 0)
+			break;
+		lens[n] = strcspn(w, " \t");
+		words[n++] = w;
+		w += lens[n - 1];
+	}
+	int last = n - 1, x, y;
+	if (*s == '*') {
+		s++;
+		x = 1;
+		y = last;
+	}
+	else {
+		if (*s == '^') {
+			x = 1;
+			s++;
+		}
+		else if (*s == '$') {
+			x = last;
+			s++;
+		}
+		else if (*s == '-')
+			x = 0;
+		else
+			x = strtol(s, (char **)&s, 10);
+		y = x;
+		if (*s == '*') {
+			s++;
+			y = last;
+		}
+		else if (*s == '-') {
+			s++;
+			if (*s == '$') {
+				s++;
+				y = last;
+			}
+			else if (isdigit((unsigned char)*s))
+				y = strtol(s, (char **)&s, 10);
+			else
+				y = last;
+		}
+		if (x > last || y > last || x > y)
+			return -1;
+	}
+	*p = s;
+	for (int i = x; i <= y && i <= last; i++) {
+		if (i > x)
+			buffer_append(out, " ", 1);
+		buffer_append(out, words[i], lens[i]);
+	}
+	return 0;
+}
+
+/**
+ * Expand history designators anywhere in a line, as bash does: !! !n
+ * !-n !prefix !?substr? and a leading ^old^new, each optionally followed
+ * by a word designator. A '!' before whitespace, = or (, before the
+ * closing double quote or inside single quotes stays as it is.
+ * @param  line
+ * @param  out  gets the expanded line
+ * @param  size of out
+ * @return      1 when the line changed, 0 when not, -1 after an error
+ *              was printed
+ */
+int hist_expand(const char *line, char *out, size_t size)
+{
+	struct buffer b = {0};
+	const char *p = line;
+	int changed = 0, quoted = 0, dquoted = 0;
+
+	if (line[0] == '^') {
+		//^old^new^rest is !!:s^old^new^ followed by rest
+		const char *old = line + 1, *sep = strchr(old, '^');
+		const char *prevline = histindex.nlog ? histindex.lines[histindex.log[histindex.nlog - 1]].line : "";
+		const char *at = NULL;
+		if (sep && sep > old) {
+			char *o = strndup(old, sep - old);
+			at = strstr(prevline, o);
+			free(o);
+		}
+		if (at == NULL) {
+			printf("-%s: :s%s: substitution failed\n", sysname, line);
+			return -1;
+		}
+		const char *new = sep + 1, *end = strchr(new, '^');
+		int newlen = end ? end - new : (int)strlen(new);
+		buffer_append(&b, prevline, at - prevline);
+		buffer_append(&b, new, newlen);
+		at += sep - old;
+		buffer_append(&b, at, strlen(at));
+		p = end ? end + 1 : new + newlen;
+		changed = 1;
+	}
+
+	while (*p) {
+		if (*p == '\'' && !dquoted)
+			quoted = !quoted;
+		else if (*p == '"' && !quoted)
+			dquoted = !dquoted;
+		if (*p != '!' || quoted || p[1] == 0 || strchr(" \t=(", p[1]) || (dquoted && p[1] == '"')) {
+			buffer_append(&b, p, 1);
+			p++;
+			continue;
+		}
+		const char *start = p++;
+		int l = hist_event(&p);
+		if (l == -1) {
+			printf("-%s: %.*s: event not found\n", sysname, (int)(p - start), start);
+			free(b.data);
+			return -1;
+		}
+		if (hist_words(&p, histindex.lines[l].line, &b) == -1) {
+			printf("-%s: %.*s: bad word specifier\n", sysname, (int)strcspn(start, " \t"), start);
+			free(b.data);
+			return -1;
+		}
+		changed = 1;
+	}
+	if (b.len >= size) {
+		printf("-%s: expanded line too long\n", sysname);
+		free(b.data);
+		return -1;
+	}
+	if (b.len)
+		memcpy(out, b.data, b.len);
+	out[b.len] = 0;
+	free(b.data);
+	return changed;
+}
+
+//SCRIPTS
+//if, while, until, for, functions, && and || are compiled to bytecode
+//and run by a small VM. A simple command is compiled to a template of
+//words: quotes are taken out, operators are found and $name references
+//are resolved to variable slots once, so a loop splits its body once.
+//When it runs each word is expanded on its own and only split at
+//whitespace, a value is never taken for | or >. $(...) and `...` are compiled along with
+//the template and run in the shell when it expands. Scripts run with ./seashell file [args]
+//and source file [args]; at the prompt, lines that need the compiler go
+//through it and an open compound command continues on the next lines.
+
+enum opcode {
+	OP_RUN,         // run template a
+	OP_NOT,         // invert last_status
+	OP_STATUS,      // set last_status to a
+	OP_JUMP,        // to a
+	OP_JUMPFALSE,   // to a when last_status is not 0
+	OP_JUMPTRUE,    // to a when last_status is 0
+	OP_FORINIT,     // push the words of template a, of the arguments when a is -1
+	OP_FORNEXT,     // next word into slot a, to b when there are none left
+	OP_FOREND,      // pop the innermost for's words
+	OP_DEFINE,      // define function name a with its body at b
+	OP_RETURN,      // from a function with status a, or last_status when -1
+	OP_ASSIGN,      // set slot a to template b, expanded but not split
+};
+
+struct insn {
+	unsigned char op;
+	int a, b;
+};
+
+enum piece_kind {
+	PIECE_TEXT,
+	PIECE_VAR,      // $name, n is the slot
+	PIECE_STATUS,   // $?
+	PIECE_ARG,      // $0 to $9, n is the number
+	PIECE_NARGS,    // $#
+	PIECE_ARGS,     // $@ and $*
+	PIECE_SUBST,    // $(...) or `...`, sub is the command
+	PIECE_BREAK,    // unquoted whitespace, the end of a word
+	PIECE_OP,       // | & < > or >> starting a word, n is '|', '&', '<', '>' or 'a'
+};
+
+struct piece {
+	unsigned char kind;
+	bool quoted;    // in quotes or escaped: not split into words, no patterns
+	int n;          // slot, argument number or length of the text
+	const char *text;
+	struct program *sub;
+};
+
+struct template {
+	char *text;     // the command as written, pieces point into it
+	struct piece *pieces;
+	int npieces;
+};
+
+struct program {
+	struct insn *code;
+	int ncode, codecap;
+	struct template *templates;
+	int ntemplates;
+	char **names;   // of the functions it defines
+	int nnames;
+	bool keep;      // defines functions, which outlive the run
+};
+
+//variables, interned by name so compiled code refers to them by slot.
+//The environment is imported into them at startup and programs get the
+//exported ones through an envp array that is only rebuilt after one of
+//them changed; each variable keeps its "name=value" entry until then.
+struct shell_var {
+	char *name;
+	char *value;
+	bool exported;
+	char *entry;    // "name=value" in envp, NULL until needed
+};
+
+static struct {
+	struct shell_var *v;
+	int n, cap;
+} shellvars;
+
+static struct {
+	char **envp;
+	int dirty;      // an exported variable changed since envp was built
+} shellenv = { NULL, 1 };
+
+struct shell_func {
+	char *name;
+	struct program *prog;
+	int addr;
+};
+
+static struct shell_func *functions;
+static int nfunctions;
+
+/**
+ * Slot of a variable, created unset on first use
+ * @param  name
+ * @param  len  of the name
+ * @return      the slot
+ */
+int var_slot(const char *name, int len)
+{
+	for (int i = 0; i < shellvars.n; i++)
+		if ((int)strlen(shellvars.v[i].name) == len && memcmp(shellvars.v[i].name, name, len) == 0)
+			return i;
+	if (shellvars.n == shellvars.cap) {
+		shellvars.cap = shellvars.cap ? shellvars.cap * 2 : 64;
+		shellvars.v = realloc(shellvars.v, sizeof(struct shell_var) * shellvars.cap);
+	}
+	shellvars.v[shellvars.n].name = strndup(name, len);
+	shellvars.v[shellvars.n].value = NULL;
+	shellvars.v[shellvars.n].exported = false;
+	shellvars.v[shellvars.n].entry = NULL;
+	return shellvars.n++;
+}
+
+void var_set(int slot, const char *value)
+{
+	struct shell_var *v = &shellvars.v[slot];
+	free(v->value);
+	v->value = value ? strdup(value) : NULL;
+	free(v->entry);
+	v->entry = NULL;
+	if (v->exported)
+		shellenv.dirty = 1;
+}
+
+void var_export(int slot, bool exported)
+{
+	if (shellvars.v[slot].exported != exported)
+		shellenv.dirty = 1;
+	shellvars.v[slot].exported = exported;
+}
+
+/**
+ * Value of a variable
+ * @return the value, NULL when unset
+ */
+const char *var_get(int slot)
+{
+	return shellvars.v[slot].value;
+}
+
+const char *var_lookup(const char *name)
+{
+	return var_get(var_slot(name, strlen(name)));
+}
+
+/**
+ * Length of the name if word is an assignment, name=value
+ * @return 0 if it isn't one
+ */
+int var_assignment(const char *word)
+{
+	int len = 0;
+	if (!isalpha((unsigned char)word[0]) && word[0] != '_')
+		return 0;
+	while (isalnum((unsigned char)word[len]) || word[len] == '_')
+		len++;
+	return word[len] == '=' ? len : 0;
+}
+
+/**
+ * Take over the environment the shell started with, all of it exported
+ */
+void var_init()
+{
+	extern char **environ;
+	for (char **e = environ; *e; e++) {
+		const char *eq = strchr(*e, '=');
+		if (eq == NULL)
+			continue;
+		int slot = var_slot(*e, eq - *e);
+		var_set(slot, eq + 1);
+		var_export(slot, true);
+	}
+}
+
+/**
+ * The environment for execve, rebuilt only when an exported variable
+ * changed since the last call. Called before forking so children use
+ * the parent's copy.
+ */
+char **var_environ()
+{
+	if (!shellenv.dirty)
+		return shellenv.envp;
+	uint64_t t0 = TRACE_BEGIN();
+	int n = 0;
+	for (int i = 0; i < shellvars.n; i++)
+		n += shellvars.v[i].exported && shellvars.v[i].value;
+	shellenv.envp = realloc(shellenv.envp, sizeof(char *) * (n + 1));
+	n = 0;
+	for (int i = 0; i < shellvars.n; i++) {
+		struct shell_var *v = &shellvars.v[i];
+		if (!v->exported || !v->value)
+			continue;
+		if (v->entry == NULL) {
+			size_t len = strlen(v->name), vlen = strlen(v->value);
+			v->entry = malloc(len + vlen + 2);
+			memcpy(v->entry, v->name, len);
+			v->entry[len] = '=';
+			memcpy(v->entry + len + 1, v->value, vlen + 1);
+		}
+		shellenv.envp[n++] = v->entry;
+	}
+	shellenv.envp[n] = NULL;
+	shellenv.dirty = 0;
+	TRACE_END("environ", t0, NULL);
+	return shellenv.envp;
+}
+
+static struct shell_func *find_function(const char *name)
+{
+	for (int i = 0; i < nfunctions; i++)
+		if (strcmp(functions[i].name, name) == 0)
+			return &functions[i];
+	return NULL;
+}
+
+//COMPILER
+
+struct loop_ctx {
+	int cont;           // where continue goes
+	int *breaks;        // jumps to patch with the loop's end
+	int nbreaks;
+};
+
+struct compiler {
+	const char *p;      // rest of the source
+	int line;
+	const char *file;   // for errors, NULL at the prompt
+	char *seg;          // current command, up to ; newline && or ||
+	char *at;           // what is left of it
+	int term;           // what ended it: ';', '\n', '&' for &&, '|' for || or 0
+	int segline;
+	struct program *prog;
+	struct loop_ctx loops[32];
+	int nloops;
+	int error;
+	int incomplete;     // the source ended inside a compound command
+	int quiet;          // don't print errors, only checking for incomplete
+};
+
+static void compile_error(struct compiler *c, const char *fmt, const char *what)
+{
+	if (!c->error && !c->quiet) {
+		if (c->file)
+			printf("-%s: %s: line %d: ", sysname, c->file, c->segline);
+		else
+			printf("-%s: ", sysname);
+		printf(fmt, what);
+		printf("\n");
+	}
+	c->error = 1;
+}
+
+static int emit(struct compiler *c, int op, int a, int b)
+{
+	struct program *prog = c->prog;
+	if (prog->ncode == prog->codecap) {
+		prog->codecap = prog->codecap ? prog->codecap * 2 : 64;
+		prog->code = realloc(prog->code, sizeof(struct insn) * prog->codecap);
+	}
+	prog->code[prog->ncode].op = op;
+	prog->code[prog->ncode].a = a;
+	prog->code[prog->ncode].b = b;
+	return prog->ncode++;
+}
+
+static void template_piece(struct template *t, int kind, bool quoted, int n, const char *text)
+{
+	t->pieces = realloc(t->pieces, sizeof(struct piece) * (t->npieces + 1));
+	t->pieces[t->npieces].kind = kind;
+	t->pieces[t->npieces].quoted = quoted;
+	t->pieces[t->npieces].n = n;
+	t->pieces[t->npieces].text = text;
+	t->pieces[t->npieces].sub = NULL;
+	t->npieces++;
+}
+
+/**
+ * Find the end of a command substitution. Quotes and substitutions
+ * inside it nest.
+ * @param  s at the $( or the opening backquote
+ * @return   the closing ) or backquote, NULL when the source ends first
+ */
+static const char *subst_end(const char *s)
+{
+	if (*s == '`') {
+		for (s++; *s; s++) {
+			if (*s == '\\' && s[1])
+				s++;
+			else if (*s == '`')
+				return s;
+		}
+		return NULL;
+	}
+	int depth = 0, sq = 0, dq = 0;
+	for (s += 2; *s; s++) {
+		if (*s == '\\' && s[1] && !sq)
+			s++;
+		else if (*s == '\'' && !dq)
+			sq = !sq;
+		else if (*s == '"' && !sq)
+			dq = !dq;
+		else if (!sq && ((*s == '$' && s[1] == '(') || *s == '`')) {
+			if ((s = subst_end(s)) == NULL)
+				return NULL;
+		}
+		else if (!sq && !dq && *s == '(')
+			depth++;
+		else if (!sq && !dq && *s == ')' && depth-- == 0)
+			return s;
+	}
+	return NULL;
+}
+
+struct program *script_compile(const char *src, const char *file, int *incomplete);
+
+/**
+ * Compile a simple command into a template of words. Quotes are taken
+ * out here: '...' is literal, elsewhere $name, ${name}, $?, $#, $@, $*,
+ * $0 to $9, $(...) and `...` expand, and a backslash keeps the next
+ * character as it is (inside "..." only before $ ` " and \). Unquoted
+ * whitespace ends a word and, with ops, | & < > and >> at the start of a
+ * word are the command's syntax. What an expansion produces is only ever
+ * split into words, see template_command.
+ * @return the template's index in the program
+ */
+static int compile_template(struct compiler *c, const char *text, int ops)
+{
+	struct program *prog = c->prog;
+	prog->templates = realloc(prog->templates, sizeof(struct template) * (prog->ntemplates + 1));
+	struct template *t = &prog->templates[prog->ntemplates];
+	memset(t, 0, sizeof(struct template));
+	t->text = strdup(text);
+
+	const char *s = t->text, *lit = s;
+	int sq = 0, dq = 0, start = 1; // start: nothing of the current word yet
+	int opened = 0; // pieces when the open quote began
+	while (*s) {
+		if (!sq && !dq && (*s == ' ' || *s == '\t' || *s == '\n')) {
+			if (s > lit)
+				template_piece(t, PIECE_TEXT, false, s - lit, lit);
+			if (!start)
+				template_piece(t, PIECE_BREAK, false, 0, NULL);
+			s += strspn(s, " \t\n");
+			lit = s;
+			start = 1;
+			continue;
+		}
+		if (ops && start && !sq && !dq && strchr("|&<>", *s)) {
+			int op = *s == '>' && s[1] == '>' ? 'a' : *s;
+			int len = op == 'a' ? 2 : 1;
+			//| and & are words of their own, a|b stays one word
+			if ((op != '|' && op != '&') || s[1] == 0 || s[1] == ' ' || s[1] == '\t' || s[1] == '\n') {
+				template_piece(t, PIECE_OP, false, op, NULL);
+				s = lit = s + len;
+				continue; // still at the start, a redirection's target follows
+			}
+		}
+		start = 0;
+		if ((*s == '\'' && !dq) || (*s == '"' && !sq)) {
+			//"" is an empty word, though "$@" without arguments is none
+			if (s > lit || ((sq || dq) && t->npieces == opened))
+				template_piece(t, PIECE_TEXT, sq || dq, s - lit, lit);
+			opened = t->npieces;
+			if (*s == '\'')
+				sq = !sq;
+			else
+				dq = !dq;
+			lit = ++s;
+			continue;
+		}
+		if (*s == '\\' && !sq && s[1] && (!dq || strchr("$`\"\\", s[1]))) {
+			if (s > lit)
+				template_piece(t, PIECE_TEXT, dq, s - lit, lit);
+			template_piece(t, PIECE_TEXT, true, 1, s + 1);
+			s = lit = s + 2;
+			continue;
+		}
+		const char *e = !sq && ((*s == '$' && s[1] == '(') || *s == '`') ? subst_end(s) : NULL;
+		if (e) {
+			if (s > lit)
+				template_piece(t, PIECE_TEXT, dq, s - lit, lit);
+			int open = *s == '`' ? 1 : 2, incomplete;
+			char *inner = strndup(s + open, e - s - open);
+			struct program *sub = script_compile(inner, c->file, c->quiet ? &incomplete : NULL);
+			free(inner);
+			if (sub == NULL)
+				c->error = 1; // the inner compile reported it
+			template_piece(t, PIECE_SUBST, dq, 0, NULL);
+			t->pieces[t->npieces - 1].sub = sub;
+			s = lit = e + 1;
+			continue;
+		}
+		if (sq || *s != '$') {
+			s++;
+			continue;
+		}
+		const char *v = s + 1;
+		int kind = -1, n = 0, len = 1;
+		if (*v == '?')
+			kind = PIECE_STATUS;
+		else if (*v == '#')
+			kind = PIECE_NARGS;
+		else if (*v == '@' || *v == '*')
+			kind = PIECE_ARGS;
+		else if (isdigit((unsigned char)*v)) {
+			kind = PIECE_ARG;
+			n = *v - '0';
+		}
+		else {
+			int braced = *v == '{';
+			const char *name = v + braced;
+			len = 0;
+			if (isalpha((unsigned char)name[0]) || name[0] == '_')
+				while (isalnum((unsigned char)name[len]) || name[len] == '_')
+					len++;
+			if (len == 0 || (braced && name[len] != '}')) {
+				s++; // not a variable, the $ stays
+				continue;
+			}
+			kind = PIECE_VAR;
+			n = var_slot(name, len);
+			len += 2 * braced;
+		}
+		if (s > lit)
+			template_piece(t, PIECE_TEXT, dq, s - lit, lit);
+		template_piece(t, kind, dq, n, NULL);
+		s = lit = v + len;
+	}
+	if (s > lit)
+		template_piece(t, PIECE_TEXT, sq || dq, s - lit, lit);
+	return prog->ntemplates++;
+}
+
+/**
+ * Load the next command of the source, up to an unquoted ; newline && or
+ * || or the end. Comments, from a # starting a word to the end of the
+ * line, are dropped and so are empty commands.
+ * @return 0 at the end of the source
+ */
+static int seg_load(struct compiler *c)
+{
+	free(c->seg);
+	c->seg = c->at = NULL;
+	while (*c->p) {
+		struct buffer b = {0};
+		const char *p = c->p;
+		int sq = 0, dq = 0, open = 0;
+		c->segline = c->line;
+		while (*p) {
+			//a substitution is copied whole, its ; and newlines are its own
+			if (!sq && ((*p == '$' && p[1] == '(') || *p == '`')) {
+				const char *e = subst_end(p);
+				if (e == NULL) {
+					open = *p == '`' ? '`' : ')';
+					p += strlen(p);
+					break;
+				}
+				for (; p <= e; p++) {
+					if (*p == '\n')
+						c->line++;
+					buffer_append(&b, p, 1);
+				}
+				continue;
+			}
+			if (!sq && !dq) {
+				if (*p == ';' || *p == '\n' || (*p == '&' && p[1] == '&') || (*p == '|' && p[1] == '|'))
+					break;
+				if (*p == '#' && (b.len == 0 || b.data[b.len - 1] == ' ' || b.data[b.len - 1] == '\t')) {
+					p += strcspn(p, "\n");
+					continue;
+				}
+			}
+			if (*p == '\\' && p[1] == '\n' && !sq) { // line continuation
+				p += 2;
+				c->line++;
+				continue;
+			}
+			if (*p == '\\' && p[1] && p[1] != '\n' && !sq) { // \" \; and the like stay literal
+				buffer_append(&b, p, 2);
+				p += 2;
+				continue;
+			}
+			if (*p == '\'' && !dq)
+				sq = !sq;
+			else if (*p == '"' && !sq)
+				dq = !dq;
+			else if (*p == '\n')
+				c->line++;
+			buffer_append(&b, p, 1);
+			p++;
+		}
+		if (sq || dq || open) {
+			c->incomplete = 1;
+			compile_error(c, "unexpected end of file looking for the closing %s",
+				open == '`' ? "`" : open ? ")" : sq ? "'" : "\"");
+			free(b.data);
+			c->p = p;
+			return 0;
+		}
+		c->term = *p;
+		if (*p == '&' || *p == '|')
+			p += 2;
+		else if (*p) {
+			if (*p == '\n')
+				c->line++;
+			p++;
+		}
+		c->p = p;
+
+		//trim, and skip commands with nothing in them
+		char *s = b.data ? b.data : "";
+		s += strspn(s, " \t");
+		int len = strlen(s);
+		while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t'))
+			len--;
+		if (len == 0) {
+			free(b.data);
+			if (c->term == '&' || c->term == '|') {
+				compile_error(c, "syntax error near `%s'", c->term == '&' ? "&&" : "||");
+				return 0;
+			}
+			continue;
+		}
+		c->seg = strndup(s, len);
+		c->at = c->seg;
+		free(b.data);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Make sure there is a command to compile
+ * @return 0 at the end of the source
+ */
+static int seg_next(struct compiler *c)
+{
+	if (c->error)
+		return 0;
+	if (c->at && *c->at)
+		return 1;
+	return seg_load(c);
+}
+
+/**
+ * Copy the first word of what is left of the command
+ * @return its length
+ */
+static int seg_word(struct compiler *c, char *w, int size)
+{
+	int n = strcspn(c->at, " \t");
+	int m = n < size - 1 ? n : size - 1;
+	memcpy(w, c->at, m);
+	w[m] = 0;
+	return n;
+}
+
+static void seg_take(struct compiler *c, int n)
+{
+	c->at += n;
+	c->at += strspn(c->at, " \t");
+}
+
+/**
+ * After a closing keyword nothing may follow in the same command
+ */
+static void seg_end(struct compiler *c)
+{
+	if (*c->at)
+		compile_error(c, "syntax error near `%s'", c->at);
+}
+
+static void compile_andor(struct compiler *c);
+
+/**
+ * Compile commands until one starts with a word in stops
+ * @return the index of the stop word found, -1 at the end of the source
+ */
+static int compile_list(struct compiler *c, const char **stops)
+{
+	char w[64];
+	while (seg_next(c)) {
+		seg_word(c, w, sizeof(w));
+		for (int i = 0; stops && stops[i]; i++)
+			if (strcmp(w, stops[i]) == 0)
+				return i;
+		compile_andor(c);
+	}
+	if (stops && !c->error) {
+		c->incomplete = 1;
+		compile_error(c, "unexpected end of file, %s expected", stops[0]);
+	}
+	return -1;
+}
+
+/**
+ * Compile a list that has to end with the keyword stop, and take it
+ */
+static int compile_until(struct compiler *c, const char *stop)
+{
+	const char *stops[] = { stop, NULL };
+	if (compile_list(c, stops) == -1)
+		return -1;
+	seg_take(c, strlen(stop));
+	return 0;
+}
+
+static void compile_if(struct compiler *c)
+{
+	static const char *branches[] = { "elif", "else", "fi", NULL };
+	int ends[64], nends = 0;
+	seg_take(c, 2);
+	while (1) {
+		if (compile_until(c, "then") == -1)
+			return;
+		int jf = emit(c, OP_JUMPFALSE, -1, 0);
+		int stop = compile_list(c, branches);
+		if (stop == -1)
+			return;
+		if (nends < 64)
+			ends[nends++] = emit(c, OP_JUMP, -1, 0);
+		c->prog->code[jf].a = c->prog->ncode;
+		seg_take(c, strlen(branches[stop]));
+		if (stop == 0)
+			continue;
+		if (stop == 1) {
+			if (compile_until(c, "fi") == -1)
+				return;
+		}
+		else
+			emit(c, OP_STATUS, 0, 0); // no branch taken is a success
+		break;
+	}
+	for (int i = 0; i < nends; i++)
+		c->prog->code[ends[i]].a = c->prog->ncode;
+	seg_end(c);
+}
+
+static struct loop_ctx *loop_push(struct compiler *c, int cont)
+{
+	if (c->nloops == 32) {
+		compile_error(c, "loops nested too deep%s", "");
+		return NULL;
+	}
+	struct loop_ctx *l = &c->loops[c->nloops++];
+	l->cont = cont;
+	l->breaks = NULL;
+	l->nbreaks = 0;
+	return l;
+}
+
+static void loop_pop(struct compiler *c, int end)
+{
+	struct loop_ctx *l = &c->loops[--c->nloops];
+	for (int i = 0; i < l->nbreaks; i++)
+		c->prog->code[l->breaks[i]].a = end;
+	free(l->breaks);
+}
+
+static void compile_while(struct compiler *c, int until)
+{
+	seg_take(c, 5); // while and until
+	int top = c->prog->ncode;
+	if (compile_until(c, "do") == -1)
+		return;
+	int jf = emit(c, until ? OP_JUMPTRUE : OP_JUMPFALSE, -1, 0);
+	if (loop_push(c, top) == NULL)
+		return;
+	int r = compile_until(c, "done");
+	emit(c, OP_JUMP, top, 0);
+	c->prog->code[jf].a = c->prog->ncode;
+	loop_pop(c, c->prog->ncode);
+	emit(c, OP_STATUS, 0, 0);
+	if (r == 0)
+		seg_end(c);
+}
+
+static void compile_for(struct compiler *c)
+{
+	char name[64], w[64];
+	seg_take(c, 3);
+	int n = seg_word(c, name, sizeof(name));
+	int valid = n > 0 && n < (int)sizeof(name) && (isalpha((unsigned char)name[0]) || name[0] == '_');
+	for (int i = 0; valid && i < n; i++)
+		valid = isalnum((unsigned char)name[i]) || name[i] == '_';
+	if (!valid) {
+		compile_error(c, "for: `%s' is not a valid name", n ? name : "");
+		return;
+	}
+	int slot = var_slot(name, n);
+	seg_take(c, n);
+
+	//for name in words..., or for name alone to go over the arguments
+	int words = -1;
+	seg_word(c, w, sizeof(w));
+	if (strcmp(w, "in") == 0) {
+		//compiled as the arguments of a command named in, see OP_FORINIT
+		seg_take(c, 2);
+		char *line = malloc(strlen(c->at) + 4);
+		sprintf(line, "in %s", c->at);
+		words = compile_template(c, line, 0);
+		free(line);
+		c->at += strlen(c->at);
+	}
+	else if (*c->at && strcmp(w, "do") != 0) {
+		compile_error(c, "syntax error near `%s'", w);
+		return;
+	}
+	emit(c, OP_FORINIT, words, 0);
+	int next = emit(c, OP_FORNEXT, slot, -1);
+	if (!seg_next(c)) {
+		c->incomplete = !c->error;
+		compile_error(c, "unexpected end of file, %s expected", "do");
+		return;
+	}
+	seg_word(c, w, sizeof(w));
+	if (strcmp(w, "do") != 0) {
+		compile_error(c, "syntax error near `%s', do expected", w);
+		return;
+	}
+	seg_take(c, 2);
+	if (loop_push(c, next) == NULL)
+		return;
+	int r = compile_until(c, "done");
+	emit(c, OP_JUMP, next, 0);
+	int end = emit(c, OP_FOREND, 0, 0);
+	c->prog->code[next].b = end;
+	loop_pop(c, end);
+	if (r == 0)
+		seg_end(c);
+}
+
+/**
+ * name() { ... } or function name [()] { ... }. The body is compiled in
+ * place behind a jump and defined when the definition runs.
+ */
+static void compile_function(struct compiler *c, int keyword)
+{
+	if (keyword)
+		seg_take(c, 8);
+	const char *s = c->at;
+	int len = 0;
+	while (isalnum((unsigned char)s[len]) || s[len] == '_' || s[len] == '-' || s[len] == '.')
+		len++;
+	if (len == 0) {
+		compile_error(c, "syntax error near `%s'", s);
+		return;
+	}
+	char *name = strndup(s, len);
+	c->at += len;
+	c->at += strspn(c->at, " \t");
+	if (strncmp(c->at, "()", 2) == 0)
+		seg_take(c, 2);
+	else if (!keyword) {
+		compile_error(c, "syntax error near `%s'", c->at);
+		free(name);
+		return;
+	}
+	if (!seg_next(c)) {
+		c->incomplete = !c->error;
+		compile_error(c, "unexpected end of file, %s expected", "{");
+		free(name);
+		return;
+	}
+	if (c->at[0] != '{') {
+		compile_error(c, "syntax error near `%s', { expected", c->at);
+		free(name);
+		return;
+	}
+	seg_take(c, 1);
+
+	struct program *prog = c->prog;
+	prog->names = realloc(prog->names, sizeof(char *) * (prog->nnames + 1));
+	prog->names[prog->nnames] = name;
+	prog->keep = true;
+	emit(c, OP_DEFINE, prog->nnames++, prog->ncode + 2);
+	int skip = emit(c, OP_JUMP, -1, 0);
+
+	//break and continue don't reach loops around the definition
+	int nloops = c->nloops;
+	c->nloops = 0;
+	int r = compile_until(c, "}");
+	c->nloops = nloops;
+	emit(c, OP_RETURN, -1, 0);
+	c->prog->code[skip].a = c->prog->ncode;
+	if (r == 0)
+		seg_end(c);
+}
+
+/**
+ * A command of nothing but name=value words, or export followed by
+ * them, sets the variables with OP_ASSIGN so a value is expanded without
+ * being split into words. With a command after them the assignments
+ * stay in its text and only go to its environment (see assign_command).
+ * @return 1 when the command was compiled here
+ */
+static int compile_assignments(struct compiler *c)
+{
+	struct { const char *word; int len, namelen; } words[64];
+	int n = 0;
+	const char *p = c->at;
+	int export = strncmp(p, "export", 6) == 0 && (p[6] == ' ' || p[6] == '\t');
+	if (export)
+		p += 6 + strspn(p + 6, " \t");
+	while (*p) {
+		const char *w = p;
+		int sq = 0, dq = 0;
+		while (*p && (sq || dq || (*p != ' ' && *p != '\t'))) {
+			const char *e = !sq && ((*p == '$' && p[1] == '(') || *p == '`') ? subst_end(p) : NULL;
+			if (e)
+				p = e;
+			else if (*p == '\\' && p[1] && !sq)
+				p++;
+			else if (*p == '\'' && !dq)
+				sq = !sq;
+			else if (*p == '"' && !sq)
+				dq = !dq;
+			p++;
+		}
+		int namelen = var_assignment(w);
+		if (n == 64 || (namelen == 0 && !export))
+			return 0;
+		words[n].word = w;
+		words[n].len = p - w;
+		words[n++].namelen = namelen;
+		p += strspn(p, " \t");
+	}
+	if (n == 0)
+		return 0;
+
+	struct buffer names = {0};
+	buffer_append(&names, "export", 6);
+	for (int i = 0; i < n; i++) {
+		int len = words[i].namelen ? words[i].namelen : words[i].len;
+		if (words[i].namelen) {
+			char *value = strndup(words[i].word + len + 1, words[i].len - len - 1);
+			emit(c, OP_ASSIGN, var_slot(words[i].word, len), compile_template(c, value, 0));
+			free(value);
+		}
+		buffer_append(&names, " ", 1);
+		buffer_append(&names, words[i].word, len);
+	}
+	if (export)
+		emit(c, OP_RUN, compile_template(c, names.data, 1), 0);
+	free(names.data);
+	c->at += strlen(c->at);
+	return 1;
+}
+
+static void compile_command(struct compiler *c)
+{
+	static const char *reserved[] = { "then", "elif", "else", "fi", "do", "done", "}", NULL };
+	char w[64];
+	int n = seg_word(c, w, sizeof(w));
+
+	if (strcmp(w, "if") == 0)
+		compile_if(c);
+	else if (strcmp(w, "while") == 0 || strcmp(w, "until") == 0)
+		compile_while(c, w[0] == 'u');
+	else if (strcmp(w, "for") == 0)
+		compile_for(c);
+	else if (strcmp(w, "function") == 0)
+		compile_function(c, 1);
+	else if (strcmp(w, "!") == 0) {
+		seg_take(c, 1);
+		if (!seg_next(c) || !*c->at) {
+			compile_error(c, "syntax error near `%s'", "!");
+			return;
+		}
+		compile_command(c);
+		emit(c, OP_NOT, 0, 0);
+	}
+	else if (strcmp(w, "break") == 0 || strcmp(w, "continue") == 0) {
+		if (c->nloops == 0) {
+			compile_error(c, "%s: only meaningful in a loop", w);
+			return;
+		}
+		struct loop_ctx *l = &c->loops[c->nloops - 1];
+		if (w[0] == 'c')
+			emit(c, OP_JUMP, l->cont, 0);
+		else {
+			l->breaks = realloc(l->breaks, sizeof(int) * (l->nbreaks + 1));
+			l->breaks[l->nbreaks++] = emit(c, OP_JUMP, -1, 0);
+		}
+		seg_take(c, n);
+		seg_end(c);
+	}
+	else if (strcmp(w, "return") == 0) {
+		seg_take(c, n);
+		emit(c, OP_RETURN, *c->at ? atoi(c->at) & 0xff : -1, 0);
+		c->at += strlen(c->at);
+	}
+	else {
+		for (int i = 0; reserved[i]; i++)
+			if (strcmp(w, reserved[i]) == 0) {
+				compile_error(c, "syntax error near unexpected `%s'", w);
+				return;
+			}
+		//name() { and name () {
+		const char *paren = c->at + strcspn(c->at, " \t(");
+		if (paren > c->at && strncmp(paren + strspn(paren, " \t"), "()", 2) == 0) {
+			compile_function(c, 0);
+			return;
+		}
+		if (compile_assignments(c))
+			return;
+		emit(c, OP_RUN, compile_template(c, c->at, 1), 0);
+		c->at += strlen(c->at);
+	}
+}
+
+/**
+ * Commands joined by && and ||. A failed && skips the next command and
+ * a successful || too, the status carries on to the operator after it.
+ */
+static void compile_andor(struct compiler *c)
+{
+	compile_command(c);
+	while (!c->error && (c->term == '&' || c->term == '|')) {
+		int op = c->term;
+		c->term = ';';
+		int j = emit(c, op == '&' ? OP_JUMPFALSE : OP_JUMPTRUE, -1, 0);
+		if (!seg_next(c)) {
+			c->incomplete = !c->error;
+			compile_error(c, "unexpected end of file after %s", op == '&' ? "&&" : "||");
+			return;
+		}
+		compile_command(c);
+		c->prog->code[j].a = c->prog->ncode;
+	}
+}
+
+static void program_free(struct program *prog)
+{
+	for (int i = 0; i < prog->ntemplates; i++) {
+		struct template *t = &prog->templates[i];
+		for (int k = 0; k < t->npieces; k++)
+			if (t->pieces[k].sub && !t->pieces[k].sub->keep)
+				program_free(t->pieces[k].sub);
+		free(t->text);
+		free(t->pieces);
+	}
+	for (int i = 0; i < prog->nnames; i++)
+		free(prog->names[i]);
+	free(prog->templates);
+	free(prog->names);
+	free(prog->code);
+	free(prog);
+}
+
+/**
+ * Compile a script
+ * @param  src
+ * @param  file       name for errors, NULL at the prompt
+ * @param  incomplete set when src ends inside a compound command, errors
+ *                    aren't printed then; NULL to always print them
+ * @return            the program, NULL on a syntax error
+ */
+struct program *script_compile(const char *src, const char *file, int *incomplete)
+{
+	struct compiler c;
+	memset(&c, 0, sizeof(c));
+	c.p = src;
+	c.line = 1;
+	c.file = file;
+	c.quiet = incomplete != NULL;
+	c.prog = calloc(1, sizeof(struct program));
+	uint64_t t0 = TRACE_BEGIN();
+	compile_list(&c, NULL);
+	TRACE_END("script_compile", t0, file);
+	free(c.seg);
+	for (int i = 0; i < c.nloops; i++)
+		free(c.loops[i].breaks);
+	if (incomplete)
+		*incomplete = c.incomplete;
+	if (c.error) {
+		program_free(c.prog);
+		return NULL;
+	}
+	return c.prog;
+}
+
+//VM
+
+struct vm_frame {
+	struct program *prog; // to return to
+	int pc;
+	char **argv;          // $0 to $n, NULL terminated
+	int argc;
+	int nfors;            // for loops open when the function was called
+};
+
+struct for_words {
+	char **words;
+	int n, i;
+};
+
+#define VM_DEPTH 256
+
+struct vm {
+	struct vm_frame frames[VM_DEPTH];
+	int nframes;
+	struct for_words fors[VM_DEPTH];
+	int nfors;
+	history *h;
+	shortdir *shortdirs;
+};
+
+static int vm_run(struct vm *vm, struct program *prog, char **argv, int argc);
+
+/**
+ * Run the command of a $(...) and append its output, the trailing
+ * newlines stripped and the others turned into spaces so the parser
+ * splits it into words. Built-ins write into memory, pipelines into a
+ * pipe the event loop drains; nothing goes through a file.
+ */
+static void subst_capture(struct vm *vm, struct program *prog, struct buffer *out)
+{
+	struct vm_frame *f = &vm->frames[vm->nframes - 1];
+	struct capture cap;
+	memset(&cap, 0, sizeof(cap));
+	cap.outonly = 1;
+	struct capture *outer = active_capture;
+	active_capture = &cap;
+	struct vm *sub = malloc(sizeof(struct vm));
+	sub->h = vm->h;
+	sub->shortdirs = vm->shortdirs;
+	uint64_t t0 = TRACE_BEGIN();
+	vm_run(sub, prog, f->argv, f->argc); // exit only leaves the substitution
+	TRACE_END("substitution", t0, NULL);
+	free(sub);
+	active_capture = outer;
+
+	size_t len = cap.out.len;
+	while (len > 0 && cap.out.data[len - 1] == '\n')
+		len--;
+	for (size_t i = 0; i < len; i++)
+		if (cap.out.data[i] == '\n')
+			cap.out.data[i] = ' ';
+	buffer_append(out, cap.out.data ? cap.out.data : "", len);
+	free(cap.out.data);
+	free(cap.err.data);
+}
+
+/**
+ * Expand a template into one string, for an assignment's value: nothing
+ * is split and there are no patterns
+ */
+static void template_expand(struct vm *vm, struct template *t, struct buffer *out)
+{
+	struct vm_frame *f = &vm->frames[vm->nframes - 1];
+	char num[16];
+	for (int i = 0; i < t->npieces; i++) {
+		struct piece *p = &t->pieces[i];
+		const char *v = NULL;
+		switch (p->kind) {
+			case PIECE_TEXT:
+				buffer_append(out, p->text, p->n);
+				break;
+			case PIECE_VAR:
+				v = var_get(p->n);
+				break;
+			case PIECE_STATUS:
+				snprintf(num, sizeof(num), "%d", last_status);
+				v = num;
+				break;
+			case PIECE_ARG:
+				v = p->n < f->argc ? f->argv[p->n] : NULL;
+				break;
+			case PIECE_NARGS:
+				snprintf(num, sizeof(num), "%d", f->argc - 1);
+				v = num;
+				break;
+			case PIECE_ARGS:
+				for (int a = 1; a < f->argc; a++) {
+					if (a > 1)
+						buffer_append(out, " ", 1);
+					buffer_append(out, f->argv[a], strlen(f->argv[a]));
+				}
+				break;
+			case PIECE_SUBST:
+				if (p->sub)
+					subst_capture(vm, p->sub, out);
+				break;
+			case PIECE_BREAK:
+				buffer_append(out, " ", 1);
+				break;
+		}
+		if (v)
+			buffer_append(out, v, strlen(v));
+	}
+	if (out->data == NULL)
+		buffer_append(out, "", 0);
+}
+
+//a command being built from the words of a template
+struct word_builder {
+	struct command_t *first, *stage;
+	struct buffer word;
+	int started;    // the word has begun, maybe empty as with ""
+	int glob;       // it has an unquoted *, ? or [
+	int redirect;   // it names the file of redirection 0 to 2, or -1
+};
+
+static struct command_t *word_stage()
+{
+	struct command_t *c = malloc(sizeof(struct command_t));
+	memset(c, 0, sizeof(struct command_t));
+	c->args = malloc(sizeof(char *));
+	return c;
+}
+
+static void word_end(struct word_builder *w)
+{
+	if (!w->started)
+		return;
+	struct command_t *c = w->stage;
+	char *word = strndup(w->word.data ? w->word.data : "", w->word.len);
+	if (w->redirect != -1) {
+		free(c->redirects[w->redirect]);
+		c->redirects[w->redirect] = word;
+		w->redirect = -1;
+	}
+	else if (c->name == NULL)
+		c->name = word;
+	else {
+		c->args = realloc(c->args, sizeof(char *) * (c->arg_count + 1));
+		c->globs = realloc(c->globs, sizeof(bool) * (c->arg_count + 1));
+		// pathname expansion happens when the command runs, see expand_patterns
+		c->globs[c->arg_count] = w->glob;
+		c->args[c->arg_count++] = word;
+	}
+	w->word.len = 0;
+	w->started = w->glob = 0;
+}
+
+/**
+ * Add text to the current word. Unquoted, whitespace in it ends words
+ * and nothing else in it is special but pattern characters.
+ */
+static void word_add(struct word_builder *w, const char *v, size_t len, bool quoted)
+{
+	if (quoted) {
+		buffer_append(&w->word, v, len);
+		w->started = 1;
+		return;
+	}
+	for (size_t i = 0; i < len;) {
+		size_t n = 0;
+		while (i + n < len && v[i + n] != ' ' && v[i + n] != '\t' && v[i + n] != '\n')
+			n++;
+		if (n == 0) {
+			word_end(w);
+			i++;
+			continue;
+		}
+		buffer_append(&w->word, v + i, n);
+		for (size_t k = i; k < i + n; k++)
+			w->glob |= v[k] == '*' || v[k] == '?' || v[k] == '[';
+		w->started = 1;
+		i += n;
+	}
+}
+
+/**
+ * Build the command of a template: expand each word, split unquoted
+ * expansions at whitespace and keep the operators the template was
+ * compiled with. A value like "a > b" or "x | y" stays words.
+ */
+static struct command_t *template_command(struct vm *vm, struct template *t)
+{
+	struct vm_frame *f = &vm->frames[vm->nframes - 1];
+	struct word_builder w = { NULL, NULL, {0}, 0, 0, -1 };
+	w.first = w.stage = word_stage();
+	char num[16];
+	for (int i = 0; i < t->npieces; i++) {
+		struct piece *p = &t->pieces[i];
+		const char *v = NULL;
+		switch (p->kind) {
+			case PIECE_TEXT:
+				word_add(&w, p->text, p->n, p->quoted);
+				break;
+			case PIECE_VAR:
+				v = var_get(p->n);
+				break;
+			case PIECE_STATUS:
+				snprintf(num, sizeof(num), "%d", last_status);
+				v = num;
+				break;
+			case PIECE_ARG:
+				v = p->n < f->argc ? f->argv[p->n] : NULL;
+				break;
+			case PIECE_NARGS:
+				snprintf(num, sizeof(num), "%d", f->argc - 1);
+				v = num;
+				break;
+			case PIECE_ARGS:
+				//"$@" is one word per argument, as the arguments were
+				for (int a = 1; a < f->argc; a++) {
+					if (a > 1 && p->quoted)
+						word_end(&w);
+					else if (a > 1)
+						word_add(&w, " ", 1, false);
+					word_add(&w, f->argv[a], strlen(f->argv[a]), p->quoted);
+				}
+				break;
+			case PIECE_SUBST:
+				if (p->sub) {
+					struct buffer out = {0};
+					subst_capture(vm, p->sub, &out);
+					word_add(&w, out.data ? out.data : "", out.len, p->quoted);
+					free(out.data);
+				}
+				break;
+			case PIECE_BREAK:
+				word_end(&w);
+				break;
+			case PIECE_OP:
+				word_end(&w);
+				if (p->n == '|') {
+					if (w.stage->name == NULL)
+						w.stage->name = strdup("");
+					w.stage->next = word_stage();
+					w.stage = w.stage->next;
+				}
+				else if (p->n == '&')
+					w.first->background = true;
+				else
+					w.redirect = p->n == '<' ? 0 : p->n == '>' ? 1 : 2;
+				break;
+		}
+		if (v)
+			word_add(&w, v, strlen(v), p->quoted);
+	}
+	word_end(&w);
+	if (w.stage->name == NULL)
+		w.stage->name = strdup("");
+	free(w.word.data);
+	return w.first;
+}
+
+static char **argv_copy(char **argv, int argc)
+{
+	char **copy = malloc(sizeof(char *) * (argc + 1));
+	for (int i = 0; i < argc; i++)
+		copy[i] = strdup(argv[i]);
+	copy[argc] = NULL;
+	return copy;
+}
+
+static void argv_free(char **argv, int argc)
+{
+	for (int i = 0; i < argc; i++)
+		free(argv[i]);
+	free(argv);
+}
+
+static void vm_pop_fors(struct vm *vm, int n)
+{
+	while (vm->nfors > n) {
+		struct for_words *fw = &vm->fors[--vm->nfors];
+		argv_free(fw->words, fw->n);
+	}
+}
+
+/**
+ * Run a program to its end, a top level return or exit
+ * @param  argv $0 and the arguments
+ * @return      EXIT when the shell has to exit, SUCCESS otherwise
+ */
+static int vm_run(struct vm *vm, struct program *prog, char **argv, int argc)
+{
+	int pc = 0, code = SUCCESS;
+	struct vm_frame *top = &vm->frames[0];
+	memset(top, 0, sizeof(struct vm_frame));
+	top->argv = argv_copy(argv, argc);
+	top->argc = argc;
+	vm->nframes = 1;
+	vm->nfors = 0;
+
+	while (code == SUCCESS) {
+		if (pc >= prog->ncode)
+			break;
+		struct insn *in = &prog->code[pc++];
+		switch (in->op) {
+			case OP_RUN: {
+				struct command_t *command = template_command(vm, &prog->templates[in->a]);
+
+				struct shell_func *fn = find_function(command->name);
+				if (fn && (command->next || command->redirects[0] || command->redirects[1] || command->redirects[2])) {
+					printf("E: %s is a function and can't be piped or redirected\n", command->name);
+					last_status = 1;
+				}
+				else if (fn) {
+					if (vm->nframes == VM_DEPTH) {
+						printf("E: %s: functions nested too deep\n", command->name);
+						last_status = 1;
+						free_command(command);
+						break;
+					}
+					expand_patterns(command);
+					struct vm_frame *f = &vm->frames[vm->nframes++];
+					f->prog = prog;
+					f->pc = pc;
+					f->nfors = vm->nfors;
+					f->argc = command->arg_count + 1;
+					f->argv = malloc(sizeof(char *) * (f->argc + 1));
+					f->argv[0] = strdup(command->name);
+					for (int i = 0; i < command->arg_count; i++)
+						f->argv[i + 1] = strdup(command->args[i]);
+					f->argv[f->argc] = NULL;
+					prog = fn->prog;
+					pc = fn->addr;
+				}
+				else if (process_command(command, vm->h, vm->shortdirs) == EXIT)
+					code = EXIT;
+				free_command(command);
+				break;
+			}
+			case OP_ASSIGN: {
+				struct buffer value = {0};
+				last_status = 0; // unless a $(...) in the value sets it
+				template_expand(vm, &prog->templates[in->b], &value);
+				var_set(in->a, value.data);
+				free(value.data);
+				break;
+			}
+			case OP_NOT:
+				last_status = !last_status;
+				break;
+			case OP_STATUS:
+				last_status = in->a;
+				break;
+			case OP_JUMP:
+				pc = in->a;
+				break;
+			case OP_JUMPFALSE:
+				if (last_status != 0)
+					pc = in->a;
+				break;
+			case OP_JUMPTRUE:
+				if (last_status == 0)
+					pc = in->a;
+				break;
+			case OP_FORINIT: {
+				struct for_words *fw = &vm->fors[vm->nfors];
+				if (vm->nfors == VM_DEPTH) {
+					printf("E: for loops nested too deep\n");
+					code = UNKNOWN;
+					break;
+				}
+				vm->nfors++;
+				fw->i = 0;
+				if (in->a == -1) {
+					struct vm_frame *f = &vm->frames[vm->nframes - 1];
+					fw->n = f->argc - 1;
+					fw->words = argv_copy(f->argv + 1, fw->n);
+					break;
+				}
+				//the words are the arguments of "in ...", so quotes and
+				//patterns work as they do on a command line
+				struct command_t *command = template_command(vm, &prog->templates[in->a]);
+				expand_patterns(command);
+				fw->n = command->arg_count;
+				fw->words = argv_copy(command->args, command->arg_count);
+				free_command(command);
+				break;
+			}
+			case OP_FORNEXT: {
+				struct for_words *fw = &vm->fors[vm->nfors - 1];
+				if (fw->i < fw->n)
+					var_set(in->a, fw->words[fw->i++]);
+				else
+					pc = in->b;
+				break;
+			}
+			case OP_FOREND:
+				vm_pop_fors(vm, vm->nfors - 1);
+				break;
+			case OP_DEFINE: {
+				struct shell_func *fn = find_function(prog->names[in->a]);
+				if (fn == NULL) {
+					functions = realloc(functions, sizeof(struct shell_func) * (nfunctions + 1));
+					fn = &functions[nfunctions++];
+					fn->name = strdup(prog->names[in->a]);
+				}
+				fn->prog = prog;
+				fn->addr = in->b;
+				last_status = 0;
+				break;
+			}
+			case OP_RETURN: {
+				if (in->a != -1)
+					last_status = in->a;
+				if (vm->nframes == 1) {
+					pc = prog->ncode; // return ends a sourced script
+					break;
+				}
+				struct vm_frame *f = &vm->frames[--vm->nframes];
+				vm_pop_fors(vm, f->nfors);
+				argv_free(f->argv, f->argc);
+				prog = f->prog;
+				pc = f->pc;
+				break;
+			}
+		}
+	}
+
+	//exit can leave from inside functions and loops
+	vm_pop_fors(vm, 0);
+	while (vm->nframes > 0) {
+		struct vm_frame *f = &vm->frames[--vm->nframes];
+		argv_free(f->argv, f->argc);
+	}
+	return code;
+}
+
+/**
+ * Compile and run a script
+ * @return EXIT when the script ran exit, SUCCESS otherwise
+ */
+static int script_run(const char *src, const char *file, char **argv, int argc, history *h, shortdir *shortdirs)
+{
+	struct program *prog = script_compile(src, file, NULL);
+	if (prog == NULL) {
+		last_status = 2;
+		return SUCCESS;
+	}
+	struct vm *vm = malloc(sizeof(struct vm));
+	vm->h = h;
+	vm->shortdirs = shortdirs;
+	uint64_t t0 = TRACE_BEGIN();
+	int code = vm_run(vm, prog, argv, argc);
+	TRACE_END("script_run", t0, file);
+	free(vm);
+	//functions point into the program that defined them
+	if (!prog->keep)
+		program_free(prog);
+	return code;
+}
+
+/**
+ * Whether a line typed at the prompt needs the compiler: it starts with
+ * a keyword, an assignment or export, defines or calls a function, has
+ * ; && || $ or ` outside single quotes, or has quotes or a backslash to
+ * take out
+ */
+int script_needed(const char *line)
+{
+	static const char *keywords[] = { "if", "while", "until", "for", "function", "!", NULL };
+	const char *p = line + strspn(line, " \t");
+	int n = strcspn(p, " \t(");
+	for (int i = 0; keywords[i]; i++)
+		if ((int)strlen(keywords[i]) == n && strncmp(p, keywords[i], n) == 0)
+			return 1;
+	if (var_assignment(p) || (n == 6 && strncmp(p, "export", 6) == 0))
+		return 1; // assignments are compiled, see compile_assignments
+	if (n > 0 && strncmp(p + n + strspn(p + n, " \t"), "()", 2) == 0)
+		return 1;
+	char name[256];
+	if (n < (int)sizeof(name) && nfunctions) {
+		memcpy(name, p, n);
+		name[n] = 0;
+		if (find_function(name))
+			return 1;
+	}
+	for (; *p; p++)
+		if (strchr("'\"\\;$`", *p) || (*p == '&' && p[1] == '&') || (*p == '|' && p[1] == '|'))
+			return 1;
+	return 0;
+}
+
+/**
+ * Whether the lines typed so far end inside a compound command
+ */
+int script_incomplete(const char *src)
+{
+	int incomplete;
+	struct program *prog = script_compile(src, NULL, &incomplete);
+	if (prog)
+		program_free(prog);
+	return incomplete;
+}
+
+/**
+ * Run a line from the prompt that script_needed picked
+ */
+int script_line(const char *line, history *h, shortdir *shortdirs)
+{
+	char *argv[] = { (char *)sysname };
+	return script_run(line, NULL, argv, 1, h, shortdirs);
+}
+
+static char *script_read(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		printf("-%s: %s: %s\n", sysname, path, strerror(errno));
+		return NULL;
+	}
+	struct buffer b = {0};
+	ssize_t n;
+	while ((n = buffer_read_fd(&b, fd)) > 0)
+		;
+	close(fd);
+	if (n == -1) {
+		printf("-%s: %s: %s\n", sysname, path, strerror(errno));
+		free(b.data);
+		return NULL;
+	}
+	if (b.data == NULL)
+		buffer_append(&b, "", 0);
+	return b.data;
+}
+
+/**
+ * source file [args], run a script in the shell itself
+ * @param  command with the file and arguments in args
+ * @return         EXIT when the script ran exit
+ */
+int source_command(struct command_t *command, history *h, shortdir *shortdirs)
+{
+	if (command->arg_count == 0) {
+		printf("E: usage: source file [args...]\n");
+		last_status = 2;
+		return UNKNOWN;
+	}
+	char *src = script_read(command->args[0]);
+	if (src == NULL) {
+		last_status = 1;
+		return UNKNOWN;
+	}
+	int code = script_run(src, command->args[0], command->args, command->arg_count, h, shortdirs);
+	free(src);
+	return code;
+}
+
+/**
+ * Run ./seashell file [args]
+ * @return the exit status of the script
+ */
+int script_file(const char *path, char **argv, int argc, history *h, shortdir *shortdirs)
+{
+	char *src = script_read(path);
+	if (src == NULL)
+		return 127;
+	//a first line of #! is a comment anyway
+	script_run(src, path, argv, argc, h, shortdirs);
+	free(src);
+	fflush(stdout);
+	return last_status;
+}
+
+//WATCH
+//watch [-p path]... [-d ms] [-c] command... runs the command, then again
+//whenever one of the paths changes. Changes come from inotify through the
+//event loop and a burst of them is coalesced until the paths have been
+//quiet for the debounce window, so the shell sleeps in epoll_wait between
+//runs. A change during a run queues one more run, or with -c cancels the
+//run and starts over. A file is watched together with its directory so a
+//log that is rotated, renamed away and created again, stays watched.
+//Directories are watched without their subdirectories.
+
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+	| IN_MOVED_TO | IN_MOVE_SELF | IN_DELETE_SELF)
+#define WATCH_DIR_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+struct watch_path {
+	char *path;
+	int wd;          // on the path itself, -1 while it doesn't exist
+	int dirwd;       // on the directory of a file, -1 for directories
+	const char *base; // the file's name in that directory
+};
+
+struct watch {
+	struct watch_path *paths;
+	int npaths;
+	int ifd, tfd;    // inotify and the debounce timerfd
+	int debounce;    // milliseconds
+	int cancel;      // -c: a change stops the running command
+	pid_t running;   // process group of the run, 0 when idle
+	int pending;     // run again once the current run ends
+	char changed[256]; // first path that changed since the last run
+	struct command_t *command;
+	history *h;
+	shortdir *shortdirs;
+};
+
+static void watch_add(struct watch *w, struct watch_path *p)
+{
+	p->wd = inotify_add_watch(w->ifd, p->path, WATCH_MASK);
+	struct stat st;
+	if (p->dirwd != -1 || (p->wd != -1 && fstatat(AT_FDCWD, p->path, &st, 0) == 0 && S_ISDIR(st.st_mode)))
+		return;
+	//a file: also watch its directory for it being created or moved back
+	char dir[4096];
+	const char *slash = strrchr(p->path, '/');
+	if (slash)
+		snprintf(dir, sizeof(dir), "%.*s", slash == p->path ? 1 : (int)(slash - p->path), p->path);
+	else
+		snprintf(dir, sizeof(dir), ".");
+	p->base = slash ? slash + 1 : p->path;
+	p->dirwd = inotify_add_watch(w->ifd, dir, WATCH_DIR_MASK);
+}
+
+static void watch_exited(pid_t pid, int status, struct rusage *ru, void *arg);
+
+static void watch_run(struct watch *w)
+{
+	w->changed[0] = 0;
+	w->pending = 0;
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) {
+		printf("-%s: fork: %s\n", sysname, strerror(errno));
+		return;
+	}
+	if (pid == 0) {
+		//a subshell in a group of its own, so a cancel reaches the whole pipeline
+		setpgid(0, 0);
+		close(w->ifd);
+		close(w->tfd);
+		loop_reset();
+		process_command(w->command, w->h, w->shortdirs);
+		fflush(stdout);
+		_exit(last_status);
+	}
+	setpgid(pid, pid);
+	loop_watch_child(pid, watch_exited, w);
+	w->running = pid;
+}
+
+static void watch_exited(pid_t pid, int status, struct rusage *ru, void *arg)
+{
+	struct watch *w = arg;
+	w->running = 0;
+	last_status = status_code(status);
+	if (w->pending) {
+		printf("--- %s changed\n", w->changed);
+		watch_run(w);
+	}
+}
+
+/**
+ * The paths have been quiet for the debounce window
+ */
+static void watch_fire(int fd, uint32_t events, void *arg)
+{
+	struct watch *w = arg;
+	uint64_t expirations;
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+	//paths that were deleted or renamed away are watched again if back
+	for (int i = 0; i < w->npaths; i++)
+		if (w->paths[i].wd == -1)
+			watch_add(w, &w->paths[i]);
+	w->pending = 1;
+	if (w->running && w->cancel)
+		kill(-w->running, SIGTERM); // watch_exited starts the next run
+	else if (!w->running) {
+		printf("--- %s changed\n", w->changed);
+		watch_run(w);
+	}
+}
+
+static void watch_event(int fd, uint32_t events, void *arg)
+{
+	struct watch *w = arg;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+	int relevant = 0;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+			struct inotify_event *e = (struct inotify_event *)p;
+			for (int i = 0; i < w->npaths; i++) {
+				struct watch_path *wp = &w->paths[i];
+				if (e->wd == wp->dirwd && e->len && strcmp(e->name, wp->base) != 0)
+					continue; // another file in the directory
+				if (e->wd != wp->wd && e->wd != wp->dirwd)
+					continue;
+				if (e->wd == wp->wd && (e->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED))) {
+					if (!(e->mask & IN_IGNORED))
+						inotify_rm_watch(fd, wp->wd);
+					wp->wd = -1;
+				}
+				if (e->mask & IN_IGNORED)
+					continue;
+				if (w->changed[0] == 0)
+					snprintf(w->changed, sizeof(w->changed), "%s%s%s", wp->path,
+						e->len && e->wd == wp->wd ? "/" : "", e->len && e->wd == wp->wd ? e->name : "");
+				relevant = 1;
+			}
+		}
+	}
+	if (!relevant)
+		return;
+	//every change pushes the run back until the burst is over
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = w->debounce / 1000;
+	its.it_value.tv_nsec = (w->debounce % 1000) * 1000000L + 1; // 0 would disarm it
+	timerfd_settime(w->tfd, 0, &its, NULL);
+}
+
+/**
+ * watch prefix
+ *   watch [-p path]... [-d ms] [-c] command...
+ * -p adds a path to watch, the current directory without any. -d sets
+ * the debounce window, 100ms by default. -c cancels a run still going
+ * when the paths change instead of running again after it. Ctrl+C
+ * stops watching.
+ * @param  command the watch command, rewritten in place to the watched one
+ * @return         SUCCESS, the last run's status goes to last_status
+ */
+int watch_command(struct command_t *command, history *h, shortdir *shortdirs)
+{
+	struct watch w;
+	memset(&w, 0, sizeof(w));
+	w.debounce = 100;
+	int k = 0;
+	while (k < command->arg_count && command->args[k][0] == '-') {
+		const char *opt = command->args[k];
+		if (strcmp(opt, "-c") == 0)
+			w.cancel = 1;
+		else if ((strcmp(opt, "-p") == 0 || strcmp(opt, "-d") == 0) && k + 1 < command->arg_count) {
+			const char *val = command->args[++k];
+			if (opt[1] == 'd')
+				w.debounce = atoi(val);
+			else {
+				w.paths = realloc(w.paths, sizeof(struct watch_path) * (w.npaths + 1));
+				w.paths[w.npaths++] = (struct watch_path){ strdup(val), -1, -1, NULL };
+			}
+		}
+		else
+			break;
+		k++;
+	}
+	if (k >= command->arg_count || w.debounce < 0) {
+		printf("E: usage: watch [-p path]... [-d ms] [-c] command...\n");
+		last_status = 2;
+		goto done;
+	}
+	if (w.npaths == 0) {
+		w.paths = malloc(sizeof(struct watch_path));
+		w.paths[w.npaths++] = (struct watch_path){ strdup("."), -1, -1, NULL };
+	}
+
+	w.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	w.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (w.ifd == -1 || w.tfd == -1) {
+		printf("-%s: watch: %s\n", sysname, strerror(errno));
+		last_status = 1;
+		goto done;
+	}
+	for (int i = 0; i < w.npaths; i++) {
+		watch_add(&w, &w.paths[i]);
+		if (w.paths[i].wd == -1 && w.paths[i].dirwd == -1) {
+			printf("-%s: %s: %s\n", sysname, w.paths[i].path, strerror(errno));
+			last_status = 1;
+			goto done;
+		}
+	}
+
+	//the first argument after the options becomes the command
+	free(command->name);
+	command->name = command->args[k];
+	for (int i = 0; i < k; i++)
+		free(command->args[i]);
+	for (int i = k + 1; i < command->arg_count; i++)
+		command->args[i - k - 1] = command->args[i];
+	command->arg_count -= k + 1;
+	w.command = command;
+	w.h = h;
+	w.shortdirs = shortdirs;
+
+	loop_add(w.ifd, watch_event, &w);
+	loop_add(w.tfd, watch_fire, &w);
+	int interrupts = loop_interrupts;
+	watch_run(&w);
+	while (loop_interrupts == interrupts)
+		loop_wait(-1);
+	//Ctrl+C: the run isn't in the terminal's group, pass it on and wait
+	printf("\n");
+	if (w.running) {
+		kill(-w.running, SIGINT);
+		w.pending = 0;
+		while (w.running)
+			loop_wait(-1);
+	}
+	loop_del(w.ifd);
+	loop_del(w.tfd);
+
+done:
+	if (w.ifd > 0)
+		close(w.ifd);
+	if (w.tfd > 0)
+		close(w.tfd);
+	for (int i = 0; i < w.npaths; i++)
+		free(w.paths[i].path);
+	free(w.paths);
+	return SUCCESS;
+}
+
+//SESSION STATS
+//Every command that runs adds its wall time, the time the shell took to
+//fork or start its thread and its exit code to histograms kept per
+//command name. The histograms are log-linear like HDR histograms: 16
+//linear buckets per power of two, so any value is within 6% of its
+//bucket, from nanoseconds up to days in 720 counters. All of it is one
+//static table, recording hashes the name and bumps three counters.
+//"stats" prints them, SEASHELL_STATS=file appends them on exit.
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((48 - HIST_SUB_BITS) * HIST_SUB + HIST_SUB) // up to 2^48ns, 78 hours
+#define STATS_COMMANDS 64 // the last one collects names that don't fit
+
+struct histogram {
+	uint32_t counts[HIST_BUCKETS];
+	uint64_t total, max;
+};
+
+struct command_stats {
+	char name[32];
+	struct histogram wall, spawn;
+	uint32_t exits[256];
+};
+
+static struct command_stats stats_table[STATS_COMMANDS];
+
+uint64_t elapsed_ns(struct timespec since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - since.tv_sec) * 1000000000ULL + now.tv_nsec - since.tv_nsec;
+}
+
+static int hist_index(uint64_t v)
+{
+	if (v < 2 * HIST_SUB)
+		return v;
+	int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	int i = (shift + 1) * HIST_SUB + (int)(v >> shift) - HIST_SUB;
+	return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+//lowest value of a bucket, and the width of the bucket
+static uint64_t hist_lower(int i, uint64_t *width)
+{
+	if (i < 2 * HIST_SUB) {
+		*width = 1;
+		return i;
+	}
+	int shift = i / HIST_SUB - 1;
+	*width = 1ULL << shift;
+	return (uint64_t)(i % HIST_SUB + HIST_SUB) << shift;
+}
+
+static void hist_add(struct histogram *hist, uint64_t v)
+{
+	hist->counts[hist_index(v)]++;
+	hist->total++;
+	if (v > hist->max)
+		hist->max = v;
+}
+
+/**
+ * Value at a percentile, the highest value of its bucket
+ * @param  p between 0 and 100
+ */
+static uint64_t hist_percentile(struct histogram *hist, double p)
+{
+	uint64_t want = (uint64_t)(hist->total * p / 100.0 + 0.5), seen = 0, width;
+	if (want == 0)
+		want = 1;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= want) {
+			uint64_t v = hist_lower(i, &width) + width - 1;
+			return v < hist->max ? v : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+static struct command_stats *stats_find(const char *name)
+{
+	uint64_t hash = xxh64(name, strnlen(name, sizeof(stats_table[0].name) - 1), 0);
+	for (int k = 0; k < STATS_COMMANDS - 1; k++) {
+		struct command_stats *cs = &stats_table[(hash + k) % (STATS_COMMANDS - 1)];
+		if (cs->name[0] == 0)
+			snprintf(cs->name, sizeof(cs->name), "%s", name);
+		if (strncmp(cs->name, name, sizeof(cs->name) - 1) == 0)
+			return cs;
+	}
+	struct command_stats *other = &stats_table[STATS_COMMANDS - 1];
+	snprintf(other->name, sizeof(other->name), "(other)");
+	return other;
+}
+
+/**
+ * Add a run of a command to its histograms
+ * @param  spawn ns the shell took to start it, 0 for a built-in in the shell
+ * @param  code  exit code
+ */
+void stats_record(const char *name, struct timespec start, struct timespec end, uint64_t spawn, int code)
+{
+	struct command_stats *cs = stats_find(name);
+	hist_add(&cs->wall, (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec);
+	if (spawn)
+		hist_add(&cs->spawn, spawn);
+	cs->exits[code & 0xff]++;
+}
+
+void stats_stages(struct stage_usage *stages, int n)
+{
+	for (int i = 0; i < n; i++)
+		if (stages[i].pid != -1 && stages[i].done)
+			stats_record(stages[i].name, stages[i].start, stages[i].end, stages[i].spawn,
+				status_code(stages[i].status));
+}
+
+static void stats_duration(char *buf, size_t size, uint64_t ns)
+{
+	if (ns < 1000)
+		snprintf(buf, size, "%lluns", (unsigned long long)ns);
+	else if (ns < 1000000)
+		snprintf(buf, size, "%.1fus", ns / 1e3);
+	else if (ns < 1000000000)
+		snprintf(buf, size, "%.1fms", ns / 1e6);
+	else
+		snprintf(buf, size, "%.2fs", ns / 1e9);
+}
+
+static void stats_print_hist(FILE *out, struct histogram *hist)
+{
+	char p50[16] = "-", p99[16] = "-", max[16] = "-";
+	if (hist->total) {
+		stats_duration(p50, sizeof(p50), hist_percentile(hist, 50));
+		stats_duration(p99, sizeof(p99), hist_percentile(hist, 99));
+		stats_duration(max, sizeof(max), hist->max);
+	}
+	fprintf(out, " %8s %8s %8s", p50, p99, max);
+}
+
+static int stats_cmp(const void *a, const void *b)
+{
+	const struct command_stats *x = *(struct command_stats * const *)a, *y = *(struct command_stats * const *)b;
+	return x->wall.total != y->wall.total ? (x->wall.total < y->wall.total ? 1 : -1) : strcmp(x->name, y->name);
+}
+
+/**
+ * stats built-in, the latency histograms of this session
+ *   stats      p50, p99 and max of wall and spawn time, and exit codes
+ *   stats -c   clear them
+ */
+int stats_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	if (command->args[1] && strcmp(command->args[1], "-c") == 0) {
+		memset(stats_table, 0, sizeof(stats_table));
+		return SUCCESS;
+	}
+	if (command->args[1]) {
+		fprintf(ctx->err, "E: usage: stats [-c]\n");
+		return UNKNOWN;
+	}
+	struct command_stats *used[STATS_COMMANDS];
+	int n = 0;
+	for (int i = 0; i < STATS_COMMANDS; i++)
+		if (stats_table[i].wall.total)
+			used[n++] = &stats_table[i];
+	qsort(used, n, sizeof(used[0]), stats_cmp);
+
+	fprintf(ctx->out, "%-16s %6s %8s %8s %8s %8s %8s %8s  %s\n", "command", "runs",
+		"p50", "p99", "max", "spawn50", "spawn99", "spawnmax", "exit codes");
+	for (int i = 0; i < n; i++) {
+		struct command_stats *cs = used[i];
+		fprintf(ctx->out, "%-16s %6llu", cs->name, (unsigned long long)cs->wall.total);
+		stats_print_hist(ctx->out, &cs->wall);
+		stats_print_hist(ctx->out, &cs->spawn);
+		fprintf(ctx->out, " ");
+		for (int code = 0; code < 256; code++)
+			if (cs->exits[code])
+				fprintf(ctx->out, " %d:%u", code, cs->exits[code]);
+		fprintf(ctx->out, "\n");
+	}
+	return SUCCESS;
+}
+
+static void stats_json_hist(FILE *f, const char *key, struct histogram *hist)
+{
+	uint64_t width;
+	fprintf(f, ",\"%s\":{\"count\":%llu,\"max\":%llu,\"buckets\":[", key,
+		(unsigned long long)hist->total, (unsigned long long)hist->max);
+	int first = 1;
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		if (hist->counts[i]) {
+			fprintf(f, "%s[%llu,%u]", first ? "" : ",", (unsigned long long)hist_lower(i, &width), hist->counts[i]);
+			first = 0;
+		}
+	fprintf(f, "]}");
+}
+
+/**
+ * Append the session's histograms to $SEASHELL_STATS, one JSON line per
+ * command. Buckets are [lowest value in ns, count] pairs, the same for
+ * every session, so files from many machines add up bucket by bucket.
+ */
+void stats_save()
+{
+	const char *file = getenv("SEASHELL_STATS");
+	if (file == NULL || file[0] == 0)
+		return;
+	FILE *f = fopen(file, "a");
+	if (f == NULL) {
+		printf("-%s: %s: %s\n", sysname, file, strerror(errno));
+		return;
+	}
+	long now = (long)time(NULL);
+	for (int i = 0; i < STATS_COMMANDS; i++) {
+		struct command_stats *cs = &stats_table[i];
+		if (cs->wall.total == 0)
+			continue;
+		fprintf(f, "{\"session\":%d,\"time\":%ld,\"command\":", (int)getpid(), now);
+		json_string(f, cs->name);
+		fprintf(f, ",\"sub_bits\":%d", HIST_SUB_BITS);
+		stats_json_hist(f, "wall_ns", &cs->wall);
+		stats_json_hist(f, "spawn_ns", &cs->spawn);
+		fprintf(f, ",\"exits\":{");
+		int first = 1;
+		for (int code = 0; code < 256; code++)
+			if (cs->exits[code]) {
+				fprintf(f, "%s\"%d\":%u", first ? "" : ",", code, cs->exits[code]);
+				first = 0;
+			}
+		fprintf(f, "}}\n");
+	}
+	fclose(f);
+}
+
+//VARIABLES AND THE ENVIRONMENT
+//name=value sets a shell variable, export puts it in the environment of
+//the programs the shell starts (see var_environ). Assignments before a
+//command are exported for that command only.
+
+/**
+ * Run a command with the name=value words in front of it in its
+ * environment, then put the variables back as they were. With nothing
+ * after them the assignments are permanent.
+ */
+int assign_command(struct command_t *command, history *h, shortdir *shortdirs)
+{
+	struct { int slot; char *value; bool exported; } saved[64];
+	int n = 0;
+	while (n < 64) {
+		int len = var_assignment(command->name);
+		if (len == 0)
+			break;
+		int slot = var_slot(command->name, len);
+		saved[n].slot = slot;
+		saved[n].value = var_get(slot) ? strdup(var_get(slot)) : NULL;
+		saved[n++].exported = shellvars.v[slot].exported;
+		var_set(slot, command->name + len + 1);
+
+		//the first argument becomes the command
+		free(command->name);
+		if (command->arg_count == 0) {
+			command->name = strdup("");
+			break;
+		}
+		command->name = command->args[0];
+		for (int i = 1; i < command->arg_count; i++)
+			command->args[i - 1] = command->args[i];
+		command->args[--command->arg_count] = NULL;
+	}
+	if (command->name[0] == 0) {
+		for (int i = 0; i < n; i++)
+			free(saved[i].value);
+		last_status = 0;
+		return SUCCESS;
+	}
+
+	for (int i = 0; i < n; i++)
+		var_export(saved[i].slot, true);
+	int code = process_command(command, h, shortdirs);
+	for (int i = n - 1; i >= 0; i--) {
+		var_set(saved[i].slot, saved[i].value);
+		var_export(saved[i].slot, saved[i].exported);
+		free(saved[i].value);
+	}
+	return code;
+}
+
+static int var_valid_name(const char *name, int len)
+{
+	if (len == 0 || isdigit((unsigned char)name[0]))
+		return 0;
+	for (int i = 0; i < len; i++)
+		if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+			return 0;
+	return 1;
+}
+
+/**
+ * export [-n] [name[=value]...], with no names the exported variables
+ * are listed in a form the shell reads back
+ */
+int export_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	char **args = command->args + 1;
+	bool unexport = false;
+	if (*args && strcmp(*args, "-n") == 0) {
+		unexport = true;
+		args++;
+	}
+	if (*args == NULL) {
+		for (int i = 0; i < shellvars.n; i++) {
+			struct shell_var *v = &shellvars.v[i];
+			if (!v->exported)
+				continue;
+			fprintf(ctx->out, "export %s", v->name);
+			if (v->value) {
+				fprintf(ctx->out, "=\"");
+				for (const char *c = v->value; *c; c++) {
+					if (*c == '"' || *c == '\\' || *c == '$' || *c == '`')
+						fputc('\\', ctx->out);
+					fputc(*c, ctx->out);
+				}
+				fputc('"', ctx->out);
+			}
+			fputc('\n', ctx->out);
+		}
+		return SUCCESS;
+	}
+
+	int status = SUCCESS;
+	for (; *args; args++) {
+		const char *eq = strchr(*args, '=');
+		int len = eq ? eq - *args : (int)strlen(*args);
+		if (!var_valid_name(*args, len)) {
+			fprintf(ctx->err, "-%s: export: `%s': not a valid identifier\n", sysname, *args);
+			status = EXIT_FAILURE;
+			continue;
+		}
+		int slot = var_slot(*args, len);
+		if (eq)
+			var_set(slot, eq + 1);
+		var_export(slot, !unexport);
+	}
+	return status;
+}
+
+/**
+ * unset name..., the variables are removed from the environment too
+ */
+int unset_command(struct command_t *command, struct builtin_ctx *ctx)
+{
+	int status = SUCCESS;
+	for (char **args = command->args + 1; *args; args++) {
+		if (!var_valid_name(*args, strlen(*args))) {
+			fprintf(ctx->err, "-%s: unset: `%s': not a valid identifier\n", sysname, *args);
+			status = EXIT_FAILURE;
+			continue;
+		}
+		int slot = var_slot(*args, strlen(*args));
+		var_set(slot, NULL);
+		var_export(slot, false);
+	}
+	return status;
+}